@@ -0,0 +1,93 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#ifndef __VAKit_DeviceCapabilities_h
+#define __VAKit_DeviceCapabilities_h
+
+#include "XSDK/Types.h"
+#include "XSDK/XString.h"
+
+#include <vector>
+
+extern "C"
+{
+#include <va/va.h>
+}
+
+// What a VA device can do, probed once per device path and cached for the life of
+// the process, so capability checks on stream open are a map lookup rather than a
+// full vaInitialize() / vaCreateConfig() / vaTerminate() round trip.
+
+namespace VAKit
+{
+
+struct ProfileCapabilities
+{
+    VAProfile profile;
+    std::vector<VAEntrypoint> entrypoints;
+};
+
+// H.264 High profile decode (VLD) or encode (EncSlice). supported is only set when
+// a config VAH264Decoder / VAH264Encoder would use could actually be created.
+// Limits the driver does not report are 0.
+struct CodecCapabilities
+{
+    bool supported;
+    uint32_t rtFormats;
+    uint32_t maxWidth;
+    uint32_t maxHeight;
+};
+
+struct DeviceCapabilities
+{
+    // False if the device could not be opened or initialized, in which case nothing
+    // else is filled in.
+    bool available;
+    int majorVersion;
+    int minorVersion;
+    XSDK::XString vendor;
+
+    std::vector<struct ProfileCapabilities> profiles;
+
+    struct CodecCapabilities h264Decode;
+    struct CodecCapabilities h264Encode;
+
+    // Encode attributes, as the raw VA attribute values (VA_RC_* and
+    // VA_ENC_PACKED_HEADER_* bits for the first two). 0 where unsupported.
+    uint32_t rateControlModes;
+    uint32_t packedHeaders;
+    uint32_t maxRefFrames;
+    uint32_t roi;
+    uint32_t intraRefresh;
+
+    // The fourccs vaCreateImage() accepts.
+    std::vector<uint32_t> imageFormats;
+};
+
+// Returns the capabilities of devicePath, probing the device the first time it is
+// asked for. A device found unavailable is probed again once that answer is a few
+// seconds old. Thread safe.
+X_API struct DeviceCapabilities GetDeviceCapabilities( const XSDK::XString& devicePath );
+
+// True if the device lists entrypoint for profile.
+X_API bool HasEntrypoint( const struct DeviceCapabilities& caps, VAProfile profile, VAEntrypoint entrypoint );
+
+// The rate control VAH264Encoder configures on a device with these capabilities:
+// CBR, else VBR, else CQP.
+X_API uint32_t ChooseRateControl( const struct DeviceCapabilities& caps );
+
+// Forgets every cached device, so the next query probes again (after a driver
+// reload or a device being added, say).
+X_API void ClearDeviceCapabilities();
+
+}
+
+#endif
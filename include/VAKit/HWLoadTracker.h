@@ -0,0 +1,87 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#ifndef __VAKit_HWLoadTracker_h
+#define __VAKit_HWLoadTracker_h
+
+#include "XSDK/Types.h"
+#include "XSDK/XMutex.h"
+#include "XSDK/XString.h"
+
+#include <map>
+
+namespace VAKit
+{
+
+// The measured load of the hardware channels on each device, which the hybrid
+// encoder and decoder place channels by (each keeps its own, as encode and decode
+// run on different parts of the GPU).
+//
+// Each channel reports the fraction of real time its work on the device takes, and
+// a device's load is the sum over its channels. A device also learns its cost per
+// pixel, so the load a channel would add can be estimated before it is placed there.
+// Thread safe.
+
+class HWLoadTracker
+{
+public:
+    X_API HWLoadTracker( double budget );
+
+    X_API virtual ~HWLoadTracker() throw();
+
+    // The fraction of a device's capacity (1.0 == fully busy) channels may use.
+    X_API void SetBudget( double budget );
+    X_API double GetBudget() const;
+
+    X_API double GetLoad( const XSDK::XString& devicePath ) const;
+
+    X_API bool OverBudget( const XSDK::XString& devicePath ) const;
+
+    // True if a channel of pixels per frame, with frameInterval seconds between
+    // frames, would keep the device within fraction of the budget. Until some channel
+    // on the device has been measured we have nothing to go on, so it fits.
+    X_API bool Fits( const XSDK::XString& devicePath,
+                     double pixels,
+                     double frameInterval,
+                     double fraction = 1.0 ) const;
+
+    X_API void AddChannel( const XSDK::XString& devicePath );
+
+    // Takes the channel's last reported load off the device.
+    X_API void RemoveChannel( const XSDK::XString& devicePath, double reportedLoad );
+
+    // Replaces the load the channel last reported with load, and folds seconds spent
+    // on a frame of pixels into the device's cost per pixel.
+    X_API void Report( const XSDK::XString& devicePath,
+                       double load,
+                       double reportedLoad,
+                       double seconds,
+                       double pixels );
+
+private:
+    HWLoadTracker( const HWLoadTracker& obj );
+    HWLoadTracker& operator = ( const HWLoadTracker& );
+
+    struct DeviceLoad
+    {
+        double load;
+        double secondsPerPixel;
+        int channels;
+    };
+
+    mutable XSDK::XMutex _lock;
+    std::map<XSDK::XString, struct DeviceLoad> _devices;
+    double _budget;
+};
+
+}
+
+#endif
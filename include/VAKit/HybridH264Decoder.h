@@ -0,0 +1,123 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#ifndef __VAKit_HybridH264Decoder_h
+#define __VAKit_HybridH264Decoder_h
+
+#include "XSDK/Types.h"
+#include "XSDK/XString.h"
+#include "AVKit/Options.h"
+#include "AVKit/Decoder.h"
+#include "AVKit/Packet.h"
+#include "VAKit/HWLoadTracker.h"
+
+#include <list>
+#include <vector>
+
+namespace VAKit
+{
+
+class VAH264Decoder;
+
+// HybridH264Decoder decodes on the GPU with VAH264Decoder while the device has
+// capacity, and with AVKit::H264Decoder otherwise (including when HasHW() fails).
+//
+// Placement works like HybridH264Encoder's. Each hardware stream reports the
+// fraction of real time its decodes and readbacks take, the sum over a device is its
+// load, and streams go to software when the device would exceed the HW budget.
+// Streams only move between hardware and software on IDR pictures. The SPS and PPS
+// last seen are replayed to the new decoder if the IDR packet does not carry them,
+// and pictures still held by the old decoder are drained first, so none are lost.
+// A stream whose hardware decode fails stays in software for a while before it is
+// offered the device again.
+//
+// Input must be Annex B.
+
+class HybridH264Decoder : public AVKit::Decoder
+{
+public:
+    X_API HybridH264Decoder( const struct AVKit::CodecOptions& options );
+
+    X_API virtual ~HybridH264Decoder() throw();
+
+    X_API virtual void Decode( XIRef<AVKit::Packet> frame );
+
+    X_API virtual uint16_t GetInputWidth() const;
+    X_API virtual uint16_t GetInputHeight() const;
+
+    X_API virtual void SetOutputWidth( uint16_t outputWidth );
+    X_API virtual uint16_t GetOutputWidth() const;
+
+    X_API virtual void SetOutputHeight( uint16_t outputHeight );
+    X_API virtual uint16_t GetOutputHeight() const;
+
+    X_API virtual XIRef<AVKit::Packet> Get();
+
+    // Pictures ready for Get(), counting those drained from a decoder the stream
+    // moved away from.
+    X_API size_t GetNumPictures() const;
+
+    // Drains the hardware decoder's reorder buffer at the end of the stream. The
+    // software decoder hands each picture out as it is decoded, so has nothing to
+    // flush.
+    X_API void Flush();
+
+    X_API bool IsHW() const;
+
+    // The fraction of a device's decode capacity (1.0 == fully busy) that hardware
+    // streams may use before new or migrating streams are placed in software.
+    X_API static void SetHWBudget( double budget );
+    X_API static double GetHWBudget();
+
+    // Current measured decode load on devicePath.
+    X_API static double GetHWLoad( const XSDK::XString& devicePath );
+
+private:
+    HybridH264Decoder( const HybridH264Decoder& obj );
+    HybridH264Decoder& operator = ( const HybridH264Decoder& );
+
+    bool _ScanPacket( XIRef<AVKit::Packet> frame, bool& hasSPS );
+    XIRef<AVKit::Packet> _WithParameterSets( XIRef<AVKit::Packet> frame );
+    void _Feed( XIRef<AVKit::Packet> frame, bool hasSPS );
+    bool _TryStartHW();
+    bool _InHWBackoff();
+    void _StartSW();
+    void _StopHW();
+    void _ApplyOutputSize();
+    void _UpdateLoad( double decodeSeconds );
+
+    struct AVKit::CodecOptions _options;
+    XSDK::XString _devicePath;
+    AVKit::Decoder* _decoder;
+    VAH264Decoder* _hwDecoder;
+    bool _isHW;
+    bool _fresh;
+    bool _waitForIDR;
+    bool _swPicture;
+    bool _hwFailed;
+    uint64_t _hwFailedAt;
+    double _frameInterval;
+    double _avgDecodeSeconds;
+    double _reportedLoad;
+    double _getSeconds;
+    double _pixels;
+    uint16_t _outputWidth;
+    uint16_t _outputHeight;
+    std::vector<uint8_t> _sps;
+    std::vector<uint8_t> _pps;
+    std::list<XIRef<AVKit::Packet> > _pending;
+
+    static HWLoadTracker _loads;
+};
+
+}
+
+#endif
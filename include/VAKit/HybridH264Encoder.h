@@ -0,0 +1,111 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#ifndef __VAKit_HybridH264Encoder_h
+#define __VAKit_HybridH264Encoder_h
+
+#include "XSDK/Types.h"
+#include "XSDK/XMemory.h"
+#include "XSDK/XString.h"
+#include "AVKit/Options.h"
+#include "AVKit/FrameTypes.h"
+#include "AVKit/Encoder.h"
+#include "AVKit/Packet.h"
+#include "VAKit/HWLoadTracker.h"
+
+namespace VAKit
+{
+
+// HybridH264Encoder encodes on the GPU with VAH264Encoder while the device has
+// capacity, and with AVKit::H264Encoder (libx264) otherwise. Both encoders are
+// configured from the same CodecOptions.
+//
+// Placement is driven by measured encode time. Each hardware channel reports
+// the fraction of real time its encodes take (encode time / frame interval), and
+// the sum over all channels on a device is that device's load. New channels go to
+// software when the device load would exceed the HW budget. Channels move between
+// hardware and software only on key frames, and the new encoder starts with an IDR
+// carrying its own SPS/PPS. libx264 and the hardware encoder do not write the same
+// SPS/PPS, so GetExtraData() can change when a channel moves; ExtraDataChanged()
+// says when. A channel whose hardware encode fails stays in software for a while
+// before it is offered the device again.
+
+class HybridH264Encoder : public AVKit::Encoder
+{
+public:
+    X_API HybridH264Encoder( const struct AVKit::CodecOptions& options,
+                             bool annexB = true );
+
+    X_API virtual ~HybridH264Encoder() throw();
+
+    X_API virtual void EncodeYUV420P( XIRef<AVKit::Packet> input,
+                                      AVKit::FrameType type = AVKit::FRAME_TYPE_AUTO_GOP );
+
+    X_API virtual XIRef<AVKit::Packet> Get();
+
+    X_API virtual bool LastWasKey() const;
+
+    X_API virtual struct AVKit::CodecOptions GetOptions() const;
+
+    X_API virtual XIRef<XSDK::XMemory> GetExtraData() const;
+
+    // True if the frame just encoded was the first from a new encoder whose
+    // extradata differs from the previous encoder's. Anything that stored the old
+    // extradata (a container header, say) has to pick up the new one, starting a new
+    // file or segment at this key frame.
+    X_API bool ExtraDataChanged() const;
+
+    X_API bool IsHW() const;
+
+    // The fraction of a device's encode capacity (1.0 == fully busy) that hardware
+    // channels may use before new or migrating channels are placed in software.
+    X_API static void SetHWBudget( double budget );
+    X_API static double GetHWBudget();
+
+    // Current measured load on devicePath.
+    X_API static double GetHWLoad( const XSDK::XString& devicePath );
+
+private:
+    HybridH264Encoder( const HybridH264Encoder& obj );
+    HybridH264Encoder& operator = ( const HybridH264Encoder& );
+
+    static bool _SameExtraData( XIRef<XSDK::XMemory> a, XIRef<XSDK::XMemory> b );
+    bool _IsKeyFrame( AVKit::FrameType type ) const;
+    double _Pixels() const;
+    bool _TryStartHW();
+    bool _InHWBackoff();
+    void _StartSW();
+    void _StopHW();
+    void _UpdateLoad( double encodeSeconds );
+
+    struct AVKit::CodecOptions _options;
+    bool _annexB;
+    XSDK::XString _devicePath;
+    AVKit::Encoder* _encoder;
+    bool _isHW;
+    double _frameInterval;
+    double _avgEncodeSeconds;
+    double _reportedLoad;
+    uint32_t _gopSize;
+    uint32_t _frameNum;
+    bool _lastWasKey;
+    XIRef<XSDK::XMemory> _extraData;
+    bool _newEncoder;
+    bool _extraDataChanged;
+    bool _hwFailed;
+    uint64_t _hwFailedAt;
+
+    static HWLoadTracker _loads;
+};
+
+}
+
+#endif
@@ -0,0 +1,152 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#ifndef __VAKit_KeyFrameCache_h
+#define __VAKit_KeyFrameCache_h
+
+#include "XSDK/Types.h"
+#include "XSDK/XString.h"
+#include "XSDK/XMutex.h"
+#include "XSDK/XCondition.h"
+#include "AVKit/Options.h"
+#include "AVKit/Packet.h"
+#include "VAKit/VAH264Decoder.h"
+
+#include <list>
+#include <map>
+#include <vector>
+
+namespace VAKit
+{
+
+const size_t DEFAULT_KEY_FRAME_CACHE_BYTES = 256 * 1024 * 1024;
+const size_t DEFAULT_KEY_FRAME_CACHE_DECODERS = 2;
+
+struct KeyFrameCacheStats
+{
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;
+    size_t memoryBudget;
+    size_t decoders;
+};
+
+// KeyFrameCache serves decoded (and scaled) key frames for thumbnails and timeline
+// scrubbing, where the same pictures are asked for over and over.
+//
+// Pictures are cached by stream id, PTS, output size and output format, least
+// recently used first out once the cache holds more than its memory budget. A hit
+// never touches a decoder. A miss decodes on one of a small pool of VAH264Decoders
+// that are kept running between requests (preferring one that last decoded the
+// same stream), so it does not pay for bringing a decoder and its VA device up.
+//
+// Pictures handed out are shared with the cache and must not be modified. Thread
+// safe. Misses for different keys decode concurrently, up to the number of
+// decoders.
+
+class KeyFrameCache
+{
+public:
+    X_API KeyFrameCache( const struct AVKit::CodecOptions& options,
+                         size_t memoryBudget = DEFAULT_KEY_FRAME_CACHE_BYTES,
+                         size_t maxDecoders = DEFAULT_KEY_FRAME_CACHE_DECODERS );
+
+    X_API virtual ~KeyFrameCache() throw();
+
+    // Returns the picture of frame, an Annex B IDR access unit carrying its SPS and
+    // PPS (as AVDeMuxer's Annex B filter produces), at width x height (0 for the
+    // picture's own size) in format.
+    X_API XIRef<AVKit::Packet> Get( const XSDK::XString& streamID,
+                                    int64_t pts,
+                                    XIRef<AVKit::Packet> frame,
+                                    uint16_t width,
+                                    uint16_t height,
+                                    OutputFormat format = OUTPUT_FORMAT_I420 );
+
+    // Returns the cached picture, or an empty ref without counting a miss, so callers
+    // can skip reading the frame from storage on a hit.
+    X_API XIRef<AVKit::Packet> Find( const XSDK::XString& streamID,
+                                     int64_t pts,
+                                     uint16_t width,
+                                     uint16_t height,
+                                     OutputFormat format = OUTPUT_FORMAT_I420 );
+
+    // Drops every cached picture of the stream (when its recording is deleted, say).
+    X_API void Remove( const XSDK::XString& streamID );
+
+    X_API void Clear();
+
+    // Evicts straight away if the cache is over the new budget.
+    X_API void SetMemoryBudget( size_t memoryBudget );
+
+    X_API struct KeyFrameCacheStats GetStats() const;
+
+private:
+    KeyFrameCache( const KeyFrameCache& obj );
+    KeyFrameCache& operator = ( const KeyFrameCache& );
+
+    struct Key
+    {
+        XSDK::XString streamID;
+        int64_t pts;
+        uint16_t width;
+        uint16_t height;
+        OutputFormat format;
+
+        bool operator < ( const struct Key& other ) const;
+    };
+
+    struct Entry
+    {
+        struct Key key;
+        XIRef<AVKit::Packet> picture;
+        size_t size;
+    };
+
+    struct PooledDecoder
+    {
+        VAH264Decoder* decoder;
+        XSDK::XString streamID;
+    };
+
+    XIRef<AVKit::Packet> _Find( const struct Key& key );
+    XIRef<AVKit::Packet> _Insert( const struct Key& key, XIRef<AVKit::Packet> picture );
+    void _Evict();
+    void _Erase( std::list<struct Entry>::iterator entry );
+    struct PooledDecoder _TakeDecoder( const XSDK::XString& streamID );
+    void _ReturnDecoder( const struct PooledDecoder& decoder );
+    XIRef<AVKit::Packet> _Decode( struct PooledDecoder& decoder, const struct Key& key, XIRef<AVKit::Packet> frame );
+
+    struct AVKit::CodecOptions _options;
+
+    mutable XSDK::XMutex _lock;
+    XSDK::XCondition _decoderCond;
+
+    // Most recently used first.
+    std::list<struct Entry> _entries;
+    std::map<struct Key, std::list<struct Entry>::iterator> _index;
+    size_t _bytes;
+    size_t _memoryBudget;
+
+    std::vector<struct PooledDecoder> _idleDecoders;
+    size_t _numDecoders;
+    size_t _maxDecoders;
+
+    size_t _hits;
+    size_t _misses;
+    size_t _evictions;
+};
+
+}
+
+#endif
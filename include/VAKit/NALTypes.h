@@ -13,6 +13,7 @@
 #define __VAKit_NALTypes_h
 
 #include "VAKit/BitStream.h"
+#include <vector>
 
 #ifndef WIN32
 
@@ -27,6 +28,58 @@ extern "C"
 namespace VAKit
 {
 
+static const int NAL_NON_IDR = 1;
+static const int NAL_IDR = 5;
+static const int NAL_SEI = 6;
+static const int NAL_SPS = 7;
+static const int NAL_PPS = 8;
+static const int NAL_AUD = 9;
+
+// A NAL unit inside an Annex B buffer. start points at its start code, data at the
+// NAL header byte just past it, and size (counted from data) runs up to the next
+// start code.
+struct NALUnit
+{
+    const uint8_t* start;
+    const uint8_t* data;
+    size_t size;
+    int32_t type;
+    int32_t refIDC;
+};
+
+// Appends every NAL unit found in the Annex B buffer p to units, in order.
+void FindNALUnits( const uint8_t* p, size_t size, std::vector<NALUnit>& units );
+
+// The SPS fields the rest of VAKit needs.
+struct SPSInfo
+{
+    int32_t profileIDC;
+    uint32_t log2MaxFrameNum;
+    uint32_t picOrderCntType;
+    uint32_t log2MaxPicOrderCntLsb;
+    uint32_t maxNumRefFrames;
+    bool separateColourPlane;
+    bool frameMBSOnly;
+};
+
+// Parses the SPS NAL unit. Returns false if unit is not an SPS or is truncated.
+bool ParseSPS( const NALUnit& unit, SPSInfo& sps );
+
+// The start of a slice header, up to pic_order_cnt_lsb. idrPicID is only set for
+// IDR slices and picOrderCntLsb only for pic_order_cnt_type 0.
+struct SliceInfo
+{
+    uint32_t firstMB;
+    uint32_t sliceType;
+    uint32_t frameNum;
+    uint32_t idrPicID;
+    uint32_t picOrderCntLsb;
+};
+
+// Parses the header of an IDR or non IDR slice NAL unit, given the SPS it refers to.
+// Returns false if unit is not a slice or is truncated.
+bool ParseSliceHeader( const NALUnit& unit, const SPSInfo& sps, SliceInfo& slice );
+
 #ifndef WIN32
 int BuildPackedPicBuffer( BitStream& bs,
                           VAEncPictureParameterBufferH264& pps,
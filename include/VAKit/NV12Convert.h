@@ -0,0 +1,174 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#ifndef __VAKit_NV12Convert_h
+#define __VAKit_NV12Convert_h
+
+#include "XSDK/Types.h"
+
+#include <vector>
+
+// Conversions out of the NV12 pictures VA-API decodes into. The inner loops have
+// SSE2, AVX2 and NEON versions (where they help), and the best one for the running
+// CPU is picked the first time a conversion is used.
+
+namespace VAKit
+{
+
+// Splits count interleaved UV pairs into separate U and V rows.
+X_API void DeinterleaveUV( const uint8_t* uv, uint8_t* u, uint8_t* v, size_t count );
+
+// Copies an NV12 picture into the I420 planes dest[0] (Y), dest[1] (U) and dest[2]
+// (V), each destPitches[i] bytes per row. width and height must be even.
+X_API void NV12ToI420( const uint8_t* y,
+                       size_t yPitch,
+                       const uint8_t* uv,
+                       size_t uvPitch,
+                       uint16_t width,
+                       uint16_t height,
+                       uint8_t* const dest[3],
+                       const size_t destPitches[3] );
+
+// Converts an NV12 picture to BGR24 (bytesPerPixel 3) or BGRA (bytesPerPixel 4, with
+// alpha 255) rows destPitch bytes apart, using BT.601. fullRange selects full (JPEG)
+// range input instead of video range. width and height must be even.
+X_API void NV12ToBGR( const uint8_t* y,
+                      size_t yPitch,
+                      const uint8_t* uv,
+                      size_t uvPitch,
+                      uint16_t width,
+                      uint16_t height,
+                      uint8_t* dest,
+                      size_t destPitch,
+                      size_t bytesPerPixel,
+                      bool fullRange );
+
+// Converts NV12 pictures to I420, Y8 (luma only) or BGR at another size, reading each
+// source row once and writing the output directly. Exact halves and quarters are
+// box filtered, any other ratio is bilinear. Output width and height must be even.
+// An NV12Scaler keeps per picture scratch rows, so it is not thread safe.
+class NV12Scaler
+{
+public:
+    X_API NV12Scaler( uint16_t inputWidth,
+                      uint16_t inputHeight,
+                      uint16_t outputWidth,
+                      uint16_t outputHeight );
+
+    X_API virtual ~NV12Scaler() throw();
+
+    // dest receives the I420 planes at the output size, as with NV12ToI420().
+    X_API void ToI420( const uint8_t* y,
+                       size_t yPitch,
+                       const uint8_t* uv,
+                       size_t uvPitch,
+                       uint8_t* const dest[3],
+                       const size_t destPitches[3] );
+
+    // dest receives only the luma plane at the output size. Chroma is never read.
+    X_API void ToY8( const uint8_t* y, size_t yPitch, uint8_t* dest, size_t destPitch );
+
+    // dest receives BGR24 or BGRA at the output size, as with NV12ToBGR().
+    X_API void ToBGR( const uint8_t* y,
+                      size_t yPitch,
+                      const uint8_t* uv,
+                      size_t uvPitch,
+                      uint8_t* dest,
+                      size_t destPitch,
+                      size_t bytesPerPixel,
+                      bool fullRange );
+
+    X_API uint16_t GetInputWidth() const;
+    X_API uint16_t GetInputHeight() const;
+    X_API uint16_t GetOutputWidth() const;
+    X_API uint16_t GetOutputHeight() const;
+
+private:
+    NV12Scaler( const NV12Scaler& obj );
+    NV12Scaler& operator = ( const NV12Scaler& );
+
+    enum Method
+    {
+        METHOD_COPY,
+        METHOD_HALF,
+        METHOD_QUARTER,
+        METHOD_BILINEAR
+    };
+
+    enum Component
+    {
+        COMPONENT_Y,
+        COMPONENT_U,
+        COMPONENT_V
+    };
+
+    // Chroma rows are deinterleaved into this many slots (enough for the four
+    // source rows a quarter scale reads per output row).
+    static const size_t NUM_CHROMA_SLOTS = 4;
+
+    struct Plane
+    {
+        size_t inputWidth;
+        size_t inputHeight;
+        size_t outputWidth;
+        size_t outputHeight;
+        Method method;
+        std::vector<uint32_t> xIndex;
+        std::vector<uint32_t> xNext;
+        std::vector<uint16_t> xWeight;
+        std::vector<uint32_t> yIndex;
+        std::vector<uint32_t> yNext;
+        std::vector<uint16_t> yWeight;
+    };
+
+    static void _InitPlane( Plane& plane,
+                            size_t inputWidth,
+                            size_t inputHeight,
+                            size_t outputWidth,
+                            size_t outputHeight );
+
+    void _ResetRows();
+    const uint8_t* _GetRow( Component component, size_t row );
+    const uint8_t* _GetHorizontalRow( Component component, const Plane& plane, size_t row );
+    void _ScaleRow( Component component, const Plane& plane, size_t row, uint8_t* dest );
+
+    uint16_t _inputWidth;
+    uint16_t _inputHeight;
+    uint16_t _outputWidth;
+    uint16_t _outputHeight;
+    Plane _luma;
+    Plane _chroma;
+
+    const uint8_t* _y;
+    size_t _yPitch;
+    const uint8_t* _uv;
+    size_t _uvPitch;
+
+    std::vector<uint8_t> _chromaRows[NUM_CHROMA_SLOTS][2];
+    size_t _chromaRowIndex[NUM_CHROMA_SLOTS];
+
+    // Horizontally scaled rows for the bilinear method, two per component.
+    std::vector<uint8_t> _horizontalRows[3][2];
+    size_t _horizontalRowIndex[3][2];
+
+    std::vector<uint8_t> _quarterRows[2];
+
+    // Scaled Y, U and V rows waiting for BGR conversion.
+    std::vector<uint8_t> _bgrRows[3];
+};
+
+// The name of the instruction set the conversions run with ("avx2", "sse2", "neon"
+// or "c").
+X_API const char* GetConvertKernelName();
+
+}
+
+#endif
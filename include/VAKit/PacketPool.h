@@ -0,0 +1,108 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#ifndef __VAKit_PacketPool_h
+#define __VAKit_PacketPool_h
+
+#include "XSDK/Types.h"
+#include "XSDK/XIRef.h"
+#include "XSDK/XMutex.h"
+#include "AVKit/Packet.h"
+#include "AVKit/PacketFactory.h"
+
+#include <vector>
+
+namespace VAKit
+{
+
+const size_t DEFAULT_MAX_FREE_PACKETS = 16;
+
+enum PoolMemory
+{
+    POOL_MEMORY_DEFAULT,
+
+    // Buffers are 2MB aligned and marked for transparent huge pages, which cuts page
+    // faults and TLB misses on large pictures.
+    POOL_MEMORY_HUGE_PAGES,
+
+    // Buffers are mlock()ed, so they are faulted in once and never paged out.
+    POOL_MEMORY_LOCKED
+};
+
+struct PacketPoolStats
+{
+    size_t allocations;
+    size_t reuses;
+    size_t freeBuffers;
+    size_t outstanding;
+    size_t bytes;
+};
+
+// A PacketFactory that hands out packets backed by recycled buffers. When the last
+// reference to a packet goes away its buffer goes back to the pool (up to maxFree
+// idle buffers are kept), so a decoder producing same sized pictures stops
+// allocating picture memory once the pool has warmed up.
+//
+// Packets keep their pool alive, so a pool must be heap allocated and held through
+// an XIRef, as VAH264Decoder::SetPacketFactory() takes it. Thread safe.
+
+class PacketPool : public AVKit::PacketFactory
+{
+public:
+    X_API PacketPool( size_t maxFree = DEFAULT_MAX_FREE_PACKETS, PoolMemory memory = POOL_MEMORY_DEFAULT );
+
+    X_API virtual ~PacketPool() throw();
+
+    X_API virtual XIRef<AVKit::Packet> Get( size_t sz );
+
+    X_API struct PacketPoolStats GetStats() const;
+
+    // Frees every idle buffer.
+    X_API void Trim();
+
+private:
+    PacketPool( const PacketPool& obj );
+    PacketPool& operator = ( const PacketPool& );
+
+    struct Buffer
+    {
+        uint8_t* data;
+        size_t size;
+    };
+
+    class PooledPacket : public AVKit::Packet
+    {
+    public:
+        PooledPacket( PacketPool* pool, const struct Buffer& buffer, size_t sz );
+        virtual ~PooledPacket() throw();
+
+    private:
+        XIRef<PacketPool> _pool;
+        struct Buffer _buffer;
+    };
+
+    struct Buffer _Allocate( size_t size );
+    void _Free( struct Buffer& buffer );
+    void _Return( const struct Buffer& buffer );
+
+    mutable XSDK::XMutex _lock;
+    size_t _maxFree;
+    PoolMemory _memory;
+    std::vector<struct Buffer> _free;
+    size_t _allocations;
+    size_t _reuses;
+    size_t _outstanding;
+    size_t _bytes;
+};
+
+}
+
+#endif
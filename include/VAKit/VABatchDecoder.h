@@ -0,0 +1,110 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#ifndef __VAKit_VABatchDecoder_h
+#define __VAKit_VABatchDecoder_h
+
+#include "XSDK/Types.h"
+#include "XSDK/XString.h"
+#include "XSDK/XMutex.h"
+#include "XSDK/XCondition.h"
+#include "XSDK/XThread.h"
+#include "AVKit/Packet.h"
+#include "VAKit/VAH264Decoder.h"
+
+#include <vector>
+
+namespace VAKit
+{
+
+struct BatchItem
+{
+    VAH264Decoder* decoder;
+    XIRef<AVKit::Packet> packet;
+    int64_t pts;
+};
+
+// A picture (or, if error is not empty, a failed Decode() or Get()) produced by a
+// batch.
+struct BatchPicture
+{
+    VAH264Decoder* decoder;
+    XIRef<AVKit::Packet> picture;
+    int64_t pts;
+    bool key;
+    XSDK::XString error;
+};
+
+// VABatchDecoder decodes one packet for each of many streams per call, for nodes that
+// fan in large numbers of small streams.
+//
+// Every packet in a batch is submitted to the hardware before any picture is read
+// back, so the GPU works through the whole batch while the first readback waits and
+// later readbacks rarely wait at all. Readback and conversion are then spread over a
+// pool of threads, one decoder per thread at a time.
+//
+// Each decoder's readback thread is redundant here, so decoders used through a batch
+// are best given SetReadbackDepth( 1 ). A VABatchDecoder is not itself thread safe,
+// and decoders in a batch must not be used elsewhere while it runs.
+
+class VABatchDecoder
+{
+public:
+    // numThreads of 0 means one per online CPU.
+    X_API VABatchDecoder( size_t numThreads = 0 );
+
+    X_API virtual ~VABatchDecoder() throw();
+
+    // Decodes every item, then appends every picture the decoders have ready to
+    // output, grouped by decoder (in the order the decoders first appear in items)
+    // and in display order within each decoder. A decoder may appear more than once;
+    // if its output queue fills up in the middle of the batch it is read back on the
+    // calling thread, so no picture is lost.
+    X_API void Decode( const std::vector<struct BatchItem>& items, std::vector<struct BatchPicture>& output );
+
+    X_API size_t GetNumThreads() const;
+
+private:
+    VABatchDecoder( const VABatchDecoder& obj );
+    VABatchDecoder& operator = ( const VABatchDecoder& );
+
+    struct Job
+    {
+        VAH264Decoder* decoder;
+        std::vector<struct BatchPicture> pictures;
+    };
+
+    class Worker : public XSDK::XThread
+    {
+    public:
+        Worker( VABatchDecoder* parent );
+        virtual ~Worker() throw();
+
+        virtual void* EntryPoint();
+
+    private:
+        VABatchDecoder* _parent;
+    };
+
+    static void _Drain( struct Job& job );
+
+    XSDK::XMutex _lock;
+    XSDK::XCondition _cond;
+    std::vector<Worker*> _workers;
+    std::vector<struct Job> _jobs;
+    size_t _nextJob;
+    size_t _jobsDone;
+    bool _running;
+};
+
+}
+
+#endif
@@ -0,0 +1,179 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#ifndef __VAKit_VADecodeScheduler_h
+#define __VAKit_VADecodeScheduler_h
+
+#include "XSDK/Types.h"
+#include "XSDK/XString.h"
+#include "XSDK/XMutex.h"
+#include "XSDK/XCondition.h"
+#include "XSDK/XThread.h"
+#include "AVKit/Packet.h"
+#include "VAKit/VAH264Decoder.h"
+
+#include <deque>
+#include <list>
+#include <map>
+#include <vector>
+
+namespace VAKit
+{
+
+// VADecodeScheduler runs many VAH264Decoders on a fixed pool of worker threads,
+// instead of one thread per stream.
+//
+// Packets submitted for a stream wait in that stream's queue. A stream with packets
+// waiting sits in the ready queue of the worker that last ran it (so its decoder
+// stays warm in that worker's cache), and idle workers steal ready streams from the
+// other workers. A stream only ever runs on one worker at a time, so its decoder is
+// never touched by two threads at once and needs no locking of its own. Decoded
+// pictures are handed to the stream's callback on the worker thread.
+//
+// Decoders added to the scheduler must not be used directly until they are removed.
+//
+// A stream given a latency budget (or packets with deadlines) sheds load when it
+// falls behind, instead of letting its queue (and latency) grow without bound. A
+// packet that is decoded after its deadline puts the stream into SHED_NON_REFERENCE,
+// where pictures nothing refers to are dropped. A packet late by more than its whole
+// deadline puts it into SHED_TO_IDR, where everything up to the next IDR is dropped.
+// The stream goes back to decoding everything as soon as a packet is on time again.
+// Packets carrying parameter sets are never dropped.
+
+class VADecodeScheduler
+{
+public:
+    enum ShedLevel
+    {
+        SHED_NONE,
+        SHED_NON_REFERENCE,
+        SHED_TO_IDR
+    };
+
+    struct SheddingStats
+    {
+        ShedLevel level;
+        size_t nonReferenceDropped;
+        size_t nonKeyDropped;
+        size_t latePackets;
+    };
+
+    class Callback
+    {
+    public:
+        X_API virtual ~Callback() throw() {}
+
+        // Each picture the stream's decoder produces, in display order.
+        virtual void OnPicture( int stream, XIRef<AVKit::Packet> picture, int64_t pts, bool key ) = 0;
+
+        // Decode() or Get() threw. The stream carries on with its next packet.
+        virtual void OnError( int stream, const XSDK::XString& error ) = 0;
+
+        // A packet was dropped to shed load, at the given level.
+        virtual void OnDropped( int stream, int64_t pts, ShedLevel level ) {}
+    };
+
+    // If cpus is not empty, worker i is pinned to cpus[i % cpus.size()].
+    X_API VADecodeScheduler( size_t numWorkers, const std::vector<int>& cpus = std::vector<int>() );
+
+    X_API virtual ~VADecodeScheduler() throw();
+
+    // Neither the decoder nor the callback is owned by the scheduler. The decoder's
+    // readback depth is set to 1, so it reads back on the worker rather than on a
+    // thread of its own. Returns the id the other calls take.
+    X_API int AddStream( VAH264Decoder* decoder, Callback* callback );
+
+    // Waits for the stream's current turn on a worker to finish, then drops any
+    // packets it still has queued.
+    X_API void RemoveStream( int stream );
+
+    X_API void Submit( int stream, XIRef<AVKit::Packet> packet, int64_t pts = AV_NOPTS_VALUE );
+
+    // The packet must be decoded within deadline seconds from now (derived from its
+    // PTS by the caller, say), rather than within the stream's latency budget. It is
+    // shed if late even when the stream has no budget.
+    X_API void Submit( int stream, XIRef<AVKit::Packet> packet, int64_t pts, double deadline );
+
+    X_API size_t GetQueuedPackets( int stream ) const;
+
+    // Packets have latency budget seconds from arrival to be decoded. 0 (the
+    // default) turns load shedding off for packets without a deadline of their own.
+    X_API void SetLatencyBudget( int stream, double budget );
+    X_API double GetLatencyBudget( int stream ) const;
+
+    X_API struct SheddingStats GetSheddingStats( int stream ) const;
+
+private:
+    VADecodeScheduler( const VADecodeScheduler& obj );
+    VADecodeScheduler& operator = ( const VADecodeScheduler& );
+
+    struct QueuedPacket
+    {
+        XIRef<AVKit::Packet> packet;
+        int64_t pts;
+        uint64_t arrival;
+        double deadline; // < 0 means the stream's latency budget.
+    };
+
+    struct Stream
+    {
+        int id;
+        VAH264Decoder* decoder;
+        Callback* callback;
+        std::list<struct QueuedPacket> packets;
+        double latencyBudget;
+        struct SheddingStats shedding;
+        size_t worker;
+        bool ready;
+        bool running;
+        bool removed;
+    };
+
+    class Worker : public XSDK::XThread
+    {
+    public:
+        Worker( VADecodeScheduler* parent, size_t index, int cpu );
+        virtual ~Worker() throw();
+
+        virtual void* EntryPoint();
+
+    private:
+        VADecodeScheduler* _parent;
+        size_t _index;
+        int _cpu;
+    };
+
+    struct Stream* _FindStream( int stream ) const;
+    struct Stream* _NextStream( size_t worker );
+    void _MakeReady( struct Stream* stream );
+    void _Wake( size_t worker );
+    void _Run( struct Stream* stream,
+               std::list<struct QueuedPacket>& packets,
+               double latencyBudget,
+               struct SheddingStats& shedding );
+    static bool _Shed( const struct QueuedPacket& queued, double latencyBudget, struct SheddingStats& shedding );
+
+    mutable XSDK::XMutex _lock;
+    XSDK::XCondition _removeCond;
+    std::vector<Worker*> _workers;
+    // One per worker, so a stream made ready wakes one worker rather than all.
+    std::vector<XSDK::XCondition*> _wakeups;
+    std::vector<bool> _idle;
+    std::vector<std::deque<struct Stream*> > _readyQueues;
+    std::map<int, struct Stream*> _streams;
+    int _nextID;
+    size_t _nextWorker;
+    bool _running;
+};
+
+}
+
+#endif
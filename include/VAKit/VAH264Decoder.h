@@ -18,8 +18,16 @@
 #include "AVKit/Packet.h"
 #include "AVKit/PacketFactory.h"
 #include "XSDK/Types.h"
+#include "XSDK/XBaseObject.h"
 #include "XSDK/XMemory.h"
 #include "XSDK/XMutex.h"
+#include "XSDK/XCondition.h"
+#include "XSDK/XThread.h"
+#include "XSDK/XString.h"
+#include "VAKit/NV12Convert.h"
+
+#include <list>
+#include <vector>
 
 extern "C"
 {
@@ -35,26 +43,238 @@ extern "C"
 namespace VAKit
 {
 
+// A retired surface is one left over from before a resolution change. It is
+// destroyed as soon as its last reference goes away.
 struct HWSurface
 {
     VASurfaceID id;
     int refcount;
-    unsigned int order;
+    bool retired;
+};
+
+// The decoder starts with enough surfaces for the stream's reference frames, its
+// reorder delay and the pictures held for the caller, and grows by
+// SURFACE_POOL_GROWTH (recreating the VA context) whenever every surface is in use,
+// up to MAX_VA_SURFACES. Decoding fails rather than reuse a surface that is in use.
+static const size_t MAX_VA_SURFACES = 64;
+static const size_t SURFACE_POOL_GROWTH = 4;
+
+struct SurfacePoolStats
+{
+    size_t size;
+    size_t inUse;
+    size_t peakInUse;
+    size_t grows;
+};
+
+// The most pictures that can wait for Get(). When the queue is full the oldest
+// picture is dropped.
+static const size_t MAX_OUTPUT_PICTURES = 4;
+
+// The most readback images Get() keeps in flight (see SetReadbackDepth()).
+static const size_t MAX_READBACK_DEPTH = 4;
+
+// Pixel formats Get() can produce. Y8 is the luma plane alone, and the chroma plane is
+// never read for it. BGR24 and BGRA are converted with BT.601, full range when
+// jpeg_source is set. BGRA alpha is 255.
+enum OutputFormat
+{
+    OUTPUT_FORMAT_I420,
+    OUTPUT_FORMAT_NV12,
+    OUTPUT_FORMAT_Y8,
+    OUTPUT_FORMAT_BGR24,
+    OUTPUT_FORMAT_BGRA
+};
+
+// How Get() scales pictures to the output size. SCALER_BICUBIC uses swscale.
+// SCALER_FAST reads the mapped picture once with NV12Scaler (box filtered halves and
+// quarters, bilinear otherwise), which is much cheaper and fine for analytics.
+enum ScalerType
+{
+    SCALER_BICUBIC,
+    SCALER_FAST
+};
+
+// Which packets Decode() lets through to the hardware. DECODE_REFERENCE drops
+// pictures nothing else predicts from (nal_ref_idc 0), and DECODE_KEY everything but
+// IDR pictures. Packets are inspected before they reach libavcodec, so dropped
+// ones cost nothing on the GPU.
+enum DecodeMode
+{
+    DECODE_ALL,
+    DECODE_REFERENCE,
+    DECODE_KEY
+};
+
+// What the decoder does about corrupt input. ERROR_POLICY_THROW throws from Decode()
+// and Get(). ERROR_POLICY_RESYNC counts the bad packet, drops packets up to the next
+// IDR (unless error concealment is on), and has Get() skip pictures that fail to
+// read back, so a lossy link never needs the decoder rebuilt.
+enum ErrorPolicy
+{
+    ERROR_POLICY_THROW,
+    ERROR_POLICY_RESYNC
 };
 
-static const int NUM_VA_BUFFERS = 16;
+// Queued pictures stay in their surface (which holds an extra reference for them)
+// until Get() reads them back, so pictures that are never asked for cost no copy.
+struct DecodedPicture
+{
+    struct HWSurface* surface;
+    int64_t pts;
+    bool key;
+};
+
+// A rectangle of the decoded picture that GetRegionPictures() reads back on its own.
+// x, y, width and height must be even. The region is scaled to outputWidth x
+// outputHeight, or kept at its own size where those are 0.
+struct Region
+{
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+    uint16_t outputWidth;
+    uint16_t outputHeight;
+};
+
+class VAH264Decoder;
+
+// The VA display a decoder and its NV12Frames share. The display is terminated (and
+// its device closed) only when the decoder and the last of its frames are gone.
+// decoder is cleared, under lock, when the decoder is destroyed, after which frames
+// free their surfaces themselves.
+class SharedVADisplay : public XSDK::XBaseObject
+{
+public:
+    SharedVADisplay( int fd, VADisplay display );
+    virtual ~SharedVADisplay() throw();
+
+    int fd;
+    VADisplay display;
+    XSDK::XMutex lock;
+    VAH264Decoder* decoder;
+
+private:
+    SharedVADisplay( const SharedVADisplay& obj );
+    SharedVADisplay& operator = ( const SharedVADisplay& );
+};
+
+// A decoded picture mapped straight out of its VA surface with vaDeriveImage(). The
+// surface stays referenced, so the decoder will not reuse it, until the last XIRef
+// to the frame is released. Frames may outlive their decoder; the surface and the
+// VA display are then freed with the last frame.
+class NV12Frame : public XSDK::XBaseObject
+{
+public:
+    X_API virtual ~NV12Frame() throw();
+
+    X_API const uint8_t* GetY() const;
+    X_API const uint8_t* GetUV() const;
+    X_API size_t GetYPitch() const;
+    X_API size_t GetUVPitch() const;
+
+    X_API uint16_t GetWidth() const;
+    X_API uint16_t GetHeight() const;
+
+    X_API int64_t GetPTS() const;
+    X_API bool IsKey() const;
+
+private:
+    friend class VAH264Decoder;
+
+    NV12Frame( XIRef<SharedVADisplay> display,
+               const VAImageFormat& nv12Format,
+               struct HWSurface* surface,
+               uint16_t width,
+               uint16_t height,
+               int64_t pts,
+               bool key );
+
+    NV12Frame( const NV12Frame& obj );
+    NV12Frame& operator = ( const NV12Frame& );
+
+    XIRef<SharedVADisplay> _display;
+    struct HWSurface* _surface;
+    VAImage _image;
+    uint8_t* _base;
+    uint16_t _width;
+    uint16_t _height;
+    int64_t _pts;
+    bool _key;
+};
 
 class VAH264Decoder : public AVKit::Decoder
 {
 public:
     X_API VAH264Decoder( const struct AVKit::CodecOptions& options );
-    X_API VAH264Decoder( AVKit::AVDeMuxer& deMuxer, const struct AVKit::CodecOptions& options );
+    // With prewarm set, the decoder is brought up from the stream's extradata right
+    // away (see Prewarm()).
+    X_API VAH264Decoder( AVKit::AVDeMuxer& deMuxer,
+                         const struct AVKit::CodecOptions& options,
+                         bool prewarm = false );
     X_API virtual ~VAH264Decoder() throw();
 
     X_API static bool HasHW( const XSDK::XString& devicePath );
 
+    // Builds the whole pipeline (libavcodec, VA display, config, surfaces, context and
+    // readback images) from the stream's SPS, so the first Decode() does not pay for
+    // device bring-up. The surface pool is sized from the SPS's max_num_ref_frames.
+    // extraData is Annex B (an SPS, optionally followed by the PPS) or an avcC
+    // record. Does nothing once the decoder is running.
+    X_API void Prewarm( const uint8_t* extraData, size_t extraDataSize );
+    X_API void Prewarm( XIRef<XSDK::XMemory> extraData );
+
+    // Decode() accepts packets that produce zero or more pictures (B-frames and
+    // decoder delay mean output lags input). Decoded pictures are queued in display
+    // order and drained with Get().
     X_API virtual void Decode( XIRef<AVKit::Packet> frame );
 
+    // As above, but tags the packet with a presentation timestamp that is returned
+    // by GetPTS() once its picture comes out of Get().
+    X_API void Decode( XIRef<AVKit::Packet> frame, int64_t pts );
+
+    // Drains the pictures still held by the decoder at end of stream into the output
+    // queue. The decoder can be fed a new stream afterwards.
+    X_API void Flush();
+
+    // With DECODE_KEY, interval N decodes every Nth IDR. Reference pictures can not
+    // be skipped without breaking prediction, so with DECODE_REFERENCE every one is
+    // decoded and interval N only queues every Nth for output. Leaving DECODE_KEY
+    // takes effect at the next IDR, the other changes straight away.
+    X_API void SetDecodeMode( DecodeMode mode, uint32_t interval = 1 );
+    X_API DecodeMode GetDecodeMode() const;
+    X_API uint32_t GetDecodeInterval() const;
+
+    // The number of packets the decode mode has dropped.
+    X_API size_t GetSkippedPackets() const;
+
+    X_API void SetErrorPolicy( ErrorPolicy policy );
+    X_API ErrorPolicy GetErrorPolicy() const;
+
+    // With concealment on, ERROR_POLICY_RESYNC keeps decoding after a corrupt packet
+    // and outputs the damaged pictures (concealed by libavcodec where it can) rather
+    // than waiting for the next IDR.
+    X_API void SetErrorConcealment( bool conceal );
+    X_API bool GetErrorConcealment() const;
+
+    // Packets that failed to decode, and pictures Get() dropped because they could
+    // not be read back, under ERROR_POLICY_RESYNC. Dropped pictures also count those
+    // pushed out of a full output queue (see MAX_OUTPUT_PICTURES).
+    X_API size_t GetCorruptPackets() const;
+    X_API size_t GetDroppedPictures() const;
+
+    // Drops every queued picture and flushes libavcodec, so the decoder can be fed a
+    // different stream. The VA display, config, surfaces and images are kept. With
+    // the new stream's extradata, the pipeline is also resized for it straight away
+    // (otherwise that happens when its SPS arrives). Surfaces are only reallocated
+    // when the new pictures are larger.
+    X_API void Reset();
+    X_API void Reset( const uint8_t* extraData, size_t extraDataSize );
+
+    // The number of decoded pictures waiting for Get().
+    X_API size_t GetNumPictures() const;
+
     X_API virtual uint16_t GetInputWidth() const;
     X_API virtual uint16_t GetInputHeight() const;
 
@@ -64,17 +284,176 @@ public:
     X_API virtual void SetOutputHeight( uint16_t outputHeight );
     X_API virtual uint16_t GetOutputHeight() const;
 
+    // Selects what Get() returns. Every format except NV12 (which is always at the
+    // decoded size) is scaled to the output size.
+    X_API void SetOutputFormat( OutputFormat format );
+    X_API OutputFormat GetOutputFormat() const;
+
+    X_API void SetScaler( ScalerType scaler );
+    X_API ScalerType GetScaler() const;
+
+    // The number of readback images Get() cycles through (1 to MAX_READBACK_DEPTH,
+    // default 2). Above 1, a readback thread copies the next queued pictures out of
+    // their surfaces while the caller converts the current one. 1 reads back each
+    // picture on the calling thread inside Get().
+    X_API void SetReadbackDepth( size_t depth );
+    X_API size_t GetReadbackDepth() const;
+
     X_API virtual XIRef<AVKit::Packet> Get();
 
+    // Converts the next picture straight into caller owned memory instead of a new
+    // packet. There is one plane for Y8, BGR24 and BGRA, two (Y, UV) for NV12 and
+    // three (Y, U, V) for I420, each strides[i] bytes per row. The planes must hold
+    // a picture of the output size (the input size for NV12, or unless
+    // SetOutputWidth() and SetOutputHeight() were called).
+    X_API void GetInto( uint8_t* const planes[], const size_t strides[] );
+
+    // Where the packets Get() and GetRegionPictures() return come from. Installing a
+    // PacketPool lets their memory be reused once the caller lets go of them.
+    X_API void SetPacketFactory( XIRef<AVKit::PacketFactory> pf );
+    X_API XIRef<AVKit::PacketFactory> GetPacketFactory() const;
+
+    // Returns the next picture as a zero copy view of its surface, ignoring the
+    // output format, width and height.
+    X_API XIRef<NV12Frame> GetNV12Frame();
+
+    // Only the regions are read back from the surface, each into an image of its own
+    // size, so readback bandwidth follows their area rather than the picture's. Each
+    // region comes back as one packet in the current output format.
+    X_API void SetRegions( const std::vector<struct Region>& regions );
+    X_API std::vector<struct Region> GetRegions() const;
+
+    // Reads back the regions set with SetRegions() (or the regions given) from the
+    // next picture, in place of Get().
+    X_API void GetRegionPictures( std::vector<XIRef<AVKit::Packet> >& output );
+    X_API void GetRegionPictures( const std::vector<struct Region>& regions,
+                                  std::vector<XIRef<AVKit::Packet> >& output );
+
+    // Surface pool occupancy. Surfaces are in use while they are references, queued
+    // for Get() or held by an NV12Frame.
+    X_API struct SurfacePoolStats GetSurfacePoolStats() const;
+
+    // The presentation timestamp and key flag of the picture last returned by Get().
+    X_API int64_t GetPTS() const;
+    X_API bool LastWasKey() const;
+
 private:
+    friend class NV12Frame;
+
     VAH264Decoder( const VAH264Decoder& obj );
     VAH264Decoder& operator = ( const VAH264Decoder& );
 
+    // Scaling state for turning one source rectangle into one output size. image is
+    // only used for regions.
+    struct Conversion
+    {
+        uint16_t inputWidth;
+        uint16_t inputHeight;
+        uint16_t outputWidth;
+        uint16_t outputHeight;
+        SwsContext* scaler;
+        NV12Scaler* fastScaler;
+        VAImage image;
+    };
+
+    // Where a conversion writes its output, one entry per plane of the output format.
+    struct Destination
+    {
+        uint8_t* planes[3];
+        size_t strides[3];
+    };
+
+    // A picture handed to the readback thread, and the image it is copied into.
+    struct Readback
+    {
+        struct DecodedPicture picture;
+        VAImage image;
+        uint16_t width;
+        uint16_t height;
+        bool done;
+        XSDK::XString error;
+    };
+
+    class ReadbackThread : public XSDK::XThread
+    {
+    public:
+        ReadbackThread( VAH264Decoder* parent );
+        virtual ~ReadbackThread() throw();
+
+        virtual void* EntryPoint();
+
+    private:
+        VAH264Decoder* _parent;
+    };
+
     void _FinishFFMPEGInit( uint8_t* frame, size_t frameSize );
+    static void _GetPictureSize( uint8_t* frame, size_t frameSize, uint16_t& width, uint16_t& height );
+    static void _ToAnnexB( const uint8_t* extraData, size_t extraDataSize, std::vector<uint8_t>& annexB );
 
     void _DestroyScaler();
 
+    XIRef<AVKit::Packet> _GetRetrying( const struct Destination* dest );
+    XIRef<AVKit::Packet> _Get( const struct Destination* dest );
+    bool _AcceptPacket( const uint8_t* data, size_t size );
+    int _Decode( AVPacket* inputPacket, bool& gotPicture );
+    void _QueuePicture();
+    XIRef<AVKit::Packet> _Convert( VAImage& image, struct Conversion& c );
+    void _Convert( VAImage& image, struct Conversion& c, const struct Destination& dest );
+    void _ConvertI420( struct Conversion& c, uint8_t* Y_start, int Y_pitch, uint8_t* U_start, int U_pitch, const struct Destination& dest );
+    void _ConvertY8( struct Conversion& c, uint8_t* Y_start, int Y_pitch, const struct Destination& dest );
+    void _ConvertBGR( struct Conversion& c,
+                      uint8_t* Y_start,
+                      int Y_pitch,
+                      uint8_t* U_start,
+                      int U_pitch,
+                      size_t bytesPerPixel,
+                      const struct Destination& dest );
+    size_t _PlaneLayout( uint16_t width, uint16_t height, size_t rowBytes[3], size_t rows[3] ) const;
+    XIRef<AVKit::Packet> _AllocateOutput( uint16_t width, uint16_t height, struct Destination& dest );
+    static bool _IsUnscaled( const struct Conversion& c );
+    bool _UseFastScaler( const struct Conversion& c ) const;
+    NV12Scaler* _GetFastScaler( struct Conversion& c );
+    void _CreateScaler( struct Conversion& c, enum PixelFormat inputFormat, enum PixelFormat outputFormat );
+    static void _InitConversion( struct Conversion& c );
+    void _UpdateConversion( struct Conversion& c,
+                            uint16_t inputWidth,
+                            uint16_t inputHeight,
+                            uint16_t outputWidth,
+                            uint16_t outputHeight );
+    static void _ResetScalers( struct Conversion& c );
+    void _DestroyConversion( struct Conversion& c );
+    VAImage _GetOutputImage();
+    void _ReleaseOutputImage( VAImage& image );
+    void _ReleasePicture( struct DecodedPicture& picture );
+    void _DropPictures();
+    void _PrimeOutputImages();
+    void _DestroyOutputImages();
+    struct DecodedPicture _PopPicture();
+    void _SubmitReadbacks();
+    struct Readback _WaitForReadback();
+    struct Readback* _NextReadback();
+    void _StopReadbackThread();
+    static void _CopyNV12( const uint8_t* y,
+                           size_t yPitch,
+                           const uint8_t* uv,
+                           size_t uvPitch,
+                           uint16_t width,
+                           uint16_t height,
+                           const struct Destination& dest );
+
+    void _RefSurface( struct HWSurface* surface );
+    void _UnrefSurface( struct HWSurface* surface );
+    size_t _InitialSurfaceCount() const;
+    bool _TopUpSurfaces();
+    void _AddSurfaces( size_t count );
+    void _RemoveSurfaces( size_t keep );
+    void _CreateContext();
+    bool _GrowSurfaces();
+    void _RetireSurfaces();
+    void _DestroySurface( struct HWSurface* surface );
+
     void _InitVAAPIDecoder();
+    void _ResizeVAAPIDecoder();
     void _DestroyVAAPIDecoder();
 
     static enum PixelFormat _GetFormat( struct AVCodecContext *avctx, const enum PixelFormat *fmt );
@@ -85,18 +464,53 @@ private:
     AVCodecContext* _context;
     struct AVKit::CodecOptions _options;
     AVFrame* _frame;
-    SwsContext* _scaler;
+    ScalerType _scalerType;
+    struct Conversion _conversion;
+    std::vector<struct Region> _regions;
+    std::vector<struct Conversion> _regionConversions;
     uint16_t _outputWidth;
     uint16_t _outputHeight;
     bool _initComplete;
     int _fd;
+    XIRef<SharedVADisplay> _display;
     struct vaapi_context _vc;
     VAConfigAttrib _attrib;
-    struct HWSurface _surfaces[NUM_VA_BUFFERS];
-    VAImage _outputImage;
-    XSDK::XMutex _surfaceLock;
-    unsigned int _surfaceOrder;
+    std::vector<struct HWSurface*> _surfaces;
+    std::vector<struct HWSurface*> _freeSurfaces;
+    std::vector<struct HWSurface*> _retiredSurfaces;
+    uint16_t _surfaceWidth;
+    uint16_t _surfaceHeight;
+    uint16_t _vaWidth;
+    uint16_t _vaHeight;
+    size_t _peakSurfacesInUse;
+    size_t _surfaceGrows;
+    // max_num_ref_frames of the SPS Prewarm() was given, which libavcodec has not
+    // parsed yet at that point.
+    uint32_t _spsRefs;
+    VAImageFormat _nv12Format;
+    std::list<struct DecodedPicture> _outputQueue;
+    std::vector<VAImage> _freeImages;
+    mutable XSDK::XMutex _surfaceLock;
     XIRef<AVKit::PacketFactory> _pf;
+    int64_t _lastPTS;
+    bool _lastKey;
+    OutputFormat _outputFormat;
+    DecodeMode _decodeMode;
+    uint32_t _decodeInterval;
+    uint32_t _intervalCount;
+    bool _waitForIDR;
+    size_t _skippedPackets;
+    ErrorPolicy _errorPolicy;
+    bool _concealErrors;
+    size_t _corruptPackets;
+    size_t _droppedPictures;
+    bool _loggedOverflow;
+    size_t _readbackDepth;
+    std::list<struct Readback> _readbacks;
+    XSDK::XMutex _readbackLock;
+    XSDK::XCondition _readbackCond;
+    ReadbackThread* _readbackThread;
+    bool _readbackRunning;
 };
 
 }
@@ -21,6 +21,7 @@ extern "C"
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <vector>
 
 #include "XSDK/Types.h"
 #include "XSDK/XSocket.h"
@@ -37,6 +38,54 @@ namespace VAKit
 
 const size_t NUM_REFERENCE_FRAMES = 2;
 const size_t SURFACE_NUM = 16;
+const size_t DEFAULT_STATS_WINDOW = 300;
+
+// Describes the most recently encoded frame. Stage durations are in nanoseconds:
+// upload is the copy of the input into the source surface, render covers the
+// vaBeginPicture() through vaEndPicture() calls, sync is the wait in vaSyncSurface()
+// and copy is the read of the coded buffer into the output packet. qp is the average
+// QP the driver reports for the frame (the configured QP under CQP if it reports
+// none, and 0 if it does not know).
+struct EncodeFrameStats
+{
+    bool key;
+    bool idr;
+    uint32_t frameNum;
+    int32_t poc;
+    int32_t qp;
+    size_t codedSize;
+    uint64_t uploadNanos;
+    uint64_t renderNanos;
+    uint64_t syncNanos;
+    uint64_t copyNanos;
+};
+
+struct EncodeStageStats
+{
+    uint64_t minNanos;
+    uint64_t avgNanos;
+    uint64_t p99Nanos;
+};
+
+// Cumulative counters since construction, plus per stage min/avg/p99 over the last
+// GetStatsWindow() frames.
+struct EncodeStats
+{
+    uint64_t frames;
+    uint64_t keyFrames;
+    uint64_t codedBytes;
+    uint64_t uploadNanos;
+    uint64_t renderNanos;
+    uint64_t syncNanos;
+    uint64_t copyNanos;
+
+    size_t windowFrames;
+    struct EncodeStageStats upload;
+    struct EncodeStageStats render;
+    struct EncodeStageStats sync;
+    struct EncodeStageStats copy;
+    struct EncodeStageStats total;
+};
 
 class VAH264Encoder : public AVKit::Encoder
 {
@@ -48,6 +97,18 @@ public:
 
     X_API static bool HasHW( const XSDK::XString& devicePath );
 
+    // Applies new encode settings without tearing down the VA display and config.
+    // QP and GOP changes take effect on the next frame. So do bitrate changes when the
+    // device encodes with CBR or VBR rate control; on a device that only has CQP they
+    // throw. A resolution change forces an IDR (with new SPS/PPS) and only reallocates
+    // surfaces when the current ones are too small.
+    X_API void Reconfigure( const struct AVKit::CodecOptions& options );
+
+    // Makes the next frame an IDR with the given idr_pic_id, restarting frame_num and
+    // POC. Used to produce closed GOPs that can be concatenated with the output of
+    // other encoder instances.
+    X_API void StartSegment( uint16_t idrPicID );
+
     X_API virtual void EncodeYUV420P( XIRef<AVKit::Packet> input,
                                       AVKit::FrameType type = AVKit::FRAME_TYPE_AUTO_GOP );
 
@@ -59,6 +120,13 @@ public:
 
     X_API virtual XIRef<XSDK::XMemory> GetExtraData() const;
 
+    X_API struct EncodeFrameStats GetLastFrameStats() const;
+
+    X_API struct EncodeStats GetStats() const;
+
+    X_API void SetStatsWindow( size_t frames );
+    X_API size_t GetStatsWindow() const;
+
 private:
 
     int32_t _ComputeCurrentFrameType( uint32_t currentFrameNum,
@@ -76,6 +144,14 @@ private:
 
     void _UploadImage( uint8_t* yv12, VAImage& image, uint16_t width, uint16_t height );
 
+    void _RecordStats();
+
+    void _SetResolution( int32_t width, int32_t height );
+    void _CreateSurfaces();
+    void _DestroySurfaces();
+    void _CreateContext();
+    void _DestroyContext();
+
     XSDK::XString _devicePath;
     bool _annexB;
     int _fd;
@@ -99,18 +175,31 @@ private:
     int32_t _frameWidthMBAligned;
     int32_t _frameHeight;
     int32_t _frameHeightMBAligned;
+    int32_t _surfaceWidth;
+    int32_t _surfaceHeight;
     uint32_t _frameBitRate;
+    uint32_t _rateControl;
     int32_t _intraPeriod;
     uint64_t _currentIDRDisplay;
+    int32_t _picOrderCntMsbRef;
+    int32_t _picOrderCntLsbRef;
     uint32_t _currentFrameNum;
     int32_t _currentFrameType;
     uint32_t _timeBaseNum;
     uint32_t _timeBaseDen;
     int32_t _initialQP;
+    int32_t _ppsQP;
+    bool _resendSequence;
+    bool _rebuildExtraData;
     XIRef<XSDK::XMemory> _extraData;
     struct AVKit::CodecOptions _options;
     XIRef<AVKit::PacketFactory> _pf;
     XIRef<AVKit::Packet> _pkt;
+    struct EncodeFrameStats _lastStats;
+    struct EncodeStats _stats;
+    std::vector<struct EncodeFrameStats> _statsWindow;
+    size_t _statsWindowSize;
+    size_t _statsWindowPos;
 };
 
 }
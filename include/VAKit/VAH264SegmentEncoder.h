@@ -0,0 +1,122 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#ifndef __VAKit_VAH264SegmentEncoder_h
+#define __VAKit_VAH264SegmentEncoder_h
+
+#include "XSDK/Types.h"
+#include "XSDK/XMemory.h"
+#include "XSDK/XString.h"
+#include "XSDK/XMutex.h"
+#include "XSDK/XCondition.h"
+#include "XSDK/XThread.h"
+#include "AVKit/Options.h"
+#include "AVKit/Packet.h"
+#include "VAKit/VAH264Encoder.h"
+
+#include <list>
+#include <map>
+#include <vector>
+
+namespace VAKit
+{
+
+// VAH264SegmentEncoder is meant for offline (archive) encoding. Input frames are cut
+// into closed GOPs of gop_size frames, each GOP is encoded on one of several
+// VAH264Encoder instances running in parallel, and the results are handed back in
+// input order as a single Annex B stream.
+//
+// Every GOP starts with an IDR, so frame_num and POC restart at each segment
+// boundary. Segments get increasing idr_pic_id values, and SPS/PPS are only
+// emitted in front of the first segment.
+//
+// Input packets are held (not copied) until their segment is encoded, so callers
+// must not reuse them.
+
+class VAH264SegmentEncoder
+{
+public:
+    // One encoder context is created per entry in devicePaths. If devicePaths is
+    // empty, numContexts contexts are created on options.device_path.
+    X_API VAH264SegmentEncoder( const struct AVKit::CodecOptions& options,
+                                size_t numContexts,
+                                const std::vector<XSDK::XString>& devicePaths = std::vector<XSDK::XString>() );
+
+    X_API virtual ~VAH264SegmentEncoder() throw();
+
+    // Queues a YUV420P frame. Blocks while too many segments are waiting for a
+    // free encoder context.
+    X_API void EncodeYUV420P( XIRef<AVKit::Packet> input );
+
+    // Submits the final (possibly short) segment. No frames may be queued after this.
+    X_API void Finish();
+
+    // Returns the next encoded frame in input order, waiting for it if its segment is
+    // still being encoded. Returns an empty ref if that segment has not been filled
+    // yet (queue more frames or call Finish()), and once everything has been returned.
+    X_API XIRef<AVKit::Packet> Get();
+
+    X_API bool LastWasKey() const;
+
+    X_API XIRef<XSDK::XMemory> GetExtraData() const;
+
+private:
+    VAH264SegmentEncoder( const VAH264SegmentEncoder& obj );
+    VAH264SegmentEncoder& operator = ( const VAH264SegmentEncoder& );
+
+    struct Segment
+    {
+        size_t index;
+        std::vector<XIRef<AVKit::Packet> > input;
+        std::vector<XIRef<AVKit::Packet> > output;
+        std::vector<bool> keys;
+        bool done;
+    };
+
+    class Worker : public XSDK::XThread
+    {
+    public:
+        Worker( VAH264SegmentEncoder* parent, VAH264Encoder* encoder );
+        virtual ~Worker() throw();
+
+        virtual void* EntryPoint();
+
+    private:
+        VAH264SegmentEncoder* _parent;
+        VAH264Encoder* _encoder;
+    };
+
+    void _SubmitCurrent();
+    void _EncodeSegment( VAH264Encoder* encoder, Segment* segment );
+    static void _StripParameterSets( XIRef<AVKit::Packet> pkt );
+
+    struct AVKit::CodecOptions _options;
+    size_t _gopSize;
+    std::vector<VAH264Encoder*> _encoders;
+    std::vector<Worker*> _workers;
+    XSDK::XMutex _lock;
+    XSDK::XCondition _cond;
+    Segment* _current;
+    size_t _nextIndex;
+    std::list<Segment*> _pending;
+    std::map<size_t, Segment*> _segments;
+    size_t _outputIndex;
+    size_t _outputFrame;
+    bool _finished;
+    bool _running;
+    XSDK::XString _error;
+    bool _lastWasKey;
+    XIRef<XSDK::XMemory> _extraData;
+};
+
+}
+
+#endif
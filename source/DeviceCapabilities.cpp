@@ -0,0 +1,286 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#include "VAKit/DeviceCapabilities.h"
+#include "XSDK/XMutex.h"
+#include "XSDK/XGuard.h"
+#include "XSDK/TimeUtils.h"
+
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <va/va_drm.h>
+}
+
+using namespace XSDK;
+using namespace std;
+
+namespace VAKit
+{
+
+// A device that could not be opened may just not be ready yet (its driver still
+// loading, say), so that answer is only kept this long.
+static const double UNAVAILABLE_RETRY_SECONDS = 5.0;
+
+struct CachedCapabilities
+{
+    struct DeviceCapabilities caps;
+    uint64_t probedAt;
+};
+
+static XMutex _capabilitiesLock;
+static map<XString, struct CachedCapabilities> _capabilities;
+
+static void _InitCodec( struct CodecCapabilities& codec )
+{
+    codec.supported = false;
+    codec.rtFormats = 0;
+    codec.maxWidth = 0;
+    codec.maxHeight = 0;
+}
+
+static uint32_t _AttribValue( const VAConfigAttrib& attrib )
+{
+    return (attrib.value == VA_ATTRIB_NOT_SUPPORTED) ? 0 : attrib.value;
+}
+
+static void _ProbeDecode( VADisplay display, struct DeviceCapabilities& caps )
+{
+    if( !HasEntrypoint( caps, VAProfileH264High, VAEntrypointVLD ) )
+        return;
+
+    VAConfigAttrib attribs[3];
+    attribs[0].type = VAConfigAttribRTFormat;
+    attribs[1].type = VAConfigAttribMaxPictureWidth;
+    attribs[2].type = VAConfigAttribMaxPictureHeight;
+
+    int numAttribs = 1;
+#if VA_CHECK_VERSION(0,38,0)
+    numAttribs = 3;
+#endif
+
+    if( vaGetConfigAttributes( display, VAProfileH264High, VAEntrypointVLD, attribs, numAttribs ) != VA_STATUS_SUCCESS )
+        return;
+
+    caps.h264Decode.rtFormats = _AttribValue( attribs[0] );
+    if( numAttribs == 3 )
+    {
+        caps.h264Decode.maxWidth = _AttribValue( attribs[1] );
+        caps.h264Decode.maxHeight = _AttribValue( attribs[2] );
+    }
+
+    if( (caps.h264Decode.rtFormats & VA_RT_FORMAT_YUV420) == 0 )
+        return;
+
+    // The same config VAH264Decoder creates.
+    VAConfigAttrib attrib;
+    attrib.type = VAConfigAttribRTFormat;
+    attrib.value = attribs[0].value;
+
+    VAConfigID configID = VA_INVALID_ID;
+    if( vaCreateConfig( display, VAProfileH264High, VAEntrypointVLD, &attrib, 1, &configID ) == VA_STATUS_SUCCESS )
+    {
+        caps.h264Decode.supported = true;
+        vaDestroyConfig( display, configID );
+    }
+}
+
+static void _ProbeEncode( VADisplay display, struct DeviceCapabilities& caps )
+{
+    if( !HasEntrypoint( caps, VAProfileH264High, VAEntrypointEncSlice ) )
+        return;
+
+    VAConfigAttrib attribs[8];
+    int numAttribs = 0;
+    attribs[numAttribs++].type = VAConfigAttribRTFormat;
+    attribs[numAttribs++].type = VAConfigAttribRateControl;
+    attribs[numAttribs++].type = VAConfigAttribEncPackedHeaders;
+    attribs[numAttribs++].type = VAConfigAttribEncMaxRefFrames;
+#if VA_CHECK_VERSION(0,38,0)
+    attribs[numAttribs++].type = VAConfigAttribMaxPictureWidth;
+    attribs[numAttribs++].type = VAConfigAttribMaxPictureHeight;
+    attribs[numAttribs++].type = VAConfigAttribEncROI;
+    attribs[numAttribs++].type = VAConfigAttribEncIntraRefresh;
+#endif
+
+    if( vaGetConfigAttributes( display, VAProfileH264High, VAEntrypointEncSlice, attribs, numAttribs ) != VA_STATUS_SUCCESS )
+        return;
+
+    caps.h264Encode.rtFormats = _AttribValue( attribs[0] );
+    caps.rateControlModes = _AttribValue( attribs[1] );
+    caps.packedHeaders = _AttribValue( attribs[2] );
+    caps.maxRefFrames = _AttribValue( attribs[3] );
+#if VA_CHECK_VERSION(0,38,0)
+    caps.h264Encode.maxWidth = _AttribValue( attribs[4] );
+    caps.h264Encode.maxHeight = _AttribValue( attribs[5] );
+    caps.roi = _AttribValue( attribs[6] );
+    caps.intraRefresh = _AttribValue( attribs[7] );
+#endif
+
+    // The same config VAH264Encoder creates.
+    VAConfigAttrib configAttribs[3];
+    configAttribs[0].type = VAConfigAttribRTFormat;
+    configAttribs[0].value = VA_RT_FORMAT_YUV420;
+    configAttribs[1].type = VAConfigAttribRateControl;
+    configAttribs[1].value = ChooseRateControl( caps );
+    configAttribs[2].type = VAConfigAttribEncPackedHeaders;
+    configAttribs[2].value = VA_ENC_PACKED_HEADER_SEQUENCE | VA_ENC_PACKED_HEADER_PICTURE;
+
+    VAConfigID configID = VA_INVALID_ID;
+    if( vaCreateConfig( display, VAProfileH264High, VAEntrypointEncSlice, configAttribs, 3, &configID ) == VA_STATUS_SUCCESS )
+    {
+        caps.h264Encode.supported = true;
+        vaDestroyConfig( display, configID );
+    }
+}
+
+static void _ProbeDisplay( VADisplay display, struct DeviceCapabilities& caps )
+{
+    const char* vendor = vaQueryVendorString( display );
+    if( vendor )
+        caps.vendor = vendor;
+
+    vector<VAProfile> profiles( vaMaxNumProfiles( display ) );
+    int numProfiles = 0;
+
+    if( !profiles.empty() && vaQueryConfigProfiles( display, &profiles[0], &numProfiles ) == VA_STATUS_SUCCESS )
+    {
+        vector<VAEntrypoint> entrypoints( vaMaxNumEntrypoints( display ) );
+
+        for( int i = 0; i < numProfiles; i++ )
+        {
+            struct ProfileCapabilities profile;
+            profile.profile = profiles[i];
+
+            int numEntrypoints = 0;
+            if( !entrypoints.empty() &&
+                vaQueryConfigEntrypoints( display, profiles[i], &entrypoints[0], &numEntrypoints ) == VA_STATUS_SUCCESS )
+                profile.entrypoints.assign( entrypoints.begin(), entrypoints.begin() + numEntrypoints );
+
+            caps.profiles.push_back( profile );
+        }
+    }
+
+    _ProbeDecode( display, caps );
+    _ProbeEncode( display, caps );
+
+    vector<VAImageFormat> formats( vaMaxNumImageFormats( display ) );
+    int numFormats = 0;
+
+    if( !formats.empty() && vaQueryImageFormats( display, &formats[0], &numFormats ) == VA_STATUS_SUCCESS )
+    {
+        for( int i = 0; i < numFormats; i++ )
+            caps.imageFormats.push_back( formats[i].fourcc );
+    }
+}
+
+static struct DeviceCapabilities _Probe( const XString& devicePath )
+{
+    struct DeviceCapabilities caps;
+    caps.available = false;
+    caps.majorVersion = 0;
+    caps.minorVersion = 0;
+    _InitCodec( caps.h264Decode );
+    _InitCodec( caps.h264Encode );
+    caps.rateControlModes = 0;
+    caps.packedHeaders = 0;
+    caps.maxRefFrames = 0;
+    caps.roi = 0;
+    caps.intraRefresh = 0;
+
+    int fd = open( devicePath.c_str(), O_RDWR );
+    if( fd < 0 )
+        return caps;
+
+    VADisplay display = (VADisplay)vaGetDisplayDRM( fd );
+
+    if( vaDisplayIsValid( display ) )
+    {
+        if( vaInitialize( display, &caps.majorVersion, &caps.minorVersion ) == VA_STATUS_SUCCESS )
+        {
+            caps.available = true;
+
+            _ProbeDisplay( display, caps );
+
+            vaTerminate( display );
+        }
+    }
+
+    close( fd );
+
+    return caps;
+}
+
+struct DeviceCapabilities GetDeviceCapabilities( const XString& devicePath )
+{
+    // Probing under the lock means streams opening together on a new device wait
+    // for one probe rather than each running their own.
+    XGuard g( _capabilitiesLock );
+
+    map<XString, struct CachedCapabilities>::iterator found = _capabilities.find( devicePath );
+
+    if( found != _capabilities.end() && !found->second.caps.available &&
+        XMonoClock::GetElapsedTime( found->second.probedAt, XMonoClock::GetTime() ) > UNAVAILABLE_RETRY_SECONDS )
+    {
+        _capabilities.erase( found );
+        found = _capabilities.end();
+    }
+
+    if( found == _capabilities.end() )
+    {
+        struct CachedCapabilities cached;
+        cached.caps = _Probe( devicePath );
+        cached.probedAt = XMonoClock::GetTime();
+
+        found = _capabilities.insert( make_pair( devicePath, cached ) ).first;
+    }
+
+    return found->second.caps;
+}
+
+bool HasEntrypoint( const struct DeviceCapabilities& caps, VAProfile profile, VAEntrypoint entrypoint )
+{
+    for( size_t i = 0; i < caps.profiles.size(); i++ )
+    {
+        if( caps.profiles[i].profile != profile )
+            continue;
+
+        for( size_t j = 0; j < caps.profiles[i].entrypoints.size(); j++ )
+        {
+            if( caps.profiles[i].entrypoints[j] == entrypoint )
+                return true;
+        }
+    }
+
+    return false;
+}
+
+uint32_t ChooseRateControl( const struct DeviceCapabilities& caps )
+{
+    if( caps.rateControlModes & VA_RC_CBR )
+        return VA_RC_CBR;
+
+    if( caps.rateControlModes & VA_RC_VBR )
+        return VA_RC_VBR;
+
+    return VA_RC_CQP;
+}
+
+void ClearDeviceCapabilities()
+{
+    XGuard g( _capabilitiesLock );
+    _capabilities.clear();
+}
+
+}
@@ -0,0 +1,112 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#include "VAKit/HWLoadTracker.h"
+#include "XSDK/XGuard.h"
+
+using namespace VAKit;
+using namespace XSDK;
+using namespace std;
+
+// Weight given to each new cost per pixel sample in the moving average.
+static const double LOAD_SMOOTHING = 0.1;
+
+HWLoadTracker::HWLoadTracker( double budget ) :
+    _lock(),
+    _devices(),
+    _budget( budget )
+{
+}
+
+HWLoadTracker::~HWLoadTracker() throw()
+{
+}
+
+void HWLoadTracker::SetBudget( double budget )
+{
+    XGuard g( _lock );
+    _budget = budget;
+}
+
+double HWLoadTracker::GetBudget() const
+{
+    XGuard g( _lock );
+    return _budget;
+}
+
+double HWLoadTracker::GetLoad( const XString& devicePath ) const
+{
+    XGuard g( _lock );
+
+    map<XString, struct DeviceLoad>::const_iterator found = _devices.find( devicePath );
+
+    return (found != _devices.end()) ? found->second.load : 0.0;
+}
+
+bool HWLoadTracker::OverBudget( const XString& devicePath ) const
+{
+    return GetLoad( devicePath ) > GetBudget();
+}
+
+bool HWLoadTracker::Fits( const XString& devicePath, double pixels, double frameInterval, double fraction ) const
+{
+    XGuard g( _lock );
+
+    map<XString, struct DeviceLoad>::const_iterator found = _devices.find( devicePath );
+
+    if( found == _devices.end() )
+        return true;
+
+    double estimate = 0.0;
+
+    if( found->second.secondsPerPixel > 0.0 && pixels > 0.0 && frameInterval > 0.0 )
+        estimate = (found->second.secondsPerPixel * pixels) / frameInterval;
+
+    return (found->second.load + estimate) <= (_budget * fraction);
+}
+
+void HWLoadTracker::AddChannel( const XString& devicePath )
+{
+    XGuard g( _lock );
+
+    _devices[devicePath].channels++;
+}
+
+void HWLoadTracker::RemoveChannel( const XString& devicePath, double reportedLoad )
+{
+    XGuard g( _lock );
+
+    struct DeviceLoad& device = _devices[devicePath];
+
+    device.load -= reportedLoad;
+    if( device.load < 0.0 )
+        device.load = 0.0;
+
+    device.channels--;
+}
+
+void HWLoadTracker::Report( const XString& devicePath, double load, double reportedLoad, double seconds, double pixels )
+{
+    XGuard g( _lock );
+
+    struct DeviceLoad& device = _devices[devicePath];
+
+    device.load += load - reportedLoad;
+
+    if( pixels <= 0.0 )
+        return;
+
+    double secondsPerPixel = seconds / pixels;
+
+    if( device.secondsPerPixel == 0.0 )
+        device.secondsPerPixel = secondsPerPixel;
+    else device.secondsPerPixel += (secondsPerPixel - device.secondsPerPixel) * LOAD_SMOOTHING;
+}
@@ -0,0 +1,425 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#include "VAKit/HybridH264Decoder.h"
+#include "VAKit/VAH264Decoder.h"
+#include "VAKit/NALTypes.h"
+#include "AVKit/H264Decoder.h"
+#include "XSDK/XException.h"
+#include "XSDK/TimeUtils.h"
+
+#include <string.h>
+
+using namespace VAKit;
+using namespace AVKit;
+using namespace XSDK;
+using namespace std;
+
+static const double DEFAULT_FRAME_INTERVAL = 1.0 / 30.0;
+static const double DEFAULT_HW_BUDGET = 0.9;
+
+// Weight given to each new decode time sample in the moving average.
+static const double LOAD_SMOOTHING = 0.1;
+
+// A software stream only moves back to hardware if the device would stay below
+// this fraction of the budget, so streams do not bounce back and forth.
+static const double RETURN_TO_HW_FRACTION = 0.8;
+
+// After a hardware decode fails the stream stays in software for this long, so a
+// broken device is not retried on every IDR.
+static const double HW_RETRY_SECONDS = 60.0;
+
+HWLoadTracker HybridH264Decoder::_loads( DEFAULT_HW_BUDGET );
+
+HybridH264Decoder::HybridH264Decoder( const struct CodecOptions& options ) :
+    _options( options ),
+    _devicePath(),
+    _decoder( NULL ),
+    _hwDecoder( NULL ),
+    _isHW( false ),
+    _fresh( true ),
+    _waitForIDR( false ),
+    _swPicture( false ),
+    _hwFailed( false ),
+    _hwFailedAt( 0 ),
+    _frameInterval( DEFAULT_FRAME_INTERVAL ),
+    _avgDecodeSeconds( 0.0 ),
+    _reportedLoad( 0.0 ),
+    _getSeconds( 0.0 ),
+    _pixels( 0.0 ),
+    _outputWidth( 0 ),
+    _outputHeight( 0 ),
+    _sps(),
+    _pps(),
+    _pending()
+{
+    if( !_options.time_base_num.IsNull() && !_options.time_base_den.IsNull() && _options.time_base_den.Value() != 0 )
+        _frameInterval = (double)_options.time_base_num.Value() / (double)_options.time_base_den.Value();
+
+    if( !_options.device_path.IsNull() && VAH264Decoder::HasHW( _options.device_path.Value() ) )
+        _devicePath = _options.device_path.Value();
+
+    if( !_TryStartHW() )
+        _StartSW();
+}
+
+HybridH264Decoder::~HybridH264Decoder() throw()
+{
+    if( _isHW )
+        _StopHW();
+    else if( _decoder )
+        delete _decoder;
+}
+
+void HybridH264Decoder::Decode( XIRef<Packet> frame )
+{
+    bool hasSPS = false;
+    bool idr = _ScanPacket( frame, hasSPS );
+
+    if( idr )
+    {
+        if( _isHW )
+        {
+            if( _loads.OverBudget( _devicePath ) )
+            {
+                X_LOG_NOTICE( "HW decode load over budget, moving stream to software." );
+                _StartSW();
+            }
+        }
+        else if( !_devicePath.empty() && !_InHWBackoff() )
+        {
+            if( _loads.Fits( _devicePath, _pixels, _frameInterval, RETURN_TO_HW_FRACTION ) )
+            {
+                Decoder* swDecoder = _decoder;
+                _decoder = NULL;
+
+                if( _TryStartHW() )
+                {
+                    // The software decoder's last picture is handed out ahead of
+                    // the hardware decoder's.
+                    if( _swPicture )
+                        _pending.push_back( swDecoder->Get() );
+
+                    _swPicture = false;
+
+                    delete swDecoder;
+                    X_LOG_NOTICE( "HW decode capacity available, moving stream to hardware." );
+                }
+                else _decoder = swDecoder;
+            }
+        }
+    }
+
+    if( _waitForIDR )
+    {
+        if( !idr )
+            return;
+
+        _waitForIDR = false;
+    }
+
+    if( _isHW )
+    {
+        try
+        {
+            uint64_t start = XMonoClock::GetTime();
+
+            _Feed( frame, hasSPS );
+
+            _UpdateLoad( XMonoClock::GetElapsedTime( start, XMonoClock::GetTime() ) + _getSeconds );
+            _getSeconds = 0.0;
+        }
+        catch( XException& ex )
+        {
+            X_LOG_WARNING( "HW decode failed (%s), moving stream to software.", ex.what() );
+
+            _hwFailed = true;
+            _hwFailedAt = XMonoClock::GetTime();
+
+            _StartSW();
+
+            // The software decoder can only start from an IDR.
+            if( idr )
+                _Feed( frame, hasSPS );
+            else _waitForIDR = true;
+        }
+    }
+    else _Feed( frame, hasSPS );
+
+    if( _decoder->GetInputWidth() > 0 && _decoder->GetInputHeight() > 0 )
+        _pixels = (double)_decoder->GetInputWidth() * (double)_decoder->GetInputHeight();
+}
+
+uint16_t HybridH264Decoder::GetInputWidth() const
+{
+    return _decoder->GetInputWidth();
+}
+
+uint16_t HybridH264Decoder::GetInputHeight() const
+{
+    return _decoder->GetInputHeight();
+}
+
+void HybridH264Decoder::SetOutputWidth( uint16_t outputWidth )
+{
+    _outputWidth = outputWidth;
+    _decoder->SetOutputWidth( outputWidth );
+}
+
+uint16_t HybridH264Decoder::GetOutputWidth() const
+{
+    return _decoder->GetOutputWidth();
+}
+
+void HybridH264Decoder::SetOutputHeight( uint16_t outputHeight )
+{
+    _outputHeight = outputHeight;
+    _decoder->SetOutputHeight( outputHeight );
+}
+
+uint16_t HybridH264Decoder::GetOutputHeight() const
+{
+    return _decoder->GetOutputHeight();
+}
+
+XIRef<Packet> HybridH264Decoder::Get()
+{
+    // Pictures drained from a decoder we moved away from come first.
+    if( !_pending.empty() )
+    {
+        XIRef<Packet> pkt = _pending.front();
+        _pending.pop_front();
+        return pkt;
+    }
+
+    if( !_isHW )
+    {
+        _swPicture = false;
+        return _decoder->Get();
+    }
+
+    // Readback is where a hardware decode actually waits for the GPU, so it counts
+    // towards the stream's load.
+    uint64_t start = XMonoClock::GetTime();
+
+    XIRef<Packet> pkt = _decoder->Get();
+
+    _getSeconds += XMonoClock::GetElapsedTime( start, XMonoClock::GetTime() );
+
+    return pkt;
+}
+
+size_t HybridH264Decoder::GetNumPictures() const
+{
+    size_t pictures = _pending.size();
+
+    if( _isHW )
+        pictures += _hwDecoder->GetNumPictures();
+    else if( _swPicture )
+        pictures++;
+
+    return pictures;
+}
+
+void HybridH264Decoder::Flush()
+{
+    if( _isHW )
+        _hwDecoder->Flush();
+}
+
+bool HybridH264Decoder::IsHW() const
+{
+    return _isHW;
+}
+
+void HybridH264Decoder::SetHWBudget( double budget )
+{
+    _loads.SetBudget( budget );
+}
+
+double HybridH264Decoder::GetHWBudget()
+{
+    return _loads.GetBudget();
+}
+
+double HybridH264Decoder::GetHWLoad( const XString& devicePath )
+{
+    return _loads.GetLoad( devicePath );
+}
+
+bool HybridH264Decoder::_ScanPacket( XIRef<Packet> frame, bool& hasSPS )
+{
+    vector<NALUnit> units;
+    FindNALUnits( frame->Map(), frame->GetDataSize(), units );
+
+    bool idr = false;
+    hasSPS = false;
+
+    for( size_t i = 0; i < units.size(); i++ )
+    {
+        const NALUnit& unit = units[i];
+
+        if( unit.type == NAL_IDR )
+            idr = true;
+        else if( unit.type == NAL_SPS )
+        {
+            _sps.assign( unit.start, unit.data + unit.size );
+            hasSPS = true;
+        }
+        else if( unit.type == NAL_PPS )
+            _pps.assign( unit.start, unit.data + unit.size );
+    }
+
+    return idr;
+}
+
+XIRef<Packet> HybridH264Decoder::_WithParameterSets( XIRef<Packet> frame )
+{
+    size_t size = _sps.size() + _pps.size() + frame->GetDataSize();
+
+    XIRef<Packet> pkt = new Packet( size );
+    uint8_t* dst = pkt->Map();
+
+    memcpy( dst, &_sps[0], _sps.size() );
+    dst += _sps.size();
+
+    if( !_pps.empty() )
+    {
+        memcpy( dst, &_pps[0], _pps.size() );
+        dst += _pps.size();
+    }
+
+    memcpy( dst, frame->Map(), frame->GetDataSize() );
+
+    pkt->SetDataSize( size );
+
+    return pkt;
+}
+
+void HybridH264Decoder::_Feed( XIRef<Packet> frame, bool hasSPS )
+{
+    // A decoder we just switched to has not seen the stream's parameter sets.
+    if( _fresh && !hasSPS && !_sps.empty() )
+        frame = _WithParameterSets( frame );
+
+    _fresh = false;
+
+    _decoder->Decode( frame );
+
+    if( !_isHW )
+        _swPicture = true;
+}
+
+bool HybridH264Decoder::_TryStartHW()
+{
+    if( _devicePath.empty() )
+        return false;
+
+    if( !_loads.Fits( _devicePath, _pixels, _frameInterval ) )
+        return false;
+
+    try
+    {
+        _hwDecoder = new VAH264Decoder( _options );
+    }
+    catch( XException& ex )
+    {
+        X_LOG_WARNING( "Unable to create VAH264Decoder (%s).", ex.what() );
+        return false;
+    }
+
+    _loads.AddChannel( _devicePath );
+
+    _decoder = _hwDecoder;
+    _isHW = true;
+    _fresh = true;
+    _avgDecodeSeconds = 0.0;
+    _reportedLoad = 0.0;
+    _getSeconds = 0.0;
+
+    _ApplyOutputSize();
+
+    return true;
+}
+
+bool HybridH264Decoder::_InHWBackoff()
+{
+    if( _hwFailed && XMonoClock::GetElapsedTime( _hwFailedAt, XMonoClock::GetTime() ) < HW_RETRY_SECONDS )
+        return true;
+
+    _hwFailed = false;
+
+    return false;
+}
+
+void HybridH264Decoder::_StartSW()
+{
+    // Built before the hardware decoder is stopped, so if this throws the stream
+    // is left with a decoder.
+    Decoder* swDecoder = new H264Decoder( _options );
+
+    if( _isHW )
+        _StopHW();
+
+    _decoder = swDecoder;
+    _isHW = false;
+    _fresh = true;
+    _swPicture = false;
+
+    _ApplyOutputSize();
+}
+
+void HybridH264Decoder::_StopHW()
+{
+    // Pictures the hardware decoder still holds are handed out ahead of the new
+    // decoder's.
+    try
+    {
+        _hwDecoder->Flush();
+
+        while( _hwDecoder->GetNumPictures() > 0 )
+            _pending.push_back( _hwDecoder->Get() );
+    }
+    catch( XException& ex )
+    {
+        X_LOG_WARNING( "Unable to drain HW decoder (%s).", ex.what() );
+    }
+
+    _loads.RemoveChannel( _devicePath, _reportedLoad );
+
+    _reportedLoad = 0.0;
+
+    delete _hwDecoder;
+    _hwDecoder = NULL;
+    _decoder = NULL;
+    _isHW = false;
+}
+
+void HybridH264Decoder::_ApplyOutputSize()
+{
+    if( _outputWidth != 0 )
+        _decoder->SetOutputWidth( _outputWidth );
+
+    if( _outputHeight != 0 )
+        _decoder->SetOutputHeight( _outputHeight );
+}
+
+void HybridH264Decoder::_UpdateLoad( double decodeSeconds )
+{
+    if( _avgDecodeSeconds == 0.0 )
+        _avgDecodeSeconds = decodeSeconds;
+    else _avgDecodeSeconds += (decodeSeconds - _avgDecodeSeconds) * LOAD_SMOOTHING;
+
+    double load = _avgDecodeSeconds / _frameInterval;
+
+    _loads.Report( _devicePath, load, _reportedLoad, decodeSeconds, _pixels );
+    _reportedLoad = load;
+}
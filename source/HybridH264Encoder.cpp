@@ -0,0 +1,300 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#include "VAKit/HybridH264Encoder.h"
+#include "VAKit/VAH264Encoder.h"
+#include "AVKit/H264Encoder.h"
+#include "XSDK/XException.h"
+#include "XSDK/TimeUtils.h"
+
+#include <string.h>
+
+using namespace VAKit;
+using namespace AVKit;
+using namespace XSDK;
+using namespace std;
+
+static const uint32_t DEFAULT_GOP_SIZE = 15;
+static const double DEFAULT_FRAME_INTERVAL = 1.0 / 30.0;
+static const double DEFAULT_HW_BUDGET = 0.9;
+
+// Weight given to each new encode time sample in the moving average.
+static const double LOAD_SMOOTHING = 0.1;
+
+// A software channel only moves back to hardware if the device would stay below
+// this fraction of the budget, so channels do not bounce back and forth.
+static const double RETURN_TO_HW_FRACTION = 0.8;
+
+// After a hardware encode fails the channel stays in software for this long, so a
+// broken device is not retried on every key frame.
+static const double HW_RETRY_SECONDS = 60.0;
+
+HWLoadTracker HybridH264Encoder::_loads( DEFAULT_HW_BUDGET );
+
+HybridH264Encoder::HybridH264Encoder( const struct CodecOptions& options,
+                                      bool annexB ) :
+    _options( options ),
+    _annexB( annexB ),
+    _devicePath(),
+    _encoder( NULL ),
+    _isHW( false ),
+    _frameInterval( DEFAULT_FRAME_INTERVAL ),
+    _avgEncodeSeconds( 0.0 ),
+    _reportedLoad( 0.0 ),
+    _gopSize( DEFAULT_GOP_SIZE ),
+    _frameNum( 0 ),
+    _lastWasKey( false ),
+    _extraData(),
+    _newEncoder( false ),
+    _extraDataChanged( false ),
+    _hwFailed( false ),
+    _hwFailedAt( 0 )
+{
+    if( !_options.time_base_num.IsNull() && !_options.time_base_den.IsNull() && _options.time_base_den.Value() != 0 )
+        _frameInterval = (double)_options.time_base_num.Value() / (double)_options.time_base_den.Value();
+
+    if( !_options.gop_size.IsNull() && _options.gop_size.Value() > 0 )
+        _gopSize = _options.gop_size.Value();
+
+    if( !_options.device_path.IsNull() && VAH264Encoder::HasHW( _options.device_path.Value() ) )
+        _devicePath = _options.device_path.Value();
+
+    if( !_TryStartHW() )
+        _StartSW();
+}
+
+HybridH264Encoder::~HybridH264Encoder() throw()
+{
+    if( _isHW )
+        _StopHW();
+    else if( _encoder )
+        delete _encoder;
+}
+
+void HybridH264Encoder::EncodeYUV420P( XIRef<Packet> input, FrameType type )
+{
+    if( _IsKeyFrame( type ) )
+    {
+        if( _isHW )
+        {
+            if( _loads.OverBudget( _devicePath ) )
+            {
+                X_LOG_NOTICE( "HW encode load over budget, moving channel to software." );
+                _StartSW();
+            }
+        }
+        else if( !_devicePath.empty() && !_InHWBackoff() )
+        {
+            if( _loads.Fits( _devicePath, _Pixels(), _frameInterval, RETURN_TO_HW_FRACTION ) )
+            {
+                Encoder* swEncoder = _encoder;
+                _encoder = NULL;
+
+                if( _TryStartHW() )
+                {
+                    delete swEncoder;
+                    X_LOG_NOTICE( "HW encode capacity available, moving channel to hardware." );
+                }
+                else _encoder = swEncoder;
+            }
+        }
+    }
+
+    if( _isHW )
+    {
+        try
+        {
+            uint64_t start = XMonoClock::GetTime();
+
+            _encoder->EncodeYUV420P( input, type );
+
+            _UpdateLoad( XMonoClock::GetElapsedTime( start, XMonoClock::GetTime() ) );
+        }
+        catch( XException& ex )
+        {
+            // The stream keeps going in software. Its first frame is an IDR, so the
+            // output stays decodable.
+            X_LOG_WARNING( "HW encode failed (%s), moving channel to software.", ex.what() );
+
+            _hwFailed = true;
+            _hwFailedAt = XMonoClock::GetTime();
+
+            _StartSW();
+
+            _encoder->EncodeYUV420P( input, type );
+        }
+    }
+    else _encoder->EncodeYUV420P( input, type );
+
+    _lastWasKey = _encoder->LastWasKey();
+
+    _extraDataChanged = false;
+
+    // A new encoder's extradata is only there once it has encoded a frame.
+    if( _newEncoder )
+    {
+        XIRef<XMemory> extraData = _encoder->GetExtraData();
+
+        if( _extraData.IsValid() && !_SameExtraData( _extraData, extraData ) )
+        {
+            X_LOG_NOTICE( "Extradata changed on move to %s encoder.", (_isHW) ? "hardware" : "software" );
+            _extraDataChanged = true;
+        }
+
+        _extraData = extraData;
+        _newEncoder = false;
+    }
+
+    _frameNum++;
+}
+
+XIRef<Packet> HybridH264Encoder::Get()
+{
+    return _encoder->Get();
+}
+
+bool HybridH264Encoder::LastWasKey() const
+{
+    return _lastWasKey;
+}
+
+struct CodecOptions HybridH264Encoder::GetOptions() const
+{
+    return _options;
+}
+
+XIRef<XMemory> HybridH264Encoder::GetExtraData() const
+{
+    return _encoder->GetExtraData();
+}
+
+bool HybridH264Encoder::ExtraDataChanged() const
+{
+    return _extraDataChanged;
+}
+
+bool HybridH264Encoder::IsHW() const
+{
+    return _isHW;
+}
+
+void HybridH264Encoder::SetHWBudget( double budget )
+{
+    _loads.SetBudget( budget );
+}
+
+double HybridH264Encoder::GetHWBudget()
+{
+    return _loads.GetBudget();
+}
+
+double HybridH264Encoder::GetHWLoad( const XString& devicePath )
+{
+    return _loads.GetLoad( devicePath );
+}
+
+bool HybridH264Encoder::_SameExtraData( XIRef<XMemory> a, XIRef<XMemory> b )
+{
+    return a->GetDataSize() == b->GetDataSize() &&
+           memcmp( a->Map(), b->Map(), a->GetDataSize() ) == 0;
+}
+
+bool HybridH264Encoder::_IsKeyFrame( FrameType type ) const
+{
+    if( type == FRAME_TYPE_AUTO_GOP )
+        return (_frameNum % _gopSize) == 0;
+
+    return type == FRAME_TYPE_KEY;
+}
+
+double HybridH264Encoder::_Pixels() const
+{
+    return (double)_options.width.Value() * (double)_options.height.Value();
+}
+
+bool HybridH264Encoder::_TryStartHW()
+{
+    if( _devicePath.empty() )
+        return false;
+
+    if( !_loads.Fits( _devicePath, _Pixels(), _frameInterval ) )
+        return false;
+
+    try
+    {
+        _encoder = new VAH264Encoder( _options, _annexB );
+    }
+    catch( XException& ex )
+    {
+        X_LOG_WARNING( "Unable to create VAH264Encoder (%s).", ex.what() );
+        return false;
+    }
+
+    _loads.AddChannel( _devicePath );
+
+    _isHW = true;
+    _avgEncodeSeconds = 0.0;
+    _reportedLoad = 0.0;
+
+    // The new encoder starts its own GOP with an IDR.
+    _frameNum = 0;
+    _newEncoder = true;
+
+    return true;
+}
+
+bool HybridH264Encoder::_InHWBackoff()
+{
+    if( _hwFailed && XMonoClock::GetElapsedTime( _hwFailedAt, XMonoClock::GetTime() ) < HW_RETRY_SECONDS )
+        return true;
+
+    _hwFailed = false;
+
+    return false;
+}
+
+void HybridH264Encoder::_StartSW()
+{
+    // Built before the hardware encoder is stopped, so if this throws the channel
+    // is left with an encoder.
+    Encoder* swEncoder = new H264Encoder( _options, _annexB );
+
+    if( _isHW )
+        _StopHW();
+
+    _encoder = swEncoder;
+    _isHW = false;
+    _frameNum = 0;
+    _newEncoder = true;
+}
+
+void HybridH264Encoder::_StopHW()
+{
+    _loads.RemoveChannel( _devicePath, _reportedLoad );
+
+    _reportedLoad = 0.0;
+
+    delete _encoder;
+    _encoder = NULL;
+    _isHW = false;
+}
+
+void HybridH264Encoder::_UpdateLoad( double encodeSeconds )
+{
+    if( _avgEncodeSeconds == 0.0 )
+        _avgEncodeSeconds = encodeSeconds;
+    else _avgEncodeSeconds += (encodeSeconds - _avgEncodeSeconds) * LOAD_SMOOTHING;
+
+    double load = _avgEncodeSeconds / _frameInterval;
+
+    _loads.Report( _devicePath, load, _reportedLoad, encodeSeconds, _Pixels() );
+    _reportedLoad = load;
+}
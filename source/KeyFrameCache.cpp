@@ -0,0 +1,336 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#include "VAKit/KeyFrameCache.h"
+#include "XSDK/XException.h"
+#include "XSDK/XGuard.h"
+
+using namespace VAKit;
+using namespace AVKit;
+using namespace XSDK;
+using namespace std;
+
+bool KeyFrameCache::Key::operator < ( const struct Key& other ) const
+{
+    if( streamID != other.streamID )
+        return streamID < other.streamID;
+
+    if( pts != other.pts )
+        return pts < other.pts;
+
+    if( width != other.width )
+        return width < other.width;
+
+    if( height != other.height )
+        return height < other.height;
+
+    return format < other.format;
+}
+
+KeyFrameCache::KeyFrameCache( const struct CodecOptions& options, size_t memoryBudget, size_t maxDecoders ) :
+    _options( options ),
+    _lock(),
+    _decoderCond( _lock ),
+    _entries(),
+    _index(),
+    _bytes( 0 ),
+    _memoryBudget( memoryBudget ),
+    _idleDecoders(),
+    _numDecoders( 0 ),
+    _maxDecoders( (maxDecoders > 0) ? maxDecoders : 1 ),
+    _hits( 0 ),
+    _misses( 0 ),
+    _evictions( 0 )
+{
+}
+
+KeyFrameCache::~KeyFrameCache() throw()
+{
+    for( size_t i = 0; i < _idleDecoders.size(); i++ )
+        delete _idleDecoders[i].decoder;
+}
+
+XIRef<Packet> KeyFrameCache::Get( const XString& streamID,
+                                  int64_t pts,
+                                  XIRef<Packet> frame,
+                                  uint16_t width,
+                                  uint16_t height,
+                                  OutputFormat format )
+{
+    struct Key key;
+    key.streamID = streamID;
+    key.pts = pts;
+    key.width = width;
+    key.height = height;
+    key.format = format;
+
+    {
+        XGuard g( _lock );
+
+        XIRef<Packet> picture = _Find( key );
+
+        if( picture.IsValid() )
+        {
+            _hits++;
+            return picture;
+        }
+
+        _misses++;
+    }
+
+    struct PooledDecoder decoder = _TakeDecoder( streamID );
+
+    XIRef<Packet> picture;
+
+    try
+    {
+        picture = _Decode( decoder, key, frame );
+    }
+    catch( ... )
+    {
+        // Whatever state it was left in, the decoder is not worth reusing.
+        delete decoder.decoder;
+
+        XGuard g( _lock );
+        _numDecoders--;
+        _decoderCond.Signal();
+
+        throw;
+    }
+
+    _ReturnDecoder( decoder );
+
+    XGuard g( _lock );
+
+    return _Insert( key, picture );
+}
+
+XIRef<Packet> KeyFrameCache::Find( const XString& streamID,
+                                   int64_t pts,
+                                   uint16_t width,
+                                   uint16_t height,
+                                   OutputFormat format )
+{
+    struct Key key;
+    key.streamID = streamID;
+    key.pts = pts;
+    key.width = width;
+    key.height = height;
+    key.format = format;
+
+    XGuard g( _lock );
+
+    XIRef<Packet> picture = _Find( key );
+
+    if( picture.IsValid() )
+        _hits++;
+
+    return picture;
+}
+
+void KeyFrameCache::Remove( const XString& streamID )
+{
+    XGuard g( _lock );
+
+    list<struct Entry>::iterator i = _entries.begin();
+
+    while( i != _entries.end() )
+    {
+        list<struct Entry>::iterator entry = i++;
+
+        if( entry->key.streamID == streamID )
+            _Erase( entry );
+    }
+}
+
+void KeyFrameCache::Clear()
+{
+    XGuard g( _lock );
+
+    _entries.clear();
+    _index.clear();
+    _bytes = 0;
+}
+
+void KeyFrameCache::SetMemoryBudget( size_t memoryBudget )
+{
+    XGuard g( _lock );
+
+    _memoryBudget = memoryBudget;
+
+    _Evict();
+}
+
+struct KeyFrameCacheStats KeyFrameCache::GetStats() const
+{
+    XGuard g( _lock );
+
+    struct KeyFrameCacheStats stats;
+    stats.hits = _hits;
+    stats.misses = _misses;
+    stats.evictions = _evictions;
+    stats.entries = _entries.size();
+    stats.bytes = _bytes;
+    stats.memoryBudget = _memoryBudget;
+    stats.decoders = _numDecoders;
+
+    return stats;
+}
+
+XIRef<Packet> KeyFrameCache::_Find( const struct Key& key )
+{
+    // Called with _lock held.
+    map<struct Key, list<struct Entry>::iterator>::iterator found = _index.find( key );
+
+    if( found == _index.end() )
+        return XIRef<Packet>();
+
+    // splice() moves the entry to the front without invalidating the iterator the
+    // index holds.
+    _entries.splice( _entries.begin(), _entries, found->second );
+
+    return found->second->picture;
+}
+
+XIRef<Packet> KeyFrameCache::_Insert( const struct Key& key, XIRef<Packet> picture )
+{
+    // Called with _lock held. Another request may have decoded the same picture
+    // while we were, in which case the cached one wins.
+    XIRef<Packet> cached = _Find( key );
+    if( cached.IsValid() )
+        return cached;
+
+    size_t size = picture->GetDataSize();
+
+    // A picture bigger than the whole budget would only push everything else out.
+    if( size > _memoryBudget )
+        return picture;
+
+    struct Entry entry;
+    entry.key = key;
+    entry.picture = picture;
+    entry.size = size;
+
+    _entries.push_front( entry );
+    _index[key] = _entries.begin();
+    _bytes += size;
+
+    _Evict();
+
+    return picture;
+}
+
+void KeyFrameCache::_Evict()
+{
+    // Called with _lock held.
+    while( _bytes > _memoryBudget && !_entries.empty() )
+    {
+        list<struct Entry>::iterator oldest = _entries.end();
+        --oldest;
+
+        _Erase( oldest );
+        _evictions++;
+    }
+}
+
+void KeyFrameCache::_Erase( list<struct Entry>::iterator entry )
+{
+    // Called with _lock held.
+    _bytes -= entry->size;
+    _index.erase( entry->key );
+    _entries.erase( entry );
+}
+
+struct KeyFrameCache::PooledDecoder KeyFrameCache::_TakeDecoder( const XString& streamID )
+{
+    {
+        XGuard g( _lock );
+
+        while( _idleDecoders.empty() && _numDecoders >= _maxDecoders )
+            _decoderCond.Wait();
+
+        if( !_idleDecoders.empty() )
+        {
+            // One that last decoded this stream is already the right size.
+            size_t chosen = _idleDecoders.size() - 1;
+
+            for( size_t i = 0; i < _idleDecoders.size(); i++ )
+            {
+                if( _idleDecoders[i].streamID == streamID )
+                {
+                    chosen = i;
+                    break;
+                }
+            }
+
+            struct PooledDecoder decoder = _idleDecoders[chosen];
+            _idleDecoders.erase( _idleDecoders.begin() + chosen );
+
+            return decoder;
+        }
+
+        _numDecoders++;
+    }
+
+    struct PooledDecoder decoder;
+    decoder.decoder = NULL;
+
+    try
+    {
+        decoder.decoder = new VAH264Decoder( _options );
+    }
+    catch( ... )
+    {
+        XGuard g( _lock );
+        _numDecoders--;
+        _decoderCond.Signal();
+        throw;
+    }
+
+    // Key frames are decoded one at a time, so a readback thread would only add a
+    // thread switch to each miss.
+    decoder.decoder->SetReadbackDepth( 1 );
+
+    return decoder;
+}
+
+void KeyFrameCache::_ReturnDecoder( const struct PooledDecoder& decoder )
+{
+    XGuard g( _lock );
+
+    _idleDecoders.push_back( decoder );
+    _decoderCond.Signal();
+}
+
+XIRef<Packet> KeyFrameCache::_Decode( struct PooledDecoder& decoder, const struct Key& key, XIRef<Packet> frame )
+{
+    VAH264Decoder* d = decoder.decoder;
+
+    // Keeps the VA device, surfaces and images. A new stream's SPS resizes them if
+    // it has to.
+    d->Reset();
+    decoder.streamID = key.streamID;
+
+    d->SetOutputFormat( key.format );
+    d->SetOutputWidth( key.width );
+    d->SetOutputHeight( key.height );
+
+    d->Decode( frame, key.pts );
+
+    // A lone key frame can sit in the decoder's reorder buffer, so drain it.
+    if( d->GetNumPictures() == 0 )
+        d->Flush();
+
+    if( d->GetNumPictures() == 0 )
+        X_THROW(( "Key frame at %lld of stream %s did not decode.", (long long)key.pts, key.streamID.c_str() ));
+
+    return d->Get();
+}
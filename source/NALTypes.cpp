@@ -16,16 +16,283 @@
 namespace VAKit
 {
 
+void FindNALUnits( const uint8_t* p, size_t size, std::vector<NALUnit>& units )
+{
+    const uint8_t* end = p + size;
+    const uint8_t* cursor = p;
+
+    NALUnit current;
+    bool haveCurrent = false;
+
+    while( (cursor + 3) <= end )
+    {
+        if( cursor[0] != 0 || cursor[1] != 0 )
+        {
+            cursor++;
+            continue;
+        }
+
+        const uint8_t* startCode = cursor;
+        size_t startCodeSize = 0;
+
+        if( cursor[2] == 1 )
+            startCodeSize = 3;
+        else if( (cursor + 4) <= end && cursor[2] == 0 && cursor[3] == 1 )
+            startCodeSize = 4;
+
+        if( startCodeSize == 0 )
+        {
+            cursor++;
+            continue;
+        }
+
+        if( haveCurrent )
+        {
+            current.size = startCode - current.data;
+            units.push_back( current );
+            haveCurrent = false;
+        }
+
+        cursor += startCodeSize;
+
+        if( cursor < end )
+        {
+            current.start = startCode;
+            current.data = cursor;
+            current.type = cursor[0] & 0x1f;
+            current.refIDC = (cursor[0] >> 5) & 0x03;
+            haveCurrent = true;
+        }
+    }
+
+    if( haveCurrent )
+    {
+        current.size = end - current.data;
+        units.push_back( current );
+    }
+}
+
+// Reads the RBSP of a NAL unit, skipping emulation prevention bytes. Reading past
+// the end sets the overrun flag rather than throwing, so parsers check once at the
+// end.
+class RBSPReader
+{
+public:
+    RBSPReader( const uint8_t* p, size_t size ) :
+        _p( p ),
+        _end( p + size ),
+        _zeros( 0 ),
+        _byte( 0 ),
+        _bitsLeft( 0 ),
+        _overrun( false )
+    {
+    }
+
+    uint32_t GetBits( int32_t count )
+    {
+        uint32_t val = 0;
+
+        for( int32_t i = 0; i < count; i++ )
+            val = (val << 1) | _GetBit();
+
+        return val;
+    }
+
+    uint32_t GetUE()
+    {
+        int32_t leadingZeros = 0;
+
+        while( _GetBit() == 0 )
+        {
+            // Runs off the end, or longer than any 32 bit value.
+            if( _overrun || ++leadingZeros > 31 )
+            {
+                _overrun = true;
+                return 0;
+            }
+        }
+
+        if( leadingZeros == 0 )
+            return 0;
+
+        return ((1u << leadingZeros) - 1) + GetBits( leadingZeros );
+    }
+
+    int32_t GetSE()
+    {
+        uint32_t val = GetUE();
+
+        return (val & 1) ? (int32_t)((val + 1) / 2) : -(int32_t)(val / 2);
+    }
+
+    bool Overrun() const
+    {
+        return _overrun;
+    }
+
+private:
+    uint32_t _GetBit()
+    {
+        if( _bitsLeft == 0 )
+        {
+            if( _p >= _end )
+            {
+                _overrun = true;
+                return 0;
+            }
+
+            // 0x000003 hides a start code; the 03 is not part of the RBSP.
+            if( _zeros >= 2 && *_p == 3 )
+            {
+                _zeros = 0;
+                _p++;
+
+                if( _p >= _end )
+                {
+                    _overrun = true;
+                    return 0;
+                }
+            }
+
+            _byte = *_p++;
+            _zeros = (_byte == 0) ? _zeros + 1 : 0;
+            _bitsLeft = 8;
+        }
+
+        _bitsLeft--;
+
+        return (_byte >> _bitsLeft) & 1;
+    }
+
+    const uint8_t* _p;
+    const uint8_t* _end;
+    int32_t _zeros;
+    uint8_t _byte;
+    int32_t _bitsLeft;
+    bool _overrun;
+};
+
+static void SkipScalingList( RBSPReader& reader, int32_t size )
+{
+    int32_t lastScale = 8;
+    int32_t nextScale = 8;
+
+    for( int32_t i = 0; i < size && nextScale != 0; i++ )
+    {
+        nextScale = (lastScale + reader.GetSE() + 256) % 256;
+
+        if( nextScale != 0 )
+            lastScale = nextScale;
+    }
+}
+
+bool ParseSPS( const NALUnit& unit, SPSInfo& sps )
+{
+    if( unit.type != NAL_SPS || unit.size < 2 )
+        return false;
+
+    // Past the NAL header byte.
+    RBSPReader reader( unit.data + 1, unit.size - 1 );
+
+    sps.profileIDC = reader.GetBits( 8 );
+    reader.GetBits( 16 );                       /* constraint flags, level_idc */
+    reader.GetUE();                             /* seq_parameter_set_id */
+
+    sps.separateColourPlane = false;
+
+    if( sps.profileIDC == 100 || sps.profileIDC == 110 || sps.profileIDC == 122 ||
+        sps.profileIDC == 244 || sps.profileIDC == 44 || sps.profileIDC == 83 ||
+        sps.profileIDC == 86 || sps.profileIDC == 118 || sps.profileIDC == 128 )
+    {
+        uint32_t chromaFormatIDC = reader.GetUE();
+
+        if( chromaFormatIDC == 3 )
+            sps.separateColourPlane = (reader.GetBits( 1 ) != 0);
+
+        reader.GetUE();                         /* bit_depth_luma_minus8 */
+        reader.GetUE();                         /* bit_depth_chroma_minus8 */
+        reader.GetBits( 1 );                    /* qpprime_y_zero_transform_bypass_flag */
+
+        if( reader.GetBits( 1 ) )               /* seq_scaling_matrix_present_flag */
+        {
+            int32_t lists = (chromaFormatIDC != 3) ? 8 : 12;
+
+            for( int32_t i = 0; i < lists; i++ )
+            {
+                if( reader.GetBits( 1 ) )
+                    SkipScalingList( reader, (i < 6) ? 16 : 64 );
+            }
+        }
+    }
+
+    sps.log2MaxFrameNum = reader.GetUE() + 4;
+    sps.picOrderCntType = reader.GetUE();
+    sps.log2MaxPicOrderCntLsb = 0;
+
+    if( sps.picOrderCntType == 0 )
+        sps.log2MaxPicOrderCntLsb = reader.GetUE() + 4;
+    else if( sps.picOrderCntType == 1 )
+    {
+        reader.GetBits( 1 );                    /* delta_pic_order_always_zero_flag */
+        reader.GetSE();                         /* offset_for_non_ref_pic */
+        reader.GetSE();                         /* offset_for_top_to_bottom_field */
+
+        uint32_t cycle = reader.GetUE();
+
+        for( uint32_t i = 0; i < cycle && !reader.Overrun(); i++ )
+            reader.GetSE();                     /* offset_for_ref_frame */
+    }
+
+    sps.maxNumRefFrames = reader.GetUE();
+    reader.GetBits( 1 );                        /* gaps_in_frame_num_value_allowed_flag */
+    reader.GetUE();                             /* pic_width_in_mbs_minus1 */
+    reader.GetUE();                             /* pic_height_in_map_units_minus1 */
+    sps.frameMBSOnly = (reader.GetBits( 1 ) != 0);
+
+    return !reader.Overrun();
+}
+
+bool ParseSliceHeader( const NALUnit& unit, const SPSInfo& sps, SliceInfo& slice )
+{
+    if( (unit.type != NAL_IDR && unit.type != NAL_NON_IDR) || unit.size < 2 )
+        return false;
+
+    RBSPReader reader( unit.data + 1, unit.size - 1 );
+
+    slice.firstMB = reader.GetUE();
+    slice.sliceType = reader.GetUE();
+    reader.GetUE();                             /* pic_parameter_set_id */
+
+    if( sps.separateColourPlane )
+        reader.GetBits( 2 );                    /* colour_plane_id */
+
+    slice.frameNum = reader.GetBits( sps.log2MaxFrameNum );
+
+    if( !sps.frameMBSOnly )
+    {
+        if( reader.GetBits( 1 ) )               /* field_pic_flag */
+            reader.GetBits( 1 );                /* bottom_field_flag */
+    }
+
+    slice.idrPicID = 0;
+
+    if( unit.type == NAL_IDR )
+        slice.idrPicID = reader.GetUE();
+
+    slice.picOrderCntLsb = 0;
+
+    if( sps.picOrderCntType == 0 )
+        slice.picOrderCntLsb = reader.GetBits( sps.log2MaxPicOrderCntLsb );
+
+    return !reader.Overrun();
+}
+
 #ifndef WIN32
 
 static const int NAL_REF_IDC_NONE = 0;
 static const int NAL_REF_IDC_LOW = 1;
 static const int NAL_REF_IDC_MEDIUM = 2;
 static const int NAL_REF_IDC_HIGH = 3;
-static const int NAL_NON_IDR = 1;
-static const int NAL_IDR = 5;
-static const int NAL_SPS = 7;
-static const int NAL_PPS = 8;
 static const int PROFILE_IDC_BASELINE = 66;
 static const int PROFILE_IDC_MAIN = 77;
 static const int PROFILE_IDC_HIGH = 100;
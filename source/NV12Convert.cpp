@@ -0,0 +1,926 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#include "VAKit/NV12Convert.h"
+#include "XSDK/XException.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VAKIT_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define VAKIT_NEON
+#include <arm_neon.h>
+#endif
+
+namespace VAKit
+{
+
+// NV12ToBGR() deinterleaves chroma this many samples at a time into buffers on the
+// stack, so it needs no per picture allocation. A multiple of every kernel's step.
+static const size_t BGR_CHROMA_CHUNK = 1024;
+
+typedef void (*DeinterleaveFunc)( const uint8_t* uv, uint8_t* u, uint8_t* v, size_t count );
+
+// Averages 2x2 blocks of two rows into count output pixels.
+typedef void (*HalveRowsFunc)( const uint8_t* row0, const uint8_t* row1, uint8_t* dest, size_t count );
+
+// dest = (row0 * (256 - weight) + row1 * weight) / 256, rounded.
+typedef void (*BlendRowsFunc)( const uint8_t* row0, const uint8_t* row1, uint16_t weight, uint8_t* dest, size_t count );
+
+// BT.601 YUV to RGB factors in 3.13 fixed point.
+struct YUVCoefficients
+{
+    int16_t yOffset;
+    int16_t y;
+    int16_t rv;
+    int16_t gu;
+    int16_t gv;
+    int16_t bu;
+};
+
+static const struct YUVCoefficients VIDEO_RANGE = { 16, 9539, 13075, 3209, 6660, 16525 };
+static const struct YUVCoefficients FULL_RANGE = { 0, 8192, 11485, 2819, 5850, 14516 };
+
+// Converts one row of planar YUV (u and v at half width) to BGR24 or BGRA.
+typedef void (*YUVToBGRRowFunc)( const uint8_t* y,
+                                 const uint8_t* u,
+                                 const uint8_t* v,
+                                 uint8_t* dest,
+                                 size_t width,
+                                 size_t bytesPerPixel,
+                                 const struct YUVCoefficients& c );
+
+struct ConvertKernels
+{
+    const char* name;
+    DeinterleaveFunc deinterleaveUV;
+    HalveRowsFunc halveRows;
+    BlendRowsFunc blendRows;
+    YUVToBGRRowFunc yuvToBGRRow;
+};
+
+static void DeinterleaveUV_C( const uint8_t* uv, uint8_t* u, uint8_t* v, size_t count )
+{
+    for( size_t i = 0; i < count; i++ )
+    {
+        u[i] = uv[i * 2];
+        v[i] = uv[(i * 2) + 1];
+    }
+}
+
+static void HalveRows_C( const uint8_t* row0, const uint8_t* row1, uint8_t* dest, size_t count )
+{
+    for( size_t i = 0; i < count; i++ )
+        dest[i] = (uint8_t)((row0[i * 2] + row0[(i * 2) + 1] + row1[i * 2] + row1[(i * 2) + 1] + 2) >> 2);
+}
+
+static void BlendRows_C( const uint8_t* row0, const uint8_t* row1, uint16_t weight, uint8_t* dest, size_t count )
+{
+    uint32_t weight0 = 256 - weight;
+
+    for( size_t i = 0; i < count; i++ )
+        dest[i] = (uint8_t)(((row0[i] * weight0) + (row1[i] * weight) + 128) >> 8);
+}
+
+static inline uint8_t Clamp( int32_t value )
+{
+    return (value < 0) ? 0 : ((value > 255) ? 255 : (uint8_t)value);
+}
+
+static void YUVToBGRRow_C( const uint8_t* y,
+                           const uint8_t* u,
+                           const uint8_t* v,
+                           uint8_t* dest,
+                           size_t width,
+                           size_t bytesPerPixel,
+                           const struct YUVCoefficients& c )
+{
+    for( size_t i = 0; i < width; i++ )
+    {
+        int32_t luma = c.y * (y[i] - c.yOffset);
+        int32_t cb = u[i / 2] - 128;
+        int32_t cr = v[i / 2] - 128;
+
+        dest[0] = Clamp( (luma + (c.bu * cb) + 4096) >> 13 );
+        dest[1] = Clamp( (luma - (c.gu * cb) - (c.gv * cr) + 4096) >> 13 );
+        dest[2] = Clamp( (luma + (c.rv * cr) + 4096) >> 13 );
+
+        if( bytesPerPixel == 4 )
+            dest[3] = 255;
+
+        dest += bytesPerPixel;
+    }
+}
+
+#ifdef VAKIT_X86
+
+#ifdef __SSE2__
+static void DeinterleaveUV_SSE2( const uint8_t* uv, uint8_t* u, uint8_t* v, size_t count )
+{
+    const __m128i lowBytes = _mm_set1_epi16( 0x00ff );
+
+    size_t i = 0;
+
+    for( ; (i + 16) <= count; i += 16 )
+    {
+        __m128i a = _mm_loadu_si128( (const __m128i*)(uv + (i * 2)) );
+        __m128i b = _mm_loadu_si128( (const __m128i*)(uv + (i * 2) + 16) );
+
+        __m128i us = _mm_packus_epi16( _mm_and_si128( a, lowBytes ), _mm_and_si128( b, lowBytes ) );
+        __m128i vs = _mm_packus_epi16( _mm_srli_epi16( a, 8 ), _mm_srli_epi16( b, 8 ) );
+
+        _mm_storeu_si128( (__m128i*)(u + i), us );
+        _mm_storeu_si128( (__m128i*)(v + i), vs );
+    }
+
+    DeinterleaveUV_C( uv + (i * 2), u + i, v + i, count - i );
+}
+
+static void HalveRows_SSE2( const uint8_t* row0, const uint8_t* row1, uint8_t* dest, size_t count )
+{
+    const __m128i lowBytes = _mm_set1_epi16( 0x00ff );
+    const __m128i two = _mm_set1_epi16( 2 );
+
+    size_t i = 0;
+
+    for( ; (i + 16) <= count; i += 16 )
+    {
+        __m128i a0 = _mm_loadu_si128( (const __m128i*)(row0 + (i * 2)) );
+        __m128i a1 = _mm_loadu_si128( (const __m128i*)(row0 + (i * 2) + 16) );
+        __m128i b0 = _mm_loadu_si128( (const __m128i*)(row1 + (i * 2)) );
+        __m128i b1 = _mm_loadu_si128( (const __m128i*)(row1 + (i * 2) + 16) );
+
+        // Adding the even and odd bytes of each row as 16 bit values gives the
+        // horizontal pair sums.
+        __m128i sum0 = _mm_add_epi16( _mm_add_epi16( _mm_and_si128( a0, lowBytes ), _mm_srli_epi16( a0, 8 ) ),
+                                      _mm_add_epi16( _mm_and_si128( b0, lowBytes ), _mm_srli_epi16( b0, 8 ) ) );
+        __m128i sum1 = _mm_add_epi16( _mm_add_epi16( _mm_and_si128( a1, lowBytes ), _mm_srli_epi16( a1, 8 ) ),
+                                      _mm_add_epi16( _mm_and_si128( b1, lowBytes ), _mm_srli_epi16( b1, 8 ) ) );
+
+        sum0 = _mm_srli_epi16( _mm_add_epi16( sum0, two ), 2 );
+        sum1 = _mm_srli_epi16( _mm_add_epi16( sum1, two ), 2 );
+
+        _mm_storeu_si128( (__m128i*)(dest + i), _mm_packus_epi16( sum0, sum1 ) );
+    }
+
+    HalveRows_C( row0 + (i * 2), row1 + (i * 2), dest + i, count - i );
+}
+
+static void BlendRows_SSE2( const uint8_t* row0, const uint8_t* row1, uint16_t weight, uint8_t* dest, size_t count )
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi16( 128 );
+    const __m128i w0 = _mm_set1_epi16( (short)(256 - weight) );
+    const __m128i w1 = _mm_set1_epi16( (short)weight );
+
+    size_t i = 0;
+
+    for( ; (i + 16) <= count; i += 16 )
+    {
+        __m128i a = _mm_loadu_si128( (const __m128i*)(row0 + i) );
+        __m128i b = _mm_loadu_si128( (const __m128i*)(row1 + i) );
+
+        // The sums fit in 16 bits unsigned (255 * 256 + 128), so the low half of the
+        // products is all we need.
+        __m128i lo = _mm_add_epi16( _mm_add_epi16( _mm_mullo_epi16( _mm_unpacklo_epi8( a, zero ), w0 ),
+                                                   _mm_mullo_epi16( _mm_unpacklo_epi8( b, zero ), w1 ) ),
+                                    rounding );
+        __m128i hi = _mm_add_epi16( _mm_add_epi16( _mm_mullo_epi16( _mm_unpackhi_epi8( a, zero ), w0 ),
+                                                   _mm_mullo_epi16( _mm_unpackhi_epi8( b, zero ), w1 ) ),
+                                    rounding );
+
+        _mm_storeu_si128( (__m128i*)(dest + i), _mm_packus_epi16( _mm_srli_epi16( lo, 8 ), _mm_srli_epi16( hi, 8 ) ) );
+    }
+
+    BlendRows_C( row0 + i, row1 + i, weight, dest + i, count - i );
+}
+
+static inline __m128i CoefficientPair( int16_t c0, int16_t c1 )
+{
+    return _mm_set1_epi32( (int32_t)(((uint32_t)(uint16_t)c1 << 16) | (uint16_t)c0) );
+}
+
+// (a * c0 + b * c1 + c * c2 + 4096) >> 13 for eight 16 bit lanes, with the
+// coefficients given as pairs (c0, c1) and (c2, 0).
+static inline __m128i YUVChannel_SSE2( __m128i a, __m128i b, __m128i c, __m128i coeffs0, __m128i coeffs1 )
+{
+    const __m128i rounding = _mm_set1_epi32( 4096 );
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i lo = _mm_add_epi32( _mm_madd_epi16( _mm_unpacklo_epi16( a, b ), coeffs0 ),
+                                _mm_madd_epi16( _mm_unpacklo_epi16( c, zero ), coeffs1 ) );
+    __m128i hi = _mm_add_epi32( _mm_madd_epi16( _mm_unpackhi_epi16( a, b ), coeffs0 ),
+                                _mm_madd_epi16( _mm_unpackhi_epi16( c, zero ), coeffs1 ) );
+
+    lo = _mm_srai_epi32( _mm_add_epi32( lo, rounding ), 13 );
+    hi = _mm_srai_epi32( _mm_add_epi32( hi, rounding ), 13 );
+
+    return _mm_packs_epi32( lo, hi );
+}
+
+static void YUVToBGRRow_SSE2( const uint8_t* y,
+                              const uint8_t* u,
+                              const uint8_t* v,
+                              uint8_t* dest,
+                              size_t width,
+                              size_t bytesPerPixel,
+                              const struct YUVCoefficients& c )
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i yOffset = _mm_set1_epi16( c.yOffset );
+    const __m128i chromaOffset = _mm_set1_epi16( 128 );
+    const __m128i alpha = _mm_set1_epi8( (char)0xff );
+
+    const __m128i bCoeffs = CoefficientPair( c.y, c.bu );
+    const __m128i gCoeffs0 = CoefficientPair( c.y, -c.gu );
+    const __m128i gCoeffs1 = CoefficientPair( -c.gv, 0 );
+    const __m128i rCoeffs = CoefficientPair( c.y, c.rv );
+
+    size_t i = 0;
+
+    for( ; (i + 16) <= width; i += 16 )
+    {
+        __m128i ys = _mm_loadu_si128( (const __m128i*)(y + i) );
+        __m128i us = _mm_sub_epi16( _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i*)(u + (i / 2)) ), zero ), chromaOffset );
+        __m128i vs = _mm_sub_epi16( _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i*)(v + (i / 2)) ), zero ), chromaOffset );
+
+        __m128i yLo = _mm_sub_epi16( _mm_unpacklo_epi8( ys, zero ), yOffset );
+        __m128i yHi = _mm_sub_epi16( _mm_unpackhi_epi8( ys, zero ), yOffset );
+
+        // Each chroma sample covers two pixels.
+        __m128i uLo = _mm_unpacklo_epi16( us, us );
+        __m128i uHi = _mm_unpackhi_epi16( us, us );
+        __m128i vLo = _mm_unpacklo_epi16( vs, vs );
+        __m128i vHi = _mm_unpackhi_epi16( vs, vs );
+
+        __m128i b = _mm_packus_epi16( YUVChannel_SSE2( yLo, uLo, zero, bCoeffs, zero ),
+                                      YUVChannel_SSE2( yHi, uHi, zero, bCoeffs, zero ) );
+        __m128i g = _mm_packus_epi16( YUVChannel_SSE2( yLo, uLo, vLo, gCoeffs0, gCoeffs1 ),
+                                      YUVChannel_SSE2( yHi, uHi, vHi, gCoeffs0, gCoeffs1 ) );
+        __m128i r = _mm_packus_epi16( YUVChannel_SSE2( yLo, vLo, zero, rCoeffs, zero ),
+                                      YUVChannel_SSE2( yHi, vHi, zero, rCoeffs, zero ) );
+
+        if( bytesPerPixel == 4 )
+        {
+            __m128i bgLo = _mm_unpacklo_epi8( b, g );
+            __m128i bgHi = _mm_unpackhi_epi8( b, g );
+            __m128i raLo = _mm_unpacklo_epi8( r, alpha );
+            __m128i raHi = _mm_unpackhi_epi8( r, alpha );
+
+            _mm_storeu_si128( (__m128i*)dest, _mm_unpacklo_epi16( bgLo, raLo ) );
+            _mm_storeu_si128( (__m128i*)(dest + 16), _mm_unpackhi_epi16( bgLo, raLo ) );
+            _mm_storeu_si128( (__m128i*)(dest + 32), _mm_unpacklo_epi16( bgHi, raHi ) );
+            _mm_storeu_si128( (__m128i*)(dest + 48), _mm_unpackhi_epi16( bgHi, raHi ) );
+        }
+        else
+        {
+            // SSE2 has no byte shuffle, so the 3 byte pixels are packed by hand.
+            uint8_t bs[16], gs[16], rs[16];
+            _mm_storeu_si128( (__m128i*)bs, b );
+            _mm_storeu_si128( (__m128i*)gs, g );
+            _mm_storeu_si128( (__m128i*)rs, r );
+
+            for( size_t j = 0; j < 16; j++ )
+            {
+                dest[j * 3] = bs[j];
+                dest[(j * 3) + 1] = gs[j];
+                dest[(j * 3) + 2] = rs[j];
+            }
+        }
+
+        dest += 16 * bytesPerPixel;
+    }
+
+    YUVToBGRRow_C( y + i, u + (i / 2), v + (i / 2), dest, width - i, bytesPerPixel, c );
+}
+#endif
+
+#if defined(__clang__) || (defined(__GNUC__) && ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define VAKIT_AVX2
+
+__attribute__((target("avx2")))
+static void DeinterleaveUV_AVX2( const uint8_t* uv, uint8_t* u, uint8_t* v, size_t count )
+{
+    const __m256i lowBytes = _mm256_set1_epi16( 0x00ff );
+
+    size_t i = 0;
+
+    for( ; (i + 32) <= count; i += 32 )
+    {
+        __m256i a = _mm256_loadu_si256( (const __m256i*)(uv + (i * 2)) );
+        __m256i b = _mm256_loadu_si256( (const __m256i*)(uv + (i * 2) + 32) );
+
+        // The 256 bit pack works within 128 bit lanes, so the 64 bit quarters come
+        // out as a0 b0 a1 b1 and have to be put back in order.
+        __m256i us = _mm256_packus_epi16( _mm256_and_si256( a, lowBytes ), _mm256_and_si256( b, lowBytes ) );
+        __m256i vs = _mm256_packus_epi16( _mm256_srli_epi16( a, 8 ), _mm256_srli_epi16( b, 8 ) );
+
+        _mm256_storeu_si256( (__m256i*)(u + i), _mm256_permute4x64_epi64( us, 0xd8 ) );
+        _mm256_storeu_si256( (__m256i*)(v + i), _mm256_permute4x64_epi64( vs, 0xd8 ) );
+    }
+
+    DeinterleaveUV_C( uv + (i * 2), u + i, v + i, count - i );
+}
+#endif
+
+#endif
+
+#ifdef VAKIT_NEON
+static void DeinterleaveUV_NEON( const uint8_t* uv, uint8_t* u, uint8_t* v, size_t count )
+{
+    size_t i = 0;
+
+    for( ; (i + 16) <= count; i += 16 )
+    {
+        uint8x16x2_t pairs = vld2q_u8( uv + (i * 2) );
+        vst1q_u8( u + i, pairs.val[0] );
+        vst1q_u8( v + i, pairs.val[1] );
+    }
+
+    DeinterleaveUV_C( uv + (i * 2), u + i, v + i, count - i );
+}
+
+static void HalveRows_NEON( const uint8_t* row0, const uint8_t* row1, uint8_t* dest, size_t count )
+{
+    size_t i = 0;
+
+    for( ; (i + 8) <= count; i += 8 )
+    {
+        uint16x8_t sum = vpaddlq_u8( vld1q_u8( row0 + (i * 2) ) );
+        sum = vpadalq_u8( sum, vld1q_u8( row1 + (i * 2) ) );
+        vst1_u8( dest + i, vrshrn_n_u16( sum, 2 ) );
+    }
+
+    HalveRows_C( row0 + (i * 2), row1 + (i * 2), dest + i, count - i );
+}
+
+static void BlendRows_NEON( const uint8_t* row0, const uint8_t* row1, uint16_t weight, uint8_t* dest, size_t count )
+{
+    uint16_t weight0 = 256 - weight;
+
+    size_t i = 0;
+
+    for( ; (i + 8) <= count; i += 8 )
+    {
+        uint16x8_t sum = vmulq_n_u16( vmovl_u8( vld1_u8( row0 + i ) ), weight0 );
+        sum = vmlaq_n_u16( sum, vmovl_u8( vld1_u8( row1 + i ) ), weight );
+        vst1_u8( dest + i, vrshrn_n_u16( sum, 8 ) );
+    }
+
+    BlendRows_C( row0 + i, row1 + i, weight, dest + i, count - i );
+}
+
+// (y * cy + a * ca + b * cb + 4096) >> 13, saturated to 8 bits.
+static inline uint8x8_t YUVChannel_NEON( int16x8_t y, int16_t cy, int16x8_t a, int16_t ca, int16x8_t b, int16_t cb )
+{
+    int32x4_t lo = vmull_n_s16( vget_low_s16( y ), cy );
+    lo = vmlal_n_s16( lo, vget_low_s16( a ), ca );
+    lo = vmlal_n_s16( lo, vget_low_s16( b ), cb );
+
+    int32x4_t hi = vmull_n_s16( vget_high_s16( y ), cy );
+    hi = vmlal_n_s16( hi, vget_high_s16( a ), ca );
+    hi = vmlal_n_s16( hi, vget_high_s16( b ), cb );
+
+    return vqmovun_s16( vcombine_s16( vrshrn_n_s32( lo, 13 ), vrshrn_n_s32( hi, 13 ) ) );
+}
+
+static void YUVToBGRRow_NEON( const uint8_t* y,
+                              const uint8_t* u,
+                              const uint8_t* v,
+                              uint8_t* dest,
+                              size_t width,
+                              size_t bytesPerPixel,
+                              const struct YUVCoefficients& c )
+{
+    const int16x8_t yOffset = vdupq_n_s16( c.yOffset );
+    const int16x8_t chromaOffset = vdupq_n_s16( 128 );
+
+    size_t i = 0;
+
+    for( ; (i + 16) <= width; i += 16 )
+    {
+        uint8x16_t ys = vld1q_u8( y + i );
+
+        // Each chroma sample covers two pixels.
+        uint8x8x2_t us = vzip_u8( vld1_u8( u + (i / 2) ), vld1_u8( u + (i / 2) ) );
+        uint8x8x2_t vs = vzip_u8( vld1_u8( v + (i / 2) ), vld1_u8( v + (i / 2) ) );
+
+        uint8x16_t b, g, r;
+        uint8x8_t bParts[2], gParts[2], rParts[2];
+
+        for( int half = 0; half < 2; half++ )
+        {
+            uint8x8_t yBytes = (half == 0) ? vget_low_u8( ys ) : vget_high_u8( ys );
+
+            int16x8_t yw = vsubq_s16( vreinterpretq_s16_u16( vmovl_u8( yBytes ) ), yOffset );
+            int16x8_t uw = vsubq_s16( vreinterpretq_s16_u16( vmovl_u8( us.val[half] ) ), chromaOffset );
+            int16x8_t vw = vsubq_s16( vreinterpretq_s16_u16( vmovl_u8( vs.val[half] ) ), chromaOffset );
+
+            bParts[half] = YUVChannel_NEON( yw, c.y, uw, c.bu, vw, 0 );
+            gParts[half] = YUVChannel_NEON( yw, c.y, uw, -c.gu, vw, -c.gv );
+            rParts[half] = YUVChannel_NEON( yw, c.y, uw, 0, vw, c.rv );
+        }
+
+        b = vcombine_u8( bParts[0], bParts[1] );
+        g = vcombine_u8( gParts[0], gParts[1] );
+        r = vcombine_u8( rParts[0], rParts[1] );
+
+        if( bytesPerPixel == 4 )
+        {
+            uint8x16x4_t bgra;
+            bgra.val[0] = b;
+            bgra.val[1] = g;
+            bgra.val[2] = r;
+            bgra.val[3] = vdupq_n_u8( 255 );
+            vst4q_u8( dest, bgra );
+        }
+        else
+        {
+            uint8x16x3_t bgr;
+            bgr.val[0] = b;
+            bgr.val[1] = g;
+            bgr.val[2] = r;
+            vst3q_u8( dest, bgr );
+        }
+
+        dest += 16 * bytesPerPixel;
+    }
+
+    YUVToBGRRow_C( y + i, u + (i / 2), v + (i / 2), dest, width - i, bytesPerPixel, c );
+}
+#endif
+
+static struct ConvertKernels SelectKernels()
+{
+    struct ConvertKernels kernels;
+    kernels.name = "c";
+    kernels.deinterleaveUV = DeinterleaveUV_C;
+    kernels.halveRows = HalveRows_C;
+    kernels.blendRows = BlendRows_C;
+    kernels.yuvToBGRRow = YUVToBGRRow_C;
+
+#ifdef VAKIT_X86
+#ifdef __SSE2__
+    kernels.name = "sse2";
+    kernels.deinterleaveUV = DeinterleaveUV_SSE2;
+    kernels.halveRows = HalveRows_SSE2;
+    kernels.blendRows = BlendRows_SSE2;
+    kernels.yuvToBGRRow = YUVToBGRRow_SSE2;
+#endif
+#ifdef VAKIT_AVX2
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx2" ) )
+    {
+        kernels.name = "avx2";
+        kernels.deinterleaveUV = DeinterleaveUV_AVX2;
+    }
+#endif
+#endif
+
+#ifdef VAKIT_NEON
+    kernels.name = "neon";
+    kernels.deinterleaveUV = DeinterleaveUV_NEON;
+    kernels.halveRows = HalveRows_NEON;
+    kernels.blendRows = BlendRows_NEON;
+    kernels.yuvToBGRRow = YUVToBGRRow_NEON;
+#endif
+
+    return kernels;
+}
+
+static const struct ConvertKernels& Kernels()
+{
+    static const struct ConvertKernels kernels = SelectKernels();
+    return kernels;
+}
+
+void DeinterleaveUV( const uint8_t* uv, uint8_t* u, uint8_t* v, size_t count )
+{
+    Kernels().deinterleaveUV( uv, u, v, count );
+}
+
+void NV12ToI420( const uint8_t* y,
+                 size_t yPitch,
+                 const uint8_t* uv,
+                 size_t uvPitch,
+                 uint16_t width,
+                 uint16_t height,
+                 uint8_t* const dest[3],
+                 const size_t destPitches[3] )
+{
+    DeinterleaveFunc deinterleaveUV = Kernels().deinterleaveUV;
+
+    uint8_t* dstY = dest[0];
+
+    for( uint16_t row = 0; row < height; row++ )
+    {
+        memcpy( dstY, y, width );
+        dstY += destPitches[0];
+        y += yPitch;
+    }
+
+    size_t chromaWidth = width / 2;
+    size_t chromaHeight = height / 2;
+
+    uint8_t* u = dest[1];
+    uint8_t* v = dest[2];
+
+    for( size_t row = 0; row < chromaHeight; row++ )
+    {
+        deinterleaveUV( uv, u, v, chromaWidth );
+        uv += uvPitch;
+        u += destPitches[1];
+        v += destPitches[2];
+    }
+}
+
+void NV12ToBGR( const uint8_t* y,
+                size_t yPitch,
+                const uint8_t* uv,
+                size_t uvPitch,
+                uint16_t width,
+                uint16_t height,
+                uint8_t* dest,
+                size_t destPitch,
+                size_t bytesPerPixel,
+                bool fullRange )
+{
+    const struct ConvertKernels& kernels = Kernels();
+    const struct YUVCoefficients& coefficients = (fullRange) ? FULL_RANGE : VIDEO_RANGE;
+
+    uint8_t u[BGR_CHROMA_CHUNK];
+    uint8_t v[BGR_CHROMA_CHUNK];
+
+    size_t chromaWidth = width / 2;
+
+    // Both rows that share a chroma row are converted chunk by chunk, so each chunk
+    // is deinterleaved once.
+    for( uint16_t row = 0; row < height; row += 2 )
+    {
+        for( size_t start = 0; start < chromaWidth; start += BGR_CHROMA_CHUNK )
+        {
+            size_t count = (chromaWidth - start < BGR_CHROMA_CHUNK) ? chromaWidth - start : BGR_CHROMA_CHUNK;
+
+            kernels.deinterleaveUV( uv + (start * 2), u, v, count );
+
+            for( size_t i = 0; i < 2; i++ )
+            {
+                kernels.yuvToBGRRow( y + (i * yPitch) + (start * 2),
+                                     u,
+                                     v,
+                                     dest + (i * destPitch) + (start * 2 * bytesPerPixel),
+                                     count * 2,
+                                     bytesPerPixel,
+                                     coefficients );
+            }
+        }
+
+        y += yPitch * 2;
+        uv += uvPitch;
+        dest += destPitch * 2;
+    }
+}
+
+NV12Scaler::NV12Scaler( uint16_t inputWidth,
+                        uint16_t inputHeight,
+                        uint16_t outputWidth,
+                        uint16_t outputHeight ) :
+    _inputWidth( inputWidth ),
+    _inputHeight( inputHeight ),
+    _outputWidth( outputWidth ),
+    _outputHeight( outputHeight ),
+    _luma(),
+    _chroma(),
+    _y( NULL ),
+    _yPitch( 0 ),
+    _uv( NULL ),
+    _uvPitch( 0 ),
+    _quarterRows()
+{
+    if( _inputWidth < 2 || _inputHeight < 2 || _outputWidth < 2 || _outputHeight < 2 )
+        X_THROW(( "Invalid NV12Scaler size (%ux%u to %ux%u).", _inputWidth, _inputHeight, _outputWidth, _outputHeight ));
+
+    if( (_outputWidth % 2) != 0 || (_outputHeight % 2) != 0 )
+        X_THROW(( "NV12Scaler output width and height must be even." ));
+
+    _InitPlane( _luma, _inputWidth, _inputHeight, _outputWidth, _outputHeight );
+    _InitPlane( _chroma, _inputWidth / 2, _inputHeight / 2, _outputWidth / 2, _outputHeight / 2 );
+
+    for( size_t i = 0; i < NUM_CHROMA_SLOTS; i++ )
+    {
+        _chromaRows[i][0].resize( _chroma.inputWidth );
+        _chromaRows[i][1].resize( _chroma.inputWidth );
+    }
+
+    _horizontalRows[COMPONENT_Y][0].resize( _luma.outputWidth );
+    _horizontalRows[COMPONENT_Y][1].resize( _luma.outputWidth );
+
+    for( int component = COMPONENT_U; component <= COMPONENT_V; component++ )
+    {
+        _horizontalRows[component][0].resize( _chroma.outputWidth );
+        _horizontalRows[component][1].resize( _chroma.outputWidth );
+    }
+
+    _quarterRows[0].resize( _luma.outputWidth * 2 );
+    _quarterRows[1].resize( _luma.outputWidth * 2 );
+
+    _bgrRows[COMPONENT_Y].resize( _luma.outputWidth );
+    _bgrRows[COMPONENT_U].resize( _chroma.outputWidth );
+    _bgrRows[COMPONENT_V].resize( _chroma.outputWidth );
+
+    _ResetRows();
+}
+
+NV12Scaler::~NV12Scaler() throw()
+{
+}
+
+void NV12Scaler::ToI420( const uint8_t* y,
+                         size_t yPitch,
+                         const uint8_t* uv,
+                         size_t uvPitch,
+                         uint8_t* const dest[3],
+                         const size_t destPitches[3] )
+{
+    _y = y;
+    _yPitch = yPitch;
+    _uv = uv;
+    _uvPitch = uvPitch;
+    _ResetRows();
+
+    uint8_t* dstY = dest[0];
+
+    for( size_t row = 0; row < _luma.outputHeight; row++ )
+    {
+        _ScaleRow( COMPONENT_Y, _luma, row, dstY );
+        dstY += destPitches[0];
+    }
+
+    uint8_t* u = dest[1];
+    uint8_t* v = dest[2];
+
+    // U and V rows are produced together, so each source chroma row is only
+    // deinterleaved once.
+    for( size_t row = 0; row < _chroma.outputHeight; row++ )
+    {
+        _ScaleRow( COMPONENT_U, _chroma, row, u );
+        _ScaleRow( COMPONENT_V, _chroma, row, v );
+        u += destPitches[1];
+        v += destPitches[2];
+    }
+}
+
+void NV12Scaler::ToY8( const uint8_t* y, size_t yPitch, uint8_t* dest, size_t destPitch )
+{
+    _y = y;
+    _yPitch = yPitch;
+    _uv = NULL;
+    _uvPitch = 0;
+    _ResetRows();
+
+    for( size_t row = 0; row < _luma.outputHeight; row++ )
+    {
+        _ScaleRow( COMPONENT_Y, _luma, row, dest );
+        dest += destPitch;
+    }
+}
+
+void NV12Scaler::ToBGR( const uint8_t* y,
+                        size_t yPitch,
+                        const uint8_t* uv,
+                        size_t uvPitch,
+                        uint8_t* dest,
+                        size_t destPitch,
+                        size_t bytesPerPixel,
+                        bool fullRange )
+{
+    const struct ConvertKernels& kernels = Kernels();
+    const struct YUVCoefficients& coefficients = (fullRange) ? FULL_RANGE : VIDEO_RANGE;
+
+    _y = y;
+    _yPitch = yPitch;
+    _uv = uv;
+    _uvPitch = uvPitch;
+    _ResetRows();
+
+    // Each scaled row goes straight from the scratch rows into the conversion, so the
+    // picture is never stored as scaled YUV.
+    for( size_t row = 0; row < _luma.outputHeight; row++ )
+    {
+        _ScaleRow( COMPONENT_Y, _luma, row, &_bgrRows[COMPONENT_Y][0] );
+
+        if( (row % 2) == 0 )
+        {
+            _ScaleRow( COMPONENT_U, _chroma, row / 2, &_bgrRows[COMPONENT_U][0] );
+            _ScaleRow( COMPONENT_V, _chroma, row / 2, &_bgrRows[COMPONENT_V][0] );
+        }
+
+        kernels.yuvToBGRRow( &_bgrRows[COMPONENT_Y][0],
+                             &_bgrRows[COMPONENT_U][0],
+                             &_bgrRows[COMPONENT_V][0],
+                             dest,
+                             _luma.outputWidth,
+                             bytesPerPixel,
+                             coefficients );
+
+        dest += destPitch;
+    }
+}
+
+uint16_t NV12Scaler::GetInputWidth() const
+{
+    return _inputWidth;
+}
+
+uint16_t NV12Scaler::GetInputHeight() const
+{
+    return _inputHeight;
+}
+
+uint16_t NV12Scaler::GetOutputWidth() const
+{
+    return _outputWidth;
+}
+
+uint16_t NV12Scaler::GetOutputHeight() const
+{
+    return _outputHeight;
+}
+
+void NV12Scaler::_InitPlane( Plane& plane,
+                             size_t inputWidth,
+                             size_t inputHeight,
+                             size_t outputWidth,
+                             size_t outputHeight )
+{
+    plane.inputWidth = inputWidth;
+    plane.inputHeight = inputHeight;
+    plane.outputWidth = outputWidth;
+    plane.outputHeight = outputHeight;
+
+    if( inputWidth == outputWidth && inputHeight == outputHeight )
+        plane.method = METHOD_COPY;
+    else if( inputWidth == (outputWidth * 2) && inputHeight == (outputHeight * 2) )
+        plane.method = METHOD_HALF;
+    else if( inputWidth == (outputWidth * 4) && inputHeight == (outputHeight * 4) )
+        plane.method = METHOD_QUARTER;
+    else plane.method = METHOD_BILINEAR;
+
+    // Output pixel centers map back to (out + 0.5) * in / out - 0.5 in the source,
+    // kept here as 24.8 fixed point.
+    plane.xIndex.resize( outputWidth );
+    plane.xNext.resize( outputWidth );
+    plane.xWeight.resize( outputWidth );
+
+    for( size_t i = 0; i < outputWidth; i++ )
+    {
+        int64_t pos = ((((int64_t)i * 2 + 1) * (int64_t)inputWidth - (int64_t)outputWidth) * 256) / ((int64_t)outputWidth * 2);
+        if( pos < 0 )
+            pos = 0;
+
+        plane.xIndex[i] = (uint32_t)(pos >> 8);
+        plane.xWeight[i] = (uint16_t)(pos & 0xff);
+
+        if( plane.xIndex[i] >= (inputWidth - 1) )
+        {
+            plane.xIndex[i] = (uint32_t)(inputWidth - 1);
+            plane.xWeight[i] = 0;
+        }
+
+        plane.xNext[i] = (plane.xIndex[i] + 1 < inputWidth) ? plane.xIndex[i] + 1 : plane.xIndex[i];
+    }
+
+    plane.yIndex.resize( outputHeight );
+    plane.yNext.resize( outputHeight );
+    plane.yWeight.resize( outputHeight );
+
+    for( size_t i = 0; i < outputHeight; i++ )
+    {
+        int64_t pos = ((((int64_t)i * 2 + 1) * (int64_t)inputHeight - (int64_t)outputHeight) * 256) / ((int64_t)outputHeight * 2);
+        if( pos < 0 )
+            pos = 0;
+
+        plane.yIndex[i] = (uint32_t)(pos >> 8);
+        plane.yWeight[i] = (uint16_t)(pos & 0xff);
+
+        if( plane.yIndex[i] >= (inputHeight - 1) )
+        {
+            plane.yIndex[i] = (uint32_t)(inputHeight - 1);
+            plane.yWeight[i] = 0;
+        }
+
+        plane.yNext[i] = (plane.yIndex[i] + 1 < inputHeight) ? plane.yIndex[i] + 1 : plane.yIndex[i];
+    }
+}
+
+void NV12Scaler::_ResetRows()
+{
+    for( size_t i = 0; i < NUM_CHROMA_SLOTS; i++ )
+        _chromaRowIndex[i] = (size_t)-1;
+
+    for( size_t i = 0; i < 3; i++ )
+    {
+        _horizontalRowIndex[i][0] = (size_t)-1;
+        _horizontalRowIndex[i][1] = (size_t)-1;
+    }
+}
+
+const uint8_t* NV12Scaler::_GetRow( Component component, size_t row )
+{
+    if( component == COMPONENT_Y )
+        return _y + (row * _yPitch);
+
+    // Every method reads at most NUM_CHROMA_SLOTS consecutive rows per output row,
+    // so indexing the slots by row number never evicts a row still in use.
+    size_t slot = row % NUM_CHROMA_SLOTS;
+
+    if( _chromaRowIndex[slot] != row )
+    {
+        Kernels().deinterleaveUV( _uv + (row * _uvPitch),
+                                  &_chromaRows[slot][0][0],
+                                  &_chromaRows[slot][1][0],
+                                  _chroma.inputWidth );
+        _chromaRowIndex[slot] = row;
+    }
+
+    return &_chromaRows[slot][(component == COMPONENT_U) ? 0 : 1][0];
+}
+
+const uint8_t* NV12Scaler::_GetHorizontalRow( Component component, const Plane& plane, size_t row )
+{
+    size_t slot = row % 2;
+
+    uint8_t* dest = &_horizontalRows[component][slot][0];
+
+    if( _horizontalRowIndex[component][slot] == row )
+        return dest;
+
+    const uint8_t* src = _GetRow( component, row );
+
+    for( size_t i = 0; i < plane.outputWidth; i++ )
+    {
+        uint32_t weight = plane.xWeight[i];
+        dest[i] = (uint8_t)(((src[plane.xIndex[i]] * (256 - weight)) + (src[plane.xNext[i]] * weight) + 128) >> 8);
+    }
+
+    _horizontalRowIndex[component][slot] = row;
+
+    return dest;
+}
+
+void NV12Scaler::_ScaleRow( Component component, const Plane& plane, size_t row, uint8_t* dest )
+{
+    const struct ConvertKernels& kernels = Kernels();
+
+    switch( plane.method )
+    {
+    case METHOD_COPY:
+        memcpy( dest, _GetRow( component, row ), plane.outputWidth );
+        break;
+    case METHOD_HALF:
+        kernels.halveRows( _GetRow( component, row * 2 ),
+                           _GetRow( component, (row * 2) + 1 ),
+                           dest,
+                           plane.outputWidth );
+        break;
+    case METHOD_QUARTER:
+        kernels.halveRows( _GetRow( component, row * 4 ),
+                           _GetRow( component, (row * 4) + 1 ),
+                           &_quarterRows[0][0],
+                           plane.outputWidth * 2 );
+        kernels.halveRows( _GetRow( component, (row * 4) + 2 ),
+                           _GetRow( component, (row * 4) + 3 ),
+                           &_quarterRows[1][0],
+                           plane.outputWidth * 2 );
+        kernels.halveRows( &_quarterRows[0][0], &_quarterRows[1][0], dest, plane.outputWidth );
+        break;
+    case METHOD_BILINEAR:
+    default:
+        kernels.blendRows( _GetHorizontalRow( component, plane, plane.yIndex[row] ),
+                           _GetHorizontalRow( component, plane, plane.yNext[row] ),
+                           plane.yWeight[row],
+                           dest,
+                           plane.outputWidth );
+        break;
+    }
+}
+
+const char* GetConvertKernelName()
+{
+    return Kernels().name;
+}
+
+}
@@ -0,0 +1,218 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#include "VAKit/PacketPool.h"
+#include "XSDK/XException.h"
+#include "XSDK/XGuard.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+using namespace VAKit;
+using namespace AVKit;
+using namespace XSDK;
+using namespace std;
+
+// Enough for the widest SIMD stores the conversion kernels make.
+static const size_t BUFFER_ALIGNMENT = 64;
+
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+PacketPool::PacketPool( size_t maxFree, PoolMemory memory ) :
+    _lock(),
+    _maxFree( maxFree ),
+    _memory( memory ),
+    _free(),
+    _allocations( 0 ),
+    _reuses( 0 ),
+    _outstanding( 0 ),
+    _bytes( 0 )
+{
+}
+
+PacketPool::~PacketPool() throw()
+{
+    Trim();
+}
+
+XIRef<Packet> PacketPool::Get( size_t sz )
+{
+    struct Buffer buffer;
+    buffer.data = NULL;
+    buffer.size = 0;
+
+    {
+        XGuard g( _lock );
+
+        // The smallest idle buffer that fits, so small requests do not tie up the
+        // buffers large ones need.
+        size_t best = _free.size();
+
+        for( size_t i = 0; i < _free.size(); i++ )
+        {
+            if( _free[i].size >= sz && (best == _free.size() || _free[i].size < _free[best].size) )
+                best = i;
+        }
+
+        if( best != _free.size() )
+        {
+            buffer = _free[best];
+            _free[best] = _free.back();
+            _free.pop_back();
+            _reuses++;
+        }
+
+        _outstanding++;
+    }
+
+    try
+    {
+        if( !buffer.data )
+            buffer = _Allocate( sz );
+
+        return new PooledPacket( this, buffer, sz );
+    }
+    catch( ... )
+    {
+        {
+            XGuard g( _lock );
+            _outstanding--;
+        }
+
+        if( buffer.data )
+            _Return( buffer );
+
+        throw;
+    }
+}
+
+struct PacketPoolStats PacketPool::GetStats() const
+{
+    XGuard g( _lock );
+
+    struct PacketPoolStats stats;
+    stats.allocations = _allocations;
+    stats.reuses = _reuses;
+    stats.freeBuffers = _free.size();
+    stats.outstanding = _outstanding;
+    stats.bytes = _bytes;
+
+    return stats;
+}
+
+void PacketPool::Trim()
+{
+    vector<struct Buffer> buffers;
+
+    {
+        XGuard g( _lock );
+        buffers.swap( _free );
+    }
+
+    for( size_t i = 0; i < buffers.size(); i++ )
+        _Free( buffers[i] );
+}
+
+struct PacketPool::Buffer PacketPool::_Allocate( size_t size )
+{
+    struct Buffer buffer;
+    buffer.size = (size > 0) ? size : 1;
+    buffer.data = NULL;
+
+    size_t alignment = BUFFER_ALIGNMENT;
+
+    if( _memory == POOL_MEMORY_HUGE_PAGES )
+    {
+        alignment = HUGE_PAGE_SIZE;
+        buffer.size = ((buffer.size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE;
+    }
+    else if( _memory == POOL_MEMORY_LOCKED )
+    {
+        size_t pageSize = (size_t)sysconf( _SC_PAGESIZE );
+        alignment = pageSize;
+        buffer.size = ((buffer.size + pageSize - 1) / pageSize) * pageSize;
+    }
+
+    void* data = NULL;
+    if( posix_memalign( &data, alignment, buffer.size ) != 0 )
+        X_THROW(( "Unable to allocate %u byte packet buffer.", (unsigned int)buffer.size ));
+
+    buffer.data = (uint8_t*)data;
+
+    if( _memory == POOL_MEMORY_HUGE_PAGES )
+    {
+#ifdef MADV_HUGEPAGE
+        if( madvise( buffer.data, buffer.size, MADV_HUGEPAGE ) != 0 )
+            X_LOG_WARNING( "Unable to use huge pages for packet buffer." );
+#endif
+    }
+    else if( _memory == POOL_MEMORY_LOCKED )
+    {
+        if( mlock( buffer.data, buffer.size ) != 0 )
+            X_LOG_WARNING( "Unable to lock packet buffer in memory." );
+    }
+
+    XGuard g( _lock );
+    _allocations++;
+    _bytes += buffer.size;
+
+    return buffer;
+}
+
+void PacketPool::_Free( struct Buffer& buffer )
+{
+    if( _memory == POOL_MEMORY_LOCKED )
+        munlock( buffer.data, buffer.size );
+
+    free( buffer.data );
+
+    {
+        XGuard g( _lock );
+        _bytes -= buffer.size;
+    }
+
+    buffer.data = NULL;
+    buffer.size = 0;
+}
+
+void PacketPool::_Return( const struct Buffer& buffer )
+{
+    {
+        XGuard g( _lock );
+
+        if( _free.size() < _maxFree )
+        {
+            _free.push_back( buffer );
+            return;
+        }
+    }
+
+    struct Buffer extra = buffer;
+    _Free( extra );
+}
+
+PacketPool::PooledPacket::PooledPacket( PacketPool* pool, const struct Buffer& buffer, size_t sz ) :
+    Packet( buffer.data, sz, false ),
+    _pool( pool ),
+    _buffer( buffer )
+{
+}
+
+PacketPool::PooledPacket::~PooledPacket() throw()
+{
+    {
+        XGuard g( _pool->_lock );
+        _pool->_outstanding--;
+    }
+
+    _pool->_Return( _buffer );
+}
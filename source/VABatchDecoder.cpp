@@ -0,0 +1,201 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#include "VAKit/VABatchDecoder.h"
+#include "XSDK/XException.h"
+#include "XSDK/XGuard.h"
+
+#include <map>
+#include <unistd.h>
+
+using namespace VAKit;
+using namespace AVKit;
+using namespace XSDK;
+using namespace std;
+
+static struct BatchPicture _MakeError( VAH264Decoder* decoder, int64_t pts, const XString& error )
+{
+    struct BatchPicture picture;
+    picture.decoder = decoder;
+    picture.pts = pts;
+    picture.key = false;
+    picture.error = error;
+
+    return picture;
+}
+
+VABatchDecoder::VABatchDecoder( size_t numThreads ) :
+    _lock(),
+    _cond( _lock ),
+    _workers(),
+    _jobs(),
+    _nextJob( 0 ),
+    _jobsDone( 0 ),
+    _running( true )
+{
+    if( numThreads == 0 )
+    {
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+        numThreads = (cpus > 0) ? (size_t)cpus : 1;
+    }
+
+    for( size_t i = 0; i < numThreads; i++ )
+    {
+        _workers.push_back( new Worker( this ) );
+        _workers.back()->Start();
+    }
+}
+
+VABatchDecoder::~VABatchDecoder() throw()
+{
+    {
+        XGuard g( _lock );
+        _running = false;
+        _cond.Broadcast();
+    }
+
+    for( size_t i = 0; i < _workers.size(); i++ )
+    {
+        _workers[i]->Join();
+        delete _workers[i];
+    }
+}
+
+void VABatchDecoder::Decode( const vector<struct BatchItem>& items, vector<struct BatchPicture>& output )
+{
+    vector<struct Job> jobs;
+    map<VAH264Decoder*, size_t> jobIndexes;
+
+    // Submit everything first. Nothing here waits on the hardware.
+    for( size_t i = 0; i < items.size(); i++ )
+    {
+        const struct BatchItem& item = items[i];
+
+        if( jobIndexes.find( item.decoder ) == jobIndexes.end() )
+        {
+            jobIndexes[item.decoder] = jobs.size();
+
+            struct Job job;
+            job.decoder = item.decoder;
+            jobs.push_back( job );
+        }
+
+        // A decoder given more packets than its output queue holds would drop the
+        // oldest pictures, so its queue is drained here first.
+        if( item.decoder->GetNumPictures() >= MAX_OUTPUT_PICTURES )
+            _Drain( jobs[jobIndexes[item.decoder]] );
+
+        try
+        {
+            item.decoder->Decode( item.packet, item.pts );
+        }
+        catch( XException& ex )
+        {
+            jobs[jobIndexes[item.decoder]].pictures.push_back( _MakeError( item.decoder, item.pts, ex.what() ) );
+        }
+    }
+
+    if( jobs.empty() )
+        return;
+
+    {
+        XGuard g( _lock );
+
+        _jobs.swap( jobs );
+        _nextJob = 0;
+        _jobsDone = 0;
+
+        _cond.Broadcast();
+
+        while( _jobsDone < _jobs.size() )
+            _cond.Wait();
+
+        _jobs.swap( jobs );
+        _nextJob = 0;
+        _jobsDone = 0;
+    }
+
+    for( size_t i = 0; i < jobs.size(); i++ )
+        output.insert( output.end(), jobs[i].pictures.begin(), jobs[i].pictures.end() );
+}
+
+size_t VABatchDecoder::GetNumThreads() const
+{
+    return _workers.size();
+}
+
+void VABatchDecoder::_Drain( struct Job& job )
+{
+    VAH264Decoder* decoder = job.decoder;
+
+    while( decoder->GetNumPictures() > 0 )
+    {
+        try
+        {
+            struct BatchPicture picture;
+            picture.decoder = decoder;
+            picture.picture = decoder->Get();
+            picture.pts = decoder->GetPTS();
+            picture.key = decoder->LastWasKey();
+
+            job.pictures.push_back( picture );
+        }
+        catch( XException& ex )
+        {
+            // Get() has released the failed picture, so the rest are still there.
+            job.pictures.push_back( _MakeError( decoder, decoder->GetPTS(), ex.what() ) );
+        }
+    }
+}
+
+VABatchDecoder::Worker::Worker( VABatchDecoder* parent ) :
+    XThread( "VABatchDecoder" ),
+    _parent( parent )
+{
+}
+
+VABatchDecoder::Worker::~Worker() throw()
+{
+}
+
+void* VABatchDecoder::Worker::EntryPoint()
+{
+    while( true )
+    {
+        struct Job* job = NULL;
+
+        {
+            XGuard g( _parent->_lock );
+
+            while( _parent->_running && _parent->_nextJob >= _parent->_jobs.size() )
+                _parent->_cond.Wait();
+
+            if( !_parent->_running )
+                break;
+
+            job = &_parent->_jobs[_parent->_nextJob++];
+        }
+
+        // _jobs is not resized until every job is done, so job stays valid.
+        _Drain( *job );
+
+        {
+            XGuard g( _parent->_lock );
+
+            _parent->_jobsDone++;
+
+            if( _parent->_jobsDone == _parent->_jobs.size() )
+                _parent->_cond.Broadcast();
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,492 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#include "VAKit/VADecodeScheduler.h"
+#include "XSDK/XException.h"
+#include "XSDK/XGuard.h"
+#include "XSDK/TimeUtils.h"
+#include "VAKit/NALTypes.h"
+
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+
+using namespace VAKit;
+using namespace AVKit;
+using namespace XSDK;
+using namespace std;
+
+// The most packets a stream decodes per turn on a worker, so one busy stream can
+// not starve the others sharing that worker.
+static const size_t MAX_PACKETS_PER_TURN = 8;
+
+enum PacketClass
+{
+    PACKET_KEEP,
+    PACKET_IDR,
+    PACKET_REFERENCE,
+    PACKET_NON_REFERENCE
+};
+
+static PacketClass _Classify( XIRef<Packet> packet )
+{
+    vector<NALUnit> units;
+    FindNALUnits( packet->Map(), packet->GetDataSize(), units );
+
+    bool parameterSets = false;
+    bool slices = false;
+    bool reference = false;
+
+    // IDRs usually carry their SPS and PPS in band, so the whole access unit is
+    // looked at before deciding it is only parameter sets.
+    for( size_t i = 0; i < units.size(); i++ )
+    {
+        const NALUnit& unit = units[i];
+
+        if( unit.type == NAL_IDR )
+            return PACKET_IDR;
+
+        if( unit.type == NAL_SPS || unit.type == NAL_PPS )
+            parameterSets = true;
+
+        if( unit.type == NAL_NON_IDR )
+        {
+            slices = true;
+            if( unit.refIDC != 0 )
+                reference = true;
+        }
+    }
+
+    if( parameterSets || !slices )
+        return PACKET_KEEP;
+
+    return (reference) ? PACKET_REFERENCE : PACKET_NON_REFERENCE;
+}
+
+VADecodeScheduler::VADecodeScheduler( size_t numWorkers, const vector<int>& cpus ) :
+    _lock(),
+    _removeCond( _lock ),
+    _workers(),
+    _wakeups(),
+    _idle( numWorkers, false ),
+    _readyQueues( numWorkers ),
+    _streams(),
+    _nextID( 0 ),
+    _nextWorker( 0 ),
+    _running( true )
+{
+    if( numWorkers == 0 )
+        X_THROW(( "VADecodeScheduler needs at least one worker." ));
+
+    for( size_t i = 0; i < numWorkers; i++ )
+        _wakeups.push_back( new XCondition( _lock ) );
+
+    for( size_t i = 0; i < numWorkers; i++ )
+    {
+        int cpu = (cpus.empty()) ? -1 : cpus[i % cpus.size()];
+
+        _workers.push_back( new Worker( this, i, cpu ) );
+        _workers.back()->Start();
+    }
+}
+
+VADecodeScheduler::~VADecodeScheduler() throw()
+{
+    {
+        XGuard g( _lock );
+        _running = false;
+
+        for( size_t i = 0; i < _wakeups.size(); i++ )
+            _wakeups[i]->Signal();
+    }
+
+    for( size_t i = 0; i < _workers.size(); i++ )
+    {
+        _workers[i]->Join();
+        delete _workers[i];
+    }
+
+    for( size_t i = 0; i < _wakeups.size(); i++ )
+        delete _wakeups[i];
+
+    for( map<int, struct Stream*>::iterator i = _streams.begin(); i != _streams.end(); i++ )
+        delete i->second;
+}
+
+int VADecodeScheduler::AddStream( VAH264Decoder* decoder, Callback* callback )
+{
+    if( !decoder || !callback )
+        X_THROW(( "VADecodeScheduler streams need a decoder and a callback." ));
+
+    // The worker is the stream's thread. A readback thread per stream would bring
+    // back the thread per stream the pool is there to avoid.
+    decoder->SetReadbackDepth( 1 );
+
+    XGuard g( _lock );
+
+    struct Stream* stream = new struct Stream;
+    stream->id = _nextID++;
+    stream->decoder = decoder;
+    stream->callback = callback;
+    stream->latencyBudget = 0.0;
+    stream->shedding.level = SHED_NONE;
+    stream->shedding.nonReferenceDropped = 0;
+    stream->shedding.nonKeyDropped = 0;
+    stream->shedding.latePackets = 0;
+    stream->ready = false;
+    stream->running = false;
+    stream->removed = false;
+
+    // New streams are spread round robin. Stealing evens out whatever imbalance
+    // that leaves.
+    stream->worker = _nextWorker;
+    _nextWorker = (_nextWorker + 1) % _workers.size();
+
+    _streams[stream->id] = stream;
+
+    return stream->id;
+}
+
+void VADecodeScheduler::RemoveStream( int stream )
+{
+    XGuard g( _lock );
+
+    struct Stream* s = _FindStream( stream );
+
+    s->removed = true;
+
+    if( s->ready )
+    {
+        deque<struct Stream*>& queue = _readyQueues[s->worker];
+        queue.erase( std::remove( queue.begin(), queue.end(), s ), queue.end() );
+        s->ready = false;
+    }
+
+    while( s->running )
+        _removeCond.Wait();
+
+    _streams.erase( stream );
+
+    delete s;
+}
+
+void VADecodeScheduler::Submit( int stream, XIRef<Packet> packet, int64_t pts )
+{
+    Submit( stream, packet, pts, -1.0 );
+}
+
+void VADecodeScheduler::Submit( int stream, XIRef<Packet> packet, int64_t pts, double deadline )
+{
+    uint64_t arrival = XMonoClock::GetTime();
+
+    XGuard g( _lock );
+
+    struct Stream* s = _FindStream( stream );
+
+    struct QueuedPacket queued;
+    queued.packet = packet;
+    queued.pts = pts;
+    queued.arrival = arrival;
+    queued.deadline = deadline;
+
+    s->packets.push_back( queued );
+
+    if( !s->ready && !s->running )
+    {
+        _MakeReady( s );
+        _Wake( s->worker );
+    }
+}
+
+size_t VADecodeScheduler::GetQueuedPackets( int stream ) const
+{
+    XGuard g( _lock );
+
+    return _FindStream( stream )->packets.size();
+}
+
+void VADecodeScheduler::SetLatencyBudget( int stream, double budget )
+{
+    XGuard g( _lock );
+
+    _FindStream( stream )->latencyBudget = budget;
+}
+
+double VADecodeScheduler::GetLatencyBudget( int stream ) const
+{
+    XGuard g( _lock );
+
+    return _FindStream( stream )->latencyBudget;
+}
+
+struct VADecodeScheduler::SheddingStats VADecodeScheduler::GetSheddingStats( int stream ) const
+{
+    XGuard g( _lock );
+
+    return _FindStream( stream )->shedding;
+}
+
+struct VADecodeScheduler::Stream* VADecodeScheduler::_FindStream( int stream ) const
+{
+    // Called with _lock held.
+    map<int, struct Stream*>::const_iterator found = _streams.find( stream );
+
+    if( found == _streams.end() || found->second->removed )
+        X_THROW(( "Unknown decode stream %d.", stream ));
+
+    return found->second;
+}
+
+struct VADecodeScheduler::Stream* VADecodeScheduler::_NextStream( size_t worker )
+{
+    // Called with _lock held. Our own streams come first, oldest first. Otherwise we
+    // steal the most recently readied stream from the first worker that has one,
+    // which is the one least likely to still be warm in that worker's cache.
+    struct Stream* stream = NULL;
+
+    if( !_readyQueues[worker].empty() )
+    {
+        stream = _readyQueues[worker].front();
+        _readyQueues[worker].pop_front();
+    }
+    else
+    {
+        for( size_t i = 1; i < _readyQueues.size() && !stream; i++ )
+        {
+            deque<struct Stream*>& victim = _readyQueues[(worker + i) % _readyQueues.size()];
+
+            if( !victim.empty() )
+            {
+                stream = victim.back();
+                victim.pop_back();
+            }
+        }
+    }
+
+    if( stream )
+    {
+        stream->ready = false;
+        stream->worker = worker;
+    }
+
+    return stream;
+}
+
+void VADecodeScheduler::_MakeReady( struct Stream* stream )
+{
+    // Called with _lock held.
+    _readyQueues[stream->worker].push_back( stream );
+    stream->ready = true;
+}
+
+void VADecodeScheduler::_Wake( size_t worker )
+{
+    // Called with _lock held. The stream's own worker if it is idle, otherwise any
+    // idle worker, which will steal it. A worker is marked busy as it is signalled so
+    // the next stream made ready wakes a different one.
+    if( !_idle[worker] )
+    {
+        for( size_t i = 1; i < _idle.size(); i++ )
+        {
+            size_t candidate = (worker + i) % _idle.size();
+
+            if( _idle[candidate] )
+            {
+                worker = candidate;
+                break;
+            }
+        }
+
+        // Everybody is busy. Whoever finishes a turn first will find the stream.
+        if( !_idle[worker] )
+            return;
+    }
+
+    _idle[worker] = false;
+    _wakeups[worker]->Signal();
+}
+
+void VADecodeScheduler::_Run( struct Stream* stream,
+                              list<struct QueuedPacket>& packets,
+                              double latencyBudget,
+                              struct SheddingStats& shedding )
+{
+    // Runs without _lock. Nothing else touches this stream's decoder while it is
+    // marked running.
+    VAH264Decoder* decoder = stream->decoder;
+
+    for( list<struct QueuedPacket>::iterator i = packets.begin(); i != packets.end(); i++ )
+    {
+        if( _Shed( *i, latencyBudget, shedding ) )
+        {
+            stream->callback->OnDropped( stream->id, i->pts, shedding.level );
+            continue;
+        }
+
+        try
+        {
+            decoder->Decode( i->packet, i->pts );
+
+            while( decoder->GetNumPictures() > 0 )
+            {
+                XIRef<Packet> picture = decoder->Get();
+                stream->callback->OnPicture( stream->id, picture, decoder->GetPTS(), decoder->LastWasKey() );
+            }
+        }
+        catch( XException& ex )
+        {
+            stream->callback->OnError( stream->id, ex.what() );
+        }
+    }
+}
+
+bool VADecodeScheduler::_Shed( const struct QueuedPacket& queued, double latencyBudget, struct SheddingStats& shedding )
+{
+    // Returns true if the packet should be dropped. A packet with no deadline of its
+    // own, on a stream without a budget, counts as on time.
+    bool hasDeadline = (queued.deadline >= 0.0 || latencyBudget > 0.0);
+
+    if( !hasDeadline && shedding.level == SHED_NONE )
+        return false;
+
+    double deadline = (queued.deadline < 0.0) ? latencyBudget : queued.deadline;
+    double lateness = 0.0;
+
+    if( hasDeadline )
+        lateness = XMonoClock::GetElapsedTime( queued.arrival, XMonoClock::GetTime() ) - deadline;
+
+    PacketClass packetClass = _Classify( queued.packet );
+
+    if( lateness > 0.0 )
+        shedding.latePackets++;
+
+    // The stream can always start over at an IDR, and packets without slices (or
+    // with parameter sets) are cheap and needed later.
+    if( packetClass == PACKET_IDR || packetClass == PACKET_KEEP )
+    {
+        if( packetClass == PACKET_IDR )
+            shedding.level = (lateness > 0.0) ? SHED_NON_REFERENCE : SHED_NONE;
+
+        return false;
+    }
+
+    if( shedding.level != SHED_TO_IDR )
+    {
+        if( lateness > deadline )
+        {
+            X_LOG_NOTICE( "Decode stream more than %f seconds behind, dropping pictures until the next IDR.", deadline );
+            shedding.level = SHED_TO_IDR;
+        }
+        else if( lateness > 0.0 )
+        {
+            if( shedding.level == SHED_NONE )
+                shedding.level = SHED_NON_REFERENCE;
+        }
+        else shedding.level = SHED_NONE;
+    }
+
+    if( shedding.level == SHED_TO_IDR )
+    {
+        shedding.nonKeyDropped++;
+        return true;
+    }
+
+    if( shedding.level == SHED_NON_REFERENCE && packetClass == PACKET_NON_REFERENCE )
+    {
+        shedding.nonReferenceDropped++;
+        return true;
+    }
+
+    return false;
+}
+
+VADecodeScheduler::Worker::Worker( VADecodeScheduler* parent, size_t index, int cpu ) :
+    XThread( "VADecodeScheduler" ),
+    _parent( parent ),
+    _index( index ),
+    _cpu( cpu )
+{
+}
+
+VADecodeScheduler::Worker::~Worker() throw()
+{
+}
+
+void* VADecodeScheduler::Worker::EntryPoint()
+{
+    if( _cpu >= 0 )
+    {
+        cpu_set_t cpuSet;
+        CPU_ZERO( &cpuSet );
+        CPU_SET( _cpu, &cpuSet );
+
+        if( pthread_setaffinity_np( pthread_self(), sizeof(cpuSet), &cpuSet ) != 0 )
+            X_LOG_WARNING( "Unable to pin decode worker %u to CPU %d.", (unsigned int)_index, _cpu );
+    }
+
+    while( true )
+    {
+        struct Stream* stream = NULL;
+        list<struct QueuedPacket> packets;
+        double latencyBudget = 0.0;
+        struct SheddingStats shedding;
+
+        {
+            XGuard g( _parent->_lock );
+
+            while( _parent->_running && (stream = _parent->_NextStream( _index )) == NULL )
+            {
+                _parent->_idle[_index] = true;
+                _parent->_wakeups[_index]->Wait();
+            }
+
+            _parent->_idle[_index] = false;
+
+            if( !_parent->_running )
+                break;
+
+            stream->running = true;
+            latencyBudget = stream->latencyBudget;
+            shedding = stream->shedding;
+
+            while( !stream->packets.empty() && packets.size() < MAX_PACKETS_PER_TURN )
+            {
+                packets.push_back( stream->packets.front() );
+                stream->packets.pop_front();
+            }
+        }
+
+        _parent->_Run( stream, packets, latencyBudget, shedding );
+
+        {
+            XGuard g( _parent->_lock );
+
+            stream->running = false;
+            stream->shedding = shedding;
+
+            // Streams with more work go to the back of our own queue, behind the
+            // streams that have been waiting. Those are left to an idle worker to
+            // steal, if there is one.
+            if( !stream->removed && !stream->packets.empty() )
+            {
+                _parent->_MakeReady( stream );
+
+                if( _parent->_readyQueues[_index].size() > 1 )
+                    _parent->_Wake( _index );
+            }
+
+            if( stream->removed )
+                _parent->_removeCond.Broadcast();
+        }
+    }
+
+    return NULL;
+}
@@ -10,10 +10,14 @@
 //-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 
 #include "VAKit/VAH264Decoder.h"
+#include "VAKit/NV12Convert.h"
+#include "VAKit/NALTypes.h"
+#include "VAKit/DeviceCapabilities.h"
 #include "MediaParser/MediaParser.h"
 #include "XSDK/XException.h"
 #include "XSDK/XGuard.h"
 
+#include <algorithm>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -22,31 +26,61 @@ using namespace AVKit;
 using namespace XSDK;
 
 static const size_t DEFAULT_PADDING = 16;
+static const size_t DEFAULT_READBACK_DEPTH = 2;
 
 VAH264Decoder::VAH264Decoder( const struct CodecOptions& options ) :
     _codec( avcodec_find_decoder( CODEC_ID_H264 ) ),
     _context( avcodec_alloc_context3( _codec ) ),
     _options( options ),
     _frame( avcodec_alloc_frame() ),
-    _scaler( NULL ),
+    _scalerType( SCALER_BICUBIC ),
+    _conversion(),
+    _regions(),
+    _regionConversions(),
     _outputWidth( 0 ),
     _outputHeight( 0 ),
     _initComplete( false ),
     _fd( -1 ),
+    _display(),
     _vc(),
     _attrib(),
     _surfaces(),
-    _outputImage(),
+    _freeSurfaces(),
+    _retiredSurfaces(),
+    _surfaceWidth( 0 ),
+    _surfaceHeight( 0 ),
+    _vaWidth( 0 ),
+    _vaHeight( 0 ),
+    _peakSurfacesInUse( 0 ),
+    _surfaceGrows( 0 ),
+    _spsRefs( 0 ),
+    _nv12Format(),
+    _outputQueue(),
+    _freeImages(),
     _surfaceLock(),
-    _surfaceOrder( 0 ),
-    _pf( new PacketFactoryDefault )
+    _pf( new PacketFactoryDefault ),
+    _lastPTS( AV_NOPTS_VALUE ),
+    _lastKey( false ),
+    _outputFormat( OUTPUT_FORMAT_I420 ),
+    _decodeMode( DECODE_ALL ),
+    _decodeInterval( 1 ),
+    _intervalCount( 0 ),
+    _waitForIDR( false ),
+    _skippedPackets( 0 ),
+    _errorPolicy( ERROR_POLICY_THROW ),
+    _concealErrors( false ),
+    _corruptPackets( 0 ),
+    _droppedPictures( 0 ),
+    _loggedOverflow( false ),
+    _readbackDepth( DEFAULT_READBACK_DEPTH ),
+    _readbacks(),
+    _readbackLock(),
+    _readbackCond( _readbackLock ),
+    _readbackThread( NULL ),
+    _readbackRunning( false )
 {
-    _outputImage.image_id = VA_INVALID_ID;
     _vc.context_id = VA_INVALID_ID;
 
-    for( int i = 0; i < NUM_VA_BUFFERS; i++ )
-        _surfaces[i].id = VA_INVALID_ID;
-
     _vc.config_id = VA_INVALID_ID;
 
     _vc.display = NULL;
@@ -63,35 +97,66 @@ VAH264Decoder::VAH264Decoder( const struct CodecOptions& options ) :
     if( _options.device_path.IsNull() )
         X_THROW(( "device_path required for VAH264Decoder." ));
 
+    _InitConversion( _conversion );
+
     // We stash our this pointer INSIDE our AVCodecContext because in some FFMPEG
     // callback functions we use, we need to get at some members of our object...
     _context->opaque = (void*)this;
 }
 
-VAH264Decoder::VAH264Decoder( AVDeMuxer& deMuxer, const struct CodecOptions& options ) :
+VAH264Decoder::VAH264Decoder( AVDeMuxer& deMuxer, const struct CodecOptions& options, bool prewarm ) :
     _codec( avcodec_find_decoder( CODEC_ID_H264 ) ),
     _context( avcodec_alloc_context3( _codec ) ),
     _options( options ),
     _frame( avcodec_alloc_frame() ),
-    _scaler( NULL ),
+    _scalerType( SCALER_BICUBIC ),
+    _conversion(),
+    _regions(),
+    _regionConversions(),
     _outputWidth( 0 ),
     _outputHeight( 0 ),
     _initComplete( false ),
     _fd( -1 ),
+    _display(),
     _vc(),
     _attrib(),
     _surfaces(),
-    _outputImage(),
+    _freeSurfaces(),
+    _retiredSurfaces(),
+    _surfaceWidth( 0 ),
+    _surfaceHeight( 0 ),
+    _vaWidth( 0 ),
+    _vaHeight( 0 ),
+    _peakSurfacesInUse( 0 ),
+    _surfaceGrows( 0 ),
+    _spsRefs( 0 ),
+    _nv12Format(),
+    _outputQueue(),
+    _freeImages(),
     _surfaceLock(),
-    _surfaceOrder( 0 ),
-    _pf( new PacketFactoryDefault )
+    _pf( new PacketFactoryDefault ),
+    _lastPTS( AV_NOPTS_VALUE ),
+    _lastKey( false ),
+    _outputFormat( OUTPUT_FORMAT_I420 ),
+    _decodeMode( DECODE_ALL ),
+    _decodeInterval( 1 ),
+    _intervalCount( 0 ),
+    _waitForIDR( false ),
+    _skippedPackets( 0 ),
+    _errorPolicy( ERROR_POLICY_THROW ),
+    _concealErrors( false ),
+    _corruptPackets( 0 ),
+    _droppedPictures( 0 ),
+    _loggedOverflow( false ),
+    _readbackDepth( DEFAULT_READBACK_DEPTH ),
+    _readbacks(),
+    _readbackLock(),
+    _readbackCond( _readbackLock ),
+    _readbackThread( NULL ),
+    _readbackRunning( false )
 {
-    _outputImage.image_id = VA_INVALID_ID;
     _vc.context_id = VA_INVALID_ID;
 
-    for( int i = 0; i < NUM_VA_BUFFERS; i++ )
-        _surfaces[i].id = VA_INVALID_ID;
-
     _vc.config_id = VA_INVALID_ID;
 
     _vc.display = NULL;
@@ -112,13 +177,20 @@ VAH264Decoder::VAH264Decoder( AVDeMuxer& deMuxer, const struct CodecOptions& opt
     if( _options.device_path.IsNull() )
         X_THROW(( "device_path required for VAH264Decoder." ));
 
+    _InitConversion( _conversion );
+
     // We stash our this pointer INSIDE our AVCodecContext because in some FFMPEG
     // callback functions we use, we need to get at some members of our object...
     _context->opaque = (void*)this;
+
+    if( prewarm && _context->extradata && _context->extradata_size > 0 )
+        Prewarm( _context->extradata, _context->extradata_size );
 }
 
 VAH264Decoder::~VAH264Decoder() throw()
 {
+    _StopReadbackThread();
+
     _DestroyScaler();
 
     if( _frame )
@@ -139,60 +211,166 @@ VAH264Decoder::~VAH264Decoder() throw()
 
 bool VAH264Decoder::HasHW( const XString& devicePath )
 {
-    bool hasHW = true;
+    // Probed once per device, then answered from the cache.
+    return GetDeviceCapabilities( devicePath ).h264Decode.supported;
+}
+
+void VAH264Decoder::Prewarm( const uint8_t* extraData, size_t extraDataSize )
+{
+    if( _initComplete )
+        return;
+
+    std::vector<uint8_t> annexB;
+    _ToAnnexB( extraData, extraDataSize, annexB );
+
+    // Sizes the surface pool for the stream's references. If the SPS can not be
+    // read assume the H.264 max rather than undersize it.
+    _spsRefs = 16;
 
-    int fd = open( devicePath.c_str(), O_RDWR );
-    if( fd <= 0 )
-        hasHW = false;
+    std::vector<NALUnit> units;
+    FindNALUnits( &annexB[0], annexB.size(), units );
 
-    if( hasHW )
+    for( size_t i = 0; i < units.size(); i++ )
     {
-        VADisplay display = (VADisplay)vaGetDisplayDRM( fd );
-        if( !vaDisplayIsValid( display ) )
-            hasHW = false;
+        SPSInfo sps;
 
-        if( hasHW )
+        if( ParseSPS( units[i], sps ) )
         {
-            int majorVer = 0, minorVer = 0;
-            VAStatus status = vaInitialize( display, &majorVer, &minorVer );
-            if( status != VA_STATUS_SUCCESS )
-                hasHW = false;
+            _spsRefs = sps.maxNumRefFrames;
+            break;
+        }
+    }
 
-            if( hasHW )
-            {
-                VAConfigAttrib attrib;
-                attrib.type = VAConfigAttribRTFormat;
-                vaGetConfigAttributes( display, VAProfileH264High, VAEntrypointVLD, &attrib, 1 );
-                if( (attrib.value & VA_RT_FORMAT_YUV420) == 0 )
-                    hasHW = false;
+    _FinishFFMPEGInit( &annexB[0], annexB.size() );
+    _initComplete = true;
 
-                if( hasHW )
-                {
-                    VAConfigID configID = VA_INVALID_ID;
-                    VAStatus status = vaCreateConfig( display,
-                                                      VAProfileH264High,
-                                                      VAEntrypointVLD,
-                                                      &attrib,
-                                                      1,
-                                                      &configID );
-                    if( status != VA_STATUS_SUCCESS )
-                        hasHW = false;
-
-                    if( hasHW )
-                        vaDestroyConfig( display, configID );
-                }
-            }
+    // libavcodec would otherwise do this from get_format() during the first decode.
+    _InitVAAPIDecoder();
 
-            vaTerminate( display );
-        }
+    _PrimeOutputImages();
+}
 
-        close( fd );
+void VAH264Decoder::Prewarm( XIRef<XMemory> extraData )
+{
+    Prewarm( extraData->Map(), extraData->GetDataSize() );
+}
+
+void VAH264Decoder::SetDecodeMode( DecodeMode mode, uint32_t interval )
+{
+    if( interval == 0 )
+        X_THROW(( "Decode interval must be at least 1." ));
+
+    // Pictures after the last decoded IDR may predict from frames we skipped.
+    if( _decodeMode == DECODE_KEY && mode != DECODE_KEY )
+        _waitForIDR = true;
+
+    _decodeMode = mode;
+    _decodeInterval = interval;
+    _intervalCount = 0;
+
+    // libavcodec's own discard is a backstop for packets we can not parse (avcC
+    // rather than Annex B).
+    if( mode == DECODE_KEY )
+        _context->skip_frame = AVDISCARD_NONKEY;
+    else if( mode == DECODE_REFERENCE )
+        _context->skip_frame = AVDISCARD_NONREF;
+    else _context->skip_frame = AVDISCARD_DEFAULT;
+}
+
+DecodeMode VAH264Decoder::GetDecodeMode() const
+{
+    return _decodeMode;
+}
+
+uint32_t VAH264Decoder::GetDecodeInterval() const
+{
+    return _decodeInterval;
+}
+
+size_t VAH264Decoder::GetSkippedPackets() const
+{
+    return _skippedPackets;
+}
+
+void VAH264Decoder::SetErrorPolicy( ErrorPolicy policy )
+{
+    _errorPolicy = policy;
+}
+
+ErrorPolicy VAH264Decoder::GetErrorPolicy() const
+{
+    return _errorPolicy;
+}
+
+void VAH264Decoder::SetErrorConcealment( bool conceal )
+{
+    _concealErrors = conceal;
+
+    _context->error_concealment = (conceal) ? (FF_EC_GUESS_MVS | FF_EC_DEBLOCK) : 0;
+}
+
+bool VAH264Decoder::GetErrorConcealment() const
+{
+    return _concealErrors;
+}
+
+size_t VAH264Decoder::GetCorruptPackets() const
+{
+    return _corruptPackets;
+}
+
+size_t VAH264Decoder::GetDroppedPictures() const
+{
+    return _droppedPictures;
+}
+
+void VAH264Decoder::Reset()
+{
+    if( !_initComplete )
+        return;
+
+    _DropPictures();
+
+    // libavcodec lets go of its references, so every surface is free again.
+    avcodec_flush_buffers( _context );
+
+    _lastPTS = AV_NOPTS_VALUE;
+    _lastKey = false;
+}
+
+void VAH264Decoder::Reset( const uint8_t* extraData, size_t extraDataSize )
+{
+    if( !_initComplete )
+    {
+        Prewarm( extraData, extraDataSize );
+        return;
     }
 
-    return hasHW;
+    Reset();
+
+    std::vector<uint8_t> annexB;
+    _ToAnnexB( extraData, extraDataSize, annexB );
+
+    uint16_t width = 0, height = 0;
+    _GetPictureSize( &annexB[0], annexB.size(), width, height );
+
+    if( width == _vaWidth && height == _vaHeight )
+        return;
+
+    _context->width = width;
+    _context->height = height;
+
+    _ResizeVAAPIDecoder();
+
+    _PrimeOutputImages();
 }
 
 void VAH264Decoder::Decode( XIRef<Packet> frame )
+{
+    Decode( frame, AV_NOPTS_VALUE );
+}
+
+void VAH264Decoder::Decode( XIRef<Packet> frame, int64_t pts )
 {
     if( !_initComplete )
     {
@@ -200,31 +378,74 @@ void VAH264Decoder::Decode( XIRef<Packet> frame )
         _initComplete = true;
     }
 
+    if( (_decodeMode != DECODE_ALL || _waitForIDR) && !_AcceptPacket( frame->Map(), frame->GetDataSize() ) )
+    {
+        _skippedPackets++;
+        return;
+    }
+
     AVPacket inputPacket;
     av_init_packet( &inputPacket );
     inputPacket.data = frame->Map();
     inputPacket.size = frame->GetDataSize();
+    inputPacket.pts = pts;
 
-    int gotPicture = 0;
-    int ret = avcodec_decode_video2( _context,
-                                     _frame,
-                                     &gotPicture,
-                                     &inputPacket );
-    if( ret < 0 )
-        X_THROW(( "Decoding returned error: %d", ret ));
-
-    if( gotPicture < 1 )
-        X_THROW(( "Unable to decode frame." ));
-
-    VAStatus status = vaGetImage( _vc.display,
-                                  (VASurfaceID)(uintptr_t)_frame->data[3],
-                                  0,
-                                  0,
-                                  _context->width,
-                                  _context->height,
-                                  _outputImage.image_id );
-    if( status != VA_STATUS_SUCCESS )
-        X_THROW(("Unable to vaGetImage(): %s\n", vaErrorStr(status)));
+    // reordered_opaque travels with the picture through the decoder's reordering,
+    // so it comes back out attached to the right frame.
+    _context->reordered_opaque = pts;
+
+    // Callers that never call Get() should not pile up pictures, so the oldest
+    // pictures are dropped to make room.
+    while( _outputQueue.size() >= MAX_OUTPUT_PICTURES )
+    {
+        _ReleasePicture( _outputQueue.front() );
+        _outputQueue.pop_front();
+
+        _droppedPictures++;
+
+        // Once per decoder. A caller that never calls Get() would otherwise log
+        // every frame.
+        if( !_loggedOverflow )
+        {
+            X_LOG_WARNING( "Output queue full, dropping oldest decoded picture (see GetDroppedPictures())." );
+            _loggedOverflow = true;
+        }
+    }
+
+    while( inputPacket.size > 0 )
+    {
+        bool gotPicture = false;
+        int consumed = _Decode( &inputPacket, gotPicture );
+
+        if( consumed <= 0 && !gotPicture )
+            break;
+
+        inputPacket.data += consumed;
+        inputPacket.size -= consumed;
+    }
+}
+
+void VAH264Decoder::Flush()
+{
+    if( !_initComplete )
+        return;
+
+    AVPacket inputPacket;
+    av_init_packet( &inputPacket );
+    inputPacket.data = NULL;
+    inputPacket.size = 0;
+
+    bool gotPicture = true;
+
+    while( gotPicture )
+        _Decode( &inputPacket, gotPicture );
+
+    avcodec_flush_buffers( _context );
+}
+
+size_t VAH264Decoder::GetNumPictures() const
+{
+    return _outputQueue.size() + _readbacks.size();
 }
 
 uint16_t VAH264Decoder::GetInputWidth() const
@@ -243,8 +464,7 @@ void VAH264Decoder::SetOutputWidth( uint16_t outputWidth )
     {
         _outputWidth = outputWidth;
 
-        if( _scaler )
-            _DestroyScaler();
+        _DestroyScaler();
     }
 }
 
@@ -259,113 +479,1277 @@ void VAH264Decoder::SetOutputHeight( uint16_t outputHeight )
     {
         _outputHeight = outputHeight;
 
-        if( _scaler )
-            _DestroyScaler();
+        _DestroyScaler();
+    }
+}
+
+uint16_t VAH264Decoder::GetOutputHeight() const
+{
+    return _outputHeight;
+}
+
+void VAH264Decoder::SetOutputFormat( OutputFormat format )
+{
+    if( _outputFormat != format )
+    {
+        _outputFormat = format;
+
+        _DestroyScaler();
+    }
+}
+
+OutputFormat VAH264Decoder::GetOutputFormat() const
+{
+    return _outputFormat;
+}
+
+void VAH264Decoder::SetScaler( ScalerType scaler )
+{
+    if( _scalerType != scaler )
+    {
+        _scalerType = scaler;
+
+        _DestroyScaler();
+    }
+}
+
+ScalerType VAH264Decoder::GetScaler() const
+{
+    return _scalerType;
+}
+
+void VAH264Decoder::SetReadbackDepth( size_t depth )
+{
+    if( depth == 0 || depth > MAX_READBACK_DEPTH )
+        X_THROW(( "Readback depth must be between 1 and %u.", (unsigned int)MAX_READBACK_DEPTH ));
+
+    // Readbacks already in flight are still returned, in order, by the next calls.
+    _readbackDepth = depth;
+}
+
+size_t VAH264Decoder::GetReadbackDepth() const
+{
+    return _readbackDepth;
+}
+
+XIRef<Packet> VAH264Decoder::Get()
+{
+    return _GetRetrying( NULL );
+}
+
+void VAH264Decoder::GetInto( uint8_t* const planes[], const size_t strides[] )
+{
+    struct Destination dest;
+
+    size_t rowBytes[3];
+    size_t rows[3];
+    size_t numPlanes = _PlaneLayout( 0, 0, rowBytes, rows );
+
+    for( size_t i = 0; i < 3; i++ )
+    {
+        dest.planes[i] = (i < numPlanes) ? planes[i] : NULL;
+        dest.strides[i] = (i < numPlanes) ? strides[i] : 0;
+    }
+
+    _GetRetrying( &dest );
+}
+
+void VAH264Decoder::SetPacketFactory( XIRef<PacketFactory> pf )
+{
+    if( !pf.IsValid() )
+        X_THROW(( "Invalid packet factory." ));
+
+    _pf = pf;
+}
+
+XIRef<PacketFactory> VAH264Decoder::GetPacketFactory() const
+{
+    return _pf;
+}
+
+XIRef<Packet> VAH264Decoder::_GetRetrying( const struct Destination* dest )
+{
+    while( true )
+    {
+        try
+        {
+            return _Get( dest );
+        }
+        catch( XException& ex )
+        {
+            // The failed picture has been released, so move on to the next one.
+            if( _errorPolicy == ERROR_POLICY_THROW || GetNumPictures() == 0 )
+                throw;
+
+            _droppedPictures++;
+            X_LOG_WARNING( "Dropping decoded picture (%s).", ex.what() );
+        }
+    }
+}
+
+XIRef<Packet> VAH264Decoder::_Get( const struct Destination* dest )
+{
+    // Returns an empty ref when dest is given.
+    if( GetNumPictures() == 0 )
+        X_THROW(( "No decoded picture available." ));
+
+    if( _outputFormat == OUTPUT_FORMAT_NV12 )
+    {
+        XIRef<NV12Frame> frame = GetNV12Frame();
+
+        struct Destination output;
+        XIRef<Packet> pkt;
+
+        if( dest )
+            output = *dest;
+        else pkt = _AllocateOutput( frame->GetWidth(), frame->GetHeight(), output );
+
+        _CopyNV12( frame->GetY(),
+                   frame->GetYPitch(),
+                   frame->GetUV(),
+                   frame->GetUVPitch(),
+                   frame->GetWidth(),
+                   frame->GetHeight(),
+                   output );
+
+        return pkt;
+    }
+
+    _SubmitReadbacks();
+
+    struct DecodedPicture picture;
+    picture.surface = NULL;
+
+    XIRef<Packet> pkt;
+    VAImage image;
+    image.image_id = VA_INVALID_ID;
+
+    try
+    {
+        if( !_readbacks.empty() )
+        {
+            // The readback thread carries on with the pictures behind this one while
+            // we convert it.
+            struct Readback readback = _WaitForReadback();
+
+            picture = readback.picture;
+            image = readback.image;
+
+            _lastPTS = picture.pts;
+            _lastKey = picture.key;
+
+            if( !readback.error.empty() )
+                X_THROW(( "%s", readback.error.c_str() ));
+        }
+        else
+        {
+            picture = _outputQueue.front();
+            _outputQueue.pop_front();
+
+            _lastPTS = picture.pts;
+            _lastKey = picture.key;
+
+            image = _GetOutputImage();
+
+            VAStatus status = vaGetImage( _vc.display,
+                                          picture.surface->id,
+                                          0,
+                                          0,
+                                          _context->width,
+                                          _context->height,
+                                          image.image_id );
+            if( status != VA_STATUS_SUCCESS )
+                X_THROW(("Unable to vaGetImage(): %s\n", vaErrorStr(status)));
+        }
+
+        if( _outputWidth == 0 )
+            _outputWidth = _context->width;
+
+        if( _outputHeight == 0 )
+            _outputHeight = _context->height;
+
+        _UpdateConversion( _conversion, _context->width, _context->height, _outputWidth, _outputHeight );
+
+        if( dest )
+            _Convert( image, _conversion, *dest );
+        else pkt = _Convert( image, _conversion );
+    }
+    catch( ... )
+    {
+        if( image.image_id != VA_INVALID_ID )
+            _ReleaseOutputImage( image );
+        _ReleasePicture( picture );
+        throw;
+    }
+
+    _ReleaseOutputImage( image );
+    _ReleasePicture( picture );
+
+    return pkt;
+}
+
+XIRef<NV12Frame> VAH264Decoder::GetNV12Frame()
+{
+    if( GetNumPictures() == 0 )
+        X_THROW(( "No decoded picture available." ));
+
+    struct DecodedPicture picture = _PopPicture();
+
+    _lastPTS = picture.pts;
+    _lastKey = picture.key;
+
+    XIRef<NV12Frame> frame;
+
+    try
+    {
+        // The frame takes over the reference the queue held on the surface.
+        frame = new NV12Frame( _display,
+                               _nv12Format,
+                               picture.surface,
+                               (uint16_t)_context->width,
+                               (uint16_t)_context->height,
+                               picture.pts,
+                               picture.key );
+    }
+    catch( ... )
+    {
+        _ReleasePicture( picture );
+        throw;
+    }
+
+    return frame;
+}
+
+void VAH264Decoder::SetRegions( const std::vector<struct Region>& regions )
+{
+    _regions = regions;
+}
+
+std::vector<struct Region> VAH264Decoder::GetRegions() const
+{
+    return _regions;
+}
+
+void VAH264Decoder::GetRegionPictures( std::vector<XIRef<Packet> >& output )
+{
+    GetRegionPictures( _regions, output );
+}
+
+void VAH264Decoder::GetRegionPictures( const std::vector<struct Region>& regions,
+                                       std::vector<XIRef<Packet> >& output )
+{
+    if( GetNumPictures() == 0 )
+        X_THROW(( "No decoded picture available." ));
+
+    if( regions.empty() )
+        X_THROW(( "No regions to read back." ));
+
+    for( size_t i = 0; i < regions.size(); i++ )
+    {
+        const struct Region& region = regions[i];
+
+        if( region.width == 0 || region.height == 0 ||
+            (region.x % 2) != 0 || (region.y % 2) != 0 || (region.width % 2) != 0 || (region.height % 2) != 0 ||
+            (region.x + region.width) > _context->width || (region.y + region.height) > _context->height )
+            X_THROW(( "Invalid region (%u,%u %ux%u) for a %dx%d picture.",
+                      region.x, region.y, region.width, region.height, _context->width, _context->height ));
+    }
+
+    struct DecodedPicture picture = _PopPicture();
+
+    _lastPTS = picture.pts;
+    _lastKey = picture.key;
+
+    while( _regionConversions.size() > regions.size() )
+    {
+        _DestroyConversion( _regionConversions.back() );
+        _regionConversions.pop_back();
+    }
+
+    while( _regionConversions.size() < regions.size() )
+    {
+        struct Conversion conversion;
+        _InitConversion( conversion );
+        _regionConversions.push_back( conversion );
+    }
+
+    output.clear();
+
+    try
+    {
+        for( size_t i = 0; i < regions.size(); i++ )
+        {
+            const struct Region& region = regions[i];
+            struct Conversion& conversion = _regionConversions[i];
+
+            _UpdateConversion( conversion,
+                               region.width,
+                               region.height,
+                               (region.outputWidth) ? region.outputWidth : region.width,
+                               (region.outputHeight) ? region.outputHeight : region.height );
+
+            // Each region gets an image of its own size, so only its pixels cross the bus.
+            if( conversion.image.image_id == VA_INVALID_ID )
+            {
+                VAStatus status = vaCreateImage( _vc.display,
+                                                 &_nv12Format,
+                                                 region.width,
+                                                 region.height,
+                                                 &conversion.image );
+                if( status != VA_STATUS_SUCCESS )
+                {
+                    conversion.image.image_id = VA_INVALID_ID;
+                    X_THROW(("Unable to vaCreateImage(): %s\n", vaErrorStr(status)));
+                }
+            }
+
+            VAStatus status = vaGetImage( _vc.display,
+                                          picture.surface->id,
+                                          region.x,
+                                          region.y,
+                                          region.width,
+                                          region.height,
+                                          conversion.image.image_id );
+            if( status != VA_STATUS_SUCCESS )
+                X_THROW(("Unable to vaGetImage(): %s\n", vaErrorStr(status)));
+
+            output.push_back( _Convert( conversion.image, conversion ) );
+        }
+    }
+    catch( ... )
+    {
+        _ReleasePicture( picture );
+        throw;
+    }
+
+    _ReleasePicture( picture );
+}
+
+struct SurfacePoolStats VAH264Decoder::GetSurfacePoolStats() const
+{
+    XGuard g( _surfaceLock );
+
+    struct SurfacePoolStats stats;
+    stats.size = _surfaces.size();
+    stats.inUse = _surfaces.size() - _freeSurfaces.size();
+    stats.peakInUse = _peakSurfacesInUse;
+    stats.grows = _surfaceGrows;
+
+    return stats;
+}
+
+int64_t VAH264Decoder::GetPTS() const
+{
+    return _lastPTS;
+}
+
+bool VAH264Decoder::LastWasKey() const
+{
+    return _lastKey;
+}
+
+XIRef<Packet> VAH264Decoder::_Convert( VAImage& image, struct Conversion& c )
+{
+    struct Destination dest;
+
+    XIRef<Packet> pkt = (_outputFormat == OUTPUT_FORMAT_NV12) ?
+                        _AllocateOutput( c.inputWidth, c.inputHeight, dest ) :
+                        _AllocateOutput( c.outputWidth, c.outputHeight, dest );
+
+    _Convert( image, c, dest );
+
+    return pkt;
+}
+
+void VAH264Decoder::_Convert( VAImage& image, struct Conversion& c, const struct Destination& dest )
+{
+    unsigned char* surface_p = NULL;
+    VAStatus status = vaMapBuffer( _vc.display, image.buf, (void **)&surface_p );
+    if( status != VA_STATUS_SUCCESS )
+        X_THROW(("Unable to vaMapBuffer(): %s\n", vaErrorStr(status)));
+
+    try
+    {
+        if( image.format.fourcc != VA_FOURCC_NV12 )
+            X_THROW(("Fall into the fourcc that is not handled"));
+
+        uint8_t* Y_start = surface_p + image.offsets[0];
+        int Y_pitch = image.pitches[0];
+
+        uint8_t* U_start = surface_p + image.offsets[1];
+        int U_pitch = image.pitches[1];
+
+        // Each format is produced straight from the mapped image in one conversion.
+        switch( _outputFormat )
+        {
+        case OUTPUT_FORMAT_NV12:
+            _CopyNV12( Y_start, Y_pitch, U_start, U_pitch, c.inputWidth, c.inputHeight, dest );
+            break;
+        case OUTPUT_FORMAT_Y8:
+            _ConvertY8( c, Y_start, Y_pitch, dest );
+            break;
+        case OUTPUT_FORMAT_BGR24:
+            _ConvertBGR( c, Y_start, Y_pitch, U_start, U_pitch, 3, dest );
+            break;
+        case OUTPUT_FORMAT_BGRA:
+            _ConvertBGR( c, Y_start, Y_pitch, U_start, U_pitch, 4, dest );
+            break;
+        default:
+            _ConvertI420( c, Y_start, Y_pitch, U_start, U_pitch, dest );
+            break;
+        }
+    }
+    catch( ... )
+    {
+        vaUnmapBuffer( _vc.display, image.buf );
+        throw;
+    }
+
+    status = vaUnmapBuffer( _vc.display, image.buf );
+    if( status != VA_STATUS_SUCCESS )
+        X_THROW(("Unable to vaMapBuffer(): %s\n", vaErrorStr(status)));
+}
+
+void VAH264Decoder::_ConvertI420( struct Conversion& c,
+                                  uint8_t* Y_start,
+                                  int Y_pitch,
+                                  uint8_t* U_start,
+                                  int U_pitch,
+                                  const struct Destination& dest )
+{
+    // At 1:1 the conversion is only a Y copy and a UV deinterleave, which is much
+    // cheaper done directly than through swscale. J420 output still goes through
+    // swscale, because it also converts the range.
+    if( _IsUnscaled( c ) && _options.jpeg_source.IsNull() )
+    {
+        NV12ToI420( Y_start, Y_pitch, U_start, U_pitch, c.outputWidth, c.outputHeight, dest.planes, dest.strides );
+        return;
+    }
+
+    if( _UseFastScaler( c ) && _options.jpeg_source.IsNull() )
+    {
+        _GetFastScaler( c )->ToI420( Y_start, Y_pitch, U_start, U_pitch, dest.planes, dest.strides );
+        return;
+    }
+
+    if( c.scaler == NULL )
+        _CreateScaler( c, PIX_FMT_NV12, (_options.jpeg_source.IsNull()) ? PIX_FMT_YUV420P : PIX_FMT_YUVJ420P );
+
+    AVPicture pict;
+    for( int i = 0; i < 3; i++ )
+    {
+        pict.data[i] = dest.planes[i];
+        pict.linesize[i] = (int)dest.strides[i];
+    }
+
+    uint8_t* srcPlanes[2];
+    srcPlanes[0] = Y_start;
+    srcPlanes[1] = U_start;
+
+    int srcStrides[2];
+    srcStrides[0] = Y_pitch;
+    srcStrides[1] = U_pitch;
+
+    int ret = sws_scale( c.scaler,
+                         srcPlanes,
+                         srcStrides,
+                         0,
+                         c.inputHeight,
+                         pict.data,
+                         pict.linesize );
+    if( ret <= 0 )
+        X_THROW(( "Unable to create YUV420P image." ));
+}
+
+void VAH264Decoder::_ConvertY8( struct Conversion& c, uint8_t* Y_start, int Y_pitch, const struct Destination& dest )
+{
+    // None of these paths read the chroma plane. Luma keeps the range it was
+    // decoded with.
+    if( c.outputWidth == c.inputWidth && c.outputHeight == c.inputHeight )
+    {
+        uint8_t* dst = dest.planes[0];
+
+        for( uint16_t i = 0; i < c.outputHeight; i++ )
+        {
+            memcpy( dst, Y_start, c.outputWidth );
+            dst += dest.strides[0];
+            Y_start += Y_pitch;
+        }
+
+        return;
+    }
+
+    if( _UseFastScaler( c ) )
+    {
+        _GetFastScaler( c )->ToY8( Y_start, Y_pitch, dest.planes[0], dest.strides[0] );
+        return;
+    }
+
+    if( c.scaler == NULL )
+        _CreateScaler( c, PIX_FMT_GRAY8, PIX_FMT_GRAY8 );
+
+    uint8_t* srcPlanes[1];
+    srcPlanes[0] = Y_start;
+
+    int srcStrides[1];
+    srcStrides[0] = Y_pitch;
+
+    uint8_t* dstPlanes[1];
+    dstPlanes[0] = dest.planes[0];
+
+    int dstStrides[1];
+    dstStrides[0] = (int)dest.strides[0];
+
+    int ret = sws_scale( c.scaler, srcPlanes, srcStrides, 0, c.inputHeight, dstPlanes, dstStrides );
+    if( ret <= 0 )
+        X_THROW(( "Unable to create Y8 image." ));
+}
+
+void VAH264Decoder::_ConvertBGR( struct Conversion& c,
+                                 uint8_t* Y_start,
+                                 int Y_pitch,
+                                 uint8_t* U_start,
+                                 int U_pitch,
+                                 size_t bytesPerPixel,
+                                 const struct Destination& dest )
+{
+    bool fullRange = !_options.jpeg_source.IsNull();
+
+    if( _IsUnscaled( c ) )
+    {
+        NV12ToBGR( Y_start,
+                   Y_pitch,
+                   U_start,
+                   U_pitch,
+                   c.outputWidth,
+                   c.outputHeight,
+                   dest.planes[0],
+                   dest.strides[0],
+                   bytesPerPixel,
+                   fullRange );
+        return;
+    }
+
+    if( _UseFastScaler( c ) )
+    {
+        _GetFastScaler( c )->ToBGR( Y_start, Y_pitch, U_start, U_pitch, dest.planes[0], dest.strides[0], bytesPerPixel, fullRange );
+        return;
+    }
+
+    if( c.scaler == NULL )
+    {
+        _CreateScaler( c, PIX_FMT_NV12, (bytesPerPixel == 4) ? PIX_FMT_BGRA : PIX_FMT_BGR24 );
+
+        if( fullRange )
+        {
+            const int* coefficients = sws_getCoefficients( SWS_CS_ITU601 );
+            sws_setColorspaceDetails( c.scaler, coefficients, 1, coefficients, 1, 0, 1 << 16, 1 << 16 );
+        }
+    }
+
+    uint8_t* srcPlanes[2];
+    srcPlanes[0] = Y_start;
+    srcPlanes[1] = U_start;
+
+    int srcStrides[2];
+    srcStrides[0] = Y_pitch;
+    srcStrides[1] = U_pitch;
+
+    uint8_t* dstPlanes[1];
+    dstPlanes[0] = dest.planes[0];
+
+    int dstStrides[1];
+    dstStrides[0] = (int)dest.strides[0];
+
+    int ret = sws_scale( c.scaler, srcPlanes, srcStrides, 0, c.inputHeight, dstPlanes, dstStrides );
+    if( ret <= 0 )
+        X_THROW(( "Unable to create BGR image." ));
+}
+
+size_t VAH264Decoder::_PlaneLayout( uint16_t width, uint16_t height, size_t rowBytes[3], size_t rows[3] ) const
+{
+    // Returns the number of planes in the output format, and the bytes per row and
+    // rows of each for a width x height picture.
+    switch( _outputFormat )
+    {
+    case OUTPUT_FORMAT_NV12:
+        rowBytes[0] = width;
+        rows[0] = height;
+        rowBytes[1] = width;
+        rows[1] = height / 2;
+        return 2;
+    case OUTPUT_FORMAT_Y8:
+        rowBytes[0] = width;
+        rows[0] = height;
+        return 1;
+    case OUTPUT_FORMAT_BGR24:
+        rowBytes[0] = width * 3;
+        rows[0] = height;
+        return 1;
+    case OUTPUT_FORMAT_BGRA:
+        rowBytes[0] = width * 4;
+        rows[0] = height;
+        return 1;
+    default:
+        rowBytes[0] = width;
+        rows[0] = height;
+        rowBytes[1] = width / 2;
+        rows[1] = height / 2;
+        rowBytes[2] = width / 2;
+        rows[2] = height / 2;
+        return 3;
+    }
+}
+
+XIRef<Packet> VAH264Decoder::_AllocateOutput( uint16_t width, uint16_t height, struct Destination& dest )
+{
+    // A packet from the packet factory, with the planes packed one after another and
+    // no row padding.
+    size_t rowBytes[3];
+    size_t rows[3];
+    size_t numPlanes = _PlaneLayout( width, height, rowBytes, rows );
+
+    size_t size = 0;
+    for( size_t i = 0; i < numPlanes; i++ )
+        size += rowBytes[i] * rows[i];
+
+    XIRef<Packet> pkt = _pf->Get( size );
+    pkt->SetDataSize( size );
+
+    uint8_t* dst = pkt->Map();
+
+    for( size_t i = 0; i < 3; i++ )
+    {
+        dest.planes[i] = (i < numPlanes) ? dst : NULL;
+        dest.strides[i] = (i < numPlanes) ? rowBytes[i] : 0;
+
+        if( i < numPlanes )
+            dst += rowBytes[i] * rows[i];
+    }
+
+    return pkt;
+}
+
+bool VAH264Decoder::_IsUnscaled( const struct Conversion& c )
+{
+    return c.outputWidth == c.inputWidth &&
+           c.outputHeight == c.inputHeight &&
+           (c.outputWidth % 2) == 0 &&
+           (c.outputHeight % 2) == 0;
+}
+
+bool VAH264Decoder::_UseFastScaler( const struct Conversion& c ) const
+{
+    return _scalerType == SCALER_FAST && (c.outputWidth % 2) == 0 && (c.outputHeight % 2) == 0;
+}
+
+NV12Scaler* VAH264Decoder::_GetFastScaler( struct Conversion& c )
+{
+    if( c.fastScaler == NULL )
+        c.fastScaler = new NV12Scaler( c.inputWidth, c.inputHeight, c.outputWidth, c.outputHeight );
+
+    return c.fastScaler;
+}
+
+void VAH264Decoder::_CreateScaler( struct Conversion& c, enum PixelFormat inputFormat, enum PixelFormat outputFormat )
+{
+    c.scaler = sws_getContext( c.inputWidth,
+                               c.inputHeight,
+                              inputFormat,
+                              c.outputWidth,
+                              c.outputHeight,
+                              outputFormat,
+                              SWS_BICUBIC,
+                              NULL,
+                              NULL,
+                              NULL );
+
+    if( !c.scaler )
+        X_THROW(( "Unable to allocate scaler context "
+                  "(input_width=%u,input_height=%u,output_width=%u,output_height=%u).",
+                  c.inputWidth, c.inputHeight, c.outputWidth, c.outputHeight ));
+}
+
+void VAH264Decoder::_InitConversion( struct Conversion& c )
+{
+    c.inputWidth = 0;
+    c.inputHeight = 0;
+    c.outputWidth = 0;
+    c.outputHeight = 0;
+    c.scaler = NULL;
+    c.fastScaler = NULL;
+    c.image.image_id = VA_INVALID_ID;
+}
+
+void VAH264Decoder::_UpdateConversion( struct Conversion& c,
+                                       uint16_t inputWidth,
+                                       uint16_t inputHeight,
+                                       uint16_t outputWidth,
+                                       uint16_t outputHeight )
+{
+    if( c.inputWidth == inputWidth && c.inputHeight == inputHeight &&
+        c.outputWidth == outputWidth && c.outputHeight == outputHeight )
+        return;
+
+    _ResetScalers( c );
+
+    if( (c.inputWidth != inputWidth || c.inputHeight != inputHeight) && c.image.image_id != VA_INVALID_ID )
+    {
+        vaDestroyImage( _vc.display, c.image.image_id );
+        c.image.image_id = VA_INVALID_ID;
+    }
+
+    c.inputWidth = inputWidth;
+    c.inputHeight = inputHeight;
+    c.outputWidth = outputWidth;
+    c.outputHeight = outputHeight;
+}
+
+void VAH264Decoder::_ResetScalers( struct Conversion& c )
+{
+    if( c.scaler )
+    {
+        sws_freeContext( c.scaler );
+        c.scaler = NULL;
+    }
+
+    if( c.fastScaler )
+    {
+        delete c.fastScaler;
+        c.fastScaler = NULL;
+    }
+}
+
+void VAH264Decoder::_DestroyConversion( struct Conversion& c )
+{
+    _ResetScalers( c );
+
+    if( c.image.image_id != VA_INVALID_ID )
+    {
+        VAStatus status = vaDestroyImage( _vc.display, c.image.image_id );
+
+        if( status != VA_STATUS_SUCCESS )
+            X_LOG_WARNING( "Unable to vaDestroyImage().");
+
+        c.image.image_id = VA_INVALID_ID;
+    }
+}
+
+bool VAH264Decoder::_AcceptPacket( const uint8_t* data, size_t size )
+{
+    std::vector<NALUnit> units;
+    FindNALUnits( data, size, units );
+
+    bool hasSlice = false;
+    bool hasIDR = false;
+    bool hasReference = false;
+
+    for( size_t i = 0; i < units.size(); i++ )
+    {
+        if( units[i].type != NAL_NON_IDR && units[i].type != NAL_IDR )
+            continue;
+
+        hasSlice = true;
+
+        if( units[i].type == NAL_IDR )
+            hasIDR = true;
+
+        if( units[i].refIDC != 0 )
+            hasReference = true;
+    }
+
+    // Parameter sets and SEI on their own always go through.
+    if( !hasSlice )
+        return true;
+
+    if( _waitForIDR )
+    {
+        if( !hasIDR )
+            return false;
+
+        _waitForIDR = false;
+    }
+
+    if( _decodeMode == DECODE_KEY )
+    {
+        if( !hasIDR )
+            return false;
+
+        return (_intervalCount++ % _decodeInterval) == 0;
+    }
+
+    if( _decodeMode == DECODE_REFERENCE )
+        return hasReference;
+
+    return true;
+}
+
+int VAH264Decoder::_Decode( AVPacket* inputPacket, bool& gotPicture )
+{
+    int decoded = 0;
+    int ret = avcodec_decode_video2( _context,
+                                     _frame,
+                                     &decoded,
+                                     inputPacket );
+    if( ret < 0 )
+    {
+        if( _errorPolicy == ERROR_POLICY_THROW )
+            X_THROW(( "Decoding returned error: %d", ret ));
+
+        // Until the next IDR, pictures may predict from whatever this packet held.
+        _corruptPackets++;
+        if( !_concealErrors )
+            _waitForIDR = true;
+
+        gotPicture = false;
+        return ret;
+    }
+
+    gotPicture = (decoded > 0);
+
+    if( gotPicture )
+        _QueuePicture();
+
+    return ret;
+}
+
+void VAH264Decoder::_QueuePicture()
+{
+    // No readback here. The picture keeps its surface until Get() asks for it, or
+    // until it is dropped from the queue.
+    if( _decodeMode == DECODE_REFERENCE && (_intervalCount++ % _decodeInterval) != 0 )
+        return;
+
+    struct DecodedPicture picture;
+    picture.surface = (struct HWSurface*)_frame->opaque;
+    picture.pts = _frame->reordered_opaque;
+    picture.key = (_frame->key_frame != 0);
+
+    _RefSurface( picture.surface );
+
+    _outputQueue.push_back( picture );
+}
+
+VAImage VAH264Decoder::_GetOutputImage()
+{
+    if( !_freeImages.empty() )
+    {
+        VAImage image = _freeImages.back();
+        _freeImages.pop_back();
+        return image;
+    }
+
+    VAImage image;
+    VAStatus status = vaCreateImage( _vc.display,
+                                     &_nv12Format,
+                                     _context->width,
+                                     _context->height,
+                                     &image );
+    if( status != VA_STATUS_SUCCESS )
+        X_THROW(("Unable to vaCreateImage(): %s\n", vaErrorStr(status)));
+
+    return image;
+}
+
+void VAH264Decoder::_ReleaseOutputImage( VAImage& image )
+{
+    _freeImages.push_back( image );
+}
+
+void VAH264Decoder::_ReleasePicture( struct DecodedPicture& picture )
+{
+    if( picture.surface )
+    {
+        _UnrefSurface( picture.surface );
+        picture.surface = NULL;
+    }
+}
+
+void VAH264Decoder::_DropPictures()
+{
+    // Readbacks in flight have to finish before their images can be reused.
+    while( !_readbacks.empty() )
+    {
+        struct Readback readback = _WaitForReadback();
+        _ReleaseOutputImage( readback.image );
+        _ReleasePicture( readback.picture );
+    }
+
+    while( !_outputQueue.empty() )
+    {
+        _ReleasePicture( _outputQueue.front() );
+        _outputQueue.pop_front();
+    }
+}
+
+void VAH264Decoder::_PrimeOutputImages()
+{
+    // Get() cycles through one image per readback in flight, so create them all now.
+    std::vector<VAImage> images;
+    while( images.size() < _readbackDepth )
+        images.push_back( _GetOutputImage() );
+
+    for( size_t i = 0; i < images.size(); i++ )
+        _ReleaseOutputImage( images[i] );
+}
+
+void VAH264Decoder::_DestroyOutputImages()
+{
+    for( size_t i = 0; i < _freeImages.size(); i++ )
+    {
+        VAStatus status = vaDestroyImage( _vc.display, _freeImages[i].image_id );
+
+        if( status != VA_STATUS_SUCCESS )
+            X_LOG_WARNING( "Unable to vaDestroyImage().");
+    }
+
+    _freeImages.clear();
+}
+
+struct DecodedPicture VAH264Decoder::_PopPicture()
+{
+    // Pictures already handed to the readback thread are older than anything in the
+    // output queue. Their copies are not needed here, so the images go straight back.
+    if( !_readbacks.empty() )
+    {
+        struct Readback readback = _WaitForReadback();
+        _ReleaseOutputImage( readback.image );
+        return readback.picture;
+    }
+
+    struct DecodedPicture picture = _outputQueue.front();
+    _outputQueue.pop_front();
+
+    return picture;
+}
+
+void VAH264Decoder::_SubmitReadbacks()
+{
+    if( _readbackDepth < 2 )
+        return;
+
+    if( !_readbackThread )
+    {
+        _readbackRunning = true;
+        _readbackThread = new ReadbackThread( this );
+        _readbackThread->Start();
+    }
+
+    XGuard g( _readbackLock );
+
+    bool submitted = false;
+
+    while( _readbacks.size() < _readbackDepth && !_outputQueue.empty() )
+    {
+        struct Readback readback;
+        readback.picture = _outputQueue.front();
+        readback.image = _GetOutputImage();
+        readback.width = (uint16_t)_context->width;
+        readback.height = (uint16_t)_context->height;
+        readback.done = false;
+
+        _outputQueue.pop_front();
+
+        _readbacks.push_back( readback );
+        submitted = true;
+    }
+
+    if( submitted )
+        _readbackCond.Broadcast();
+}
+
+struct VAH264Decoder::Readback VAH264Decoder::_WaitForReadback()
+{
+    XGuard g( _readbackLock );
+
+    while( !_readbacks.front().done )
+        _readbackCond.Wait();
+
+    struct Readback readback = _readbacks.front();
+    _readbacks.pop_front();
+
+    return readback;
+}
+
+struct VAH264Decoder::Readback* VAH264Decoder::_NextReadback()
+{
+    // Called with _readbackLock held. Entries are only removed once they are done,
+    // so the one returned stays put while the thread works on it.
+    for( std::list<struct Readback>::iterator i = _readbacks.begin(); i != _readbacks.end(); i++ )
+    {
+        if( !i->done )
+            return &(*i);
+    }
+
+    return NULL;
+}
+
+void VAH264Decoder::_StopReadbackThread()
+{
+    if( _readbackThread )
+    {
+        {
+            XGuard g( _readbackLock );
+            _readbackRunning = false;
+            _readbackCond.Broadcast();
+        }
+
+        _readbackThread->Join();
+        delete _readbackThread;
+        _readbackThread = NULL;
+    }
+
+    while( !_readbacks.empty() )
+    {
+        _ReleaseOutputImage( _readbacks.front().image );
+        _ReleasePicture( _readbacks.front().picture );
+        _readbacks.pop_front();
+    }
+}
+
+void VAH264Decoder::_CopyNV12( const uint8_t* y,
+                               size_t yPitch,
+                               const uint8_t* uv,
+                               size_t uvPitch,
+                               uint16_t width,
+                               uint16_t height,
+                               const struct Destination& dest )
+{
+    uint8_t* dst = dest.planes[0];
+
+    for( uint16_t i = 0; i < height; i++ )
+    {
+        memcpy( dst, y, width );
+        dst += dest.strides[0];
+        y += yPitch;
+    }
+
+    dst = dest.planes[1];
+
+    for( uint16_t i = 0; i < (height / 2); i++ )
+    {
+        memcpy( dst, uv, width );
+        dst += dest.strides[1];
+        uv += uvPitch;
+    }
+}
+
+void VAH264Decoder::_RefSurface( struct HWSurface* surface )
+{
+    XGuard g( _surfaceLock );
+    surface->refcount++;
+}
+
+void VAH264Decoder::_UnrefSurface( struct HWSurface* surface )
+{
+    XGuard g( _surfaceLock );
+
+    if( surface->refcount <= 0 )
+    {
+        X_LOG_WARNING( "Unbalanced release of VA surface %u.", surface->id );
+        return;
+    }
+
+    if( --surface->refcount == 0 )
+    {
+        if( surface->retired )
+            _DestroySurface( surface );
+        else _freeSurfaces.push_back( surface );
+    }
+}
+
+size_t VAH264Decoder::_InitialSurfaceCount() const
+{
+    // libavcodec has parsed the SPS by the time it asks for a pixel format, so refs
+    // and has_b_frames describe this stream. Prewarm() gets here first, with the
+    // refs it parsed itself. If neither knows assume the H.264 max.
+    size_t refs = (_context->refs > 0) ? (size_t)_context->refs : 0;
+
+    if( _spsRefs > refs )
+        refs = _spsRefs;
+
+    if( refs == 0 )
+        refs = 16;
+    size_t reorder = (_context->has_b_frames > 0) ? (size_t)_context->has_b_frames : 0;
+
+    // The DPB, the picture being decoded, the reorder delay, the output queue and the
+    // pictures in flight to the readback thread.
+    size_t count = refs + 1 + reorder + MAX_OUTPUT_PICTURES + _readbackDepth;
+
+    return (count < MAX_VA_SURFACES) ? count : MAX_VA_SURFACES;
+}
+
+bool VAH264Decoder::_TopUpSurfaces()
+{
+    // Called with _surfaceLock held. Returns true if surfaces were added, in which
+    // case the context has to be recreated to use them.
+    size_t wanted = _InitialSurfaceCount();
+
+    if( _surfaces.size() >= wanted )
+        return false;
+
+    _AddSurfaces( wanted - _surfaces.size() );
+
+    return true;
+}
+
+void VAH264Decoder::_AddSurfaces( size_t count )
+{
+    std::vector<VASurfaceID> surfaceIDs( count );
+
+    VAStatus status = vaCreateSurfaces( _vc.display,
+                                        VA_RT_FORMAT_YUV420,
+                                        _surfaceWidth,
+                                        _surfaceHeight,
+                                        &surfaceIDs[0],
+                                        count,
+                                        NULL,
+                                        0 );
+    if( status != VA_STATUS_SUCCESS )
+        X_THROW(("Unable to vaCreateSurfaces(): %s\n", vaErrorStr(status)));
+
+    for( size_t i = 0; i < count; i++ )
+    {
+        struct HWSurface* surface = new struct HWSurface;
+        surface->id = surfaceIDs[i];
+        surface->refcount = 0;
+        surface->retired = false;
+
+        _surfaces.push_back( surface );
+        _freeSurfaces.push_back( surface );
+    }
+}
+
+void VAH264Decoder::_RemoveSurfaces( size_t keep )
+{
+    // Called with _surfaceLock held. Destroys every surface after the first keep,
+    // which must all be free (as ones just added are).
+    while( _surfaces.size() > keep )
+    {
+        struct HWSurface* surface = _surfaces.back();
+        _surfaces.pop_back();
+
+        std::vector<struct HWSurface*>::iterator found = std::find( _freeSurfaces.begin(), _freeSurfaces.end(), surface );
+        if( found != _freeSurfaces.end() )
+            _freeSurfaces.erase( found );
+
+        _DestroySurface( surface );
     }
 }
 
-uint16_t VAH264Decoder::GetOutputHeight() const
+void VAH264Decoder::_CreateContext()
 {
-    return _outputHeight;
+    std::vector<VASurfaceID> surfaceIDs;
+    for( size_t i = 0; i < _surfaces.size(); i++ )
+        surfaceIDs.push_back( _surfaces[i]->id );
+
+    VAStatus status = vaCreateContext( _vc.display,
+                                       _vc.config_id,
+                                       _context->width,
+                                       _context->height,
+                                       VA_PROGRESSIVE,
+                                       &surfaceIDs[0],
+                                       surfaceIDs.size(),
+                                       &_vc.context_id );
+    if( status != VA_STATUS_SUCCESS )
+    {
+        _vc.context_id = VA_INVALID_ID;
+        X_THROW(("Unable to vaCreateContext(): %s\n", vaErrorStr(status)));
+    }
 }
 
-XIRef<Packet> VAH264Decoder::Get()
+bool VAH264Decoder::_GrowSurfaces()
 {
-    if( _outputWidth == 0 )
-        _outputWidth = _context->width;
+    // Called with _surfaceLock held, between pictures, so nothing is being decoded
+    // into the context we replace. Surface contents (and so the references) survive.
+    if( _surfaces.size() >= MAX_VA_SURFACES )
+        return false;
 
-    if( _outputHeight == 0 )
-        _outputHeight = _context->height;
+    size_t oldCount = _surfaces.size();
 
-    unsigned char* surface_p = NULL;
-    VAStatus status = vaMapBuffer( _vc.display, _outputImage.buf, (void **)&surface_p );
-    if( status != VA_STATUS_SUCCESS )
-        X_THROW(("Unable to vaMapBuffer(): %s\n", vaErrorStr(status)));
+    size_t count = MAX_VA_SURFACES - oldCount;
+    if( count > SURFACE_POOL_GROWTH )
+        count = SURFACE_POOL_GROWTH;
 
-    unsigned char* Y_start = surface_p + _outputImage.offsets[0];
-    int Y_pitch = _outputImage.pitches[0];
+    try
+    {
+        _AddSurfaces( count );
+    }
+    catch( XException& ex )
+    {
+        X_LOG_WARNING( "Unable to grow VA surface pool (%s).", ex.what() );
+        return false;
+    }
 
-    int U_pitch = 0;
-    unsigned char* U_start = NULL;
-    switch (_outputImage.format.fourcc)
+    if( _vc.context_id != VA_INVALID_ID )
     {
-    case VA_FOURCC_NV12:
-        U_start = (unsigned char *)surface_p + _outputImage.offsets[1];
-        U_pitch = _outputImage.pitches[1];
-        break;
-    default:
-        X_THROW(("Fall into the fourcc that is not handled"));
+        vaDestroyContext( _vc.display, _vc.context_id );
+        _vc.context_id = VA_INVALID_ID;
     }
 
-    if( _scaler == NULL )
+    try
+    {
+        _CreateContext();
+    }
+    catch( XException& ex )
     {
-        _scaler = sws_getContext( _context->width,
-                                  _context->height,
-                                  PIX_FMT_NV12,
-                                  _outputWidth,
-                                  _outputHeight,
-                                  (_options.jpeg_source.IsNull()) ? PIX_FMT_YUV420P : PIX_FMT_YUVJ420P,
-                                  SWS_BICUBIC,
-                                  NULL,
-                                  NULL,
-                                  NULL );
+        X_LOG_WARNING( "Unable to grow VA surface pool (%s).", ex.what() );
 
-        if( !_scaler )
-            X_THROW(( "Unable to allocate scaler context "
-                      "(input_width=%u,input_height=%u,output_width=%u,output_height=%u).",
-                      _context->width, _context->height, _outputWidth, _outputHeight ));
+        // The old context is gone, so go back to its surfaces and recreate it. If even
+        // that fails the decoder has no context left, and the error goes up.
+        _RemoveSurfaces( oldCount );
+        _CreateContext();
+
+        return false;
     }
 
-    XIRef<Packet> pkt = _pf->Get( _outputWidth * _outputHeight * 1.5 );
-    pkt->SetDataSize( _outputWidth * _outputHeight * 1.5 );
-    uint8_t* dest = pkt->Map();
+    _surfaceGrows++;
 
-    AVPicture pict;
-    pict.data[0] = dest;
-    dest += _outputWidth * _outputHeight;
-    pict.data[1] = dest;
-    dest += (_outputWidth/4) * _outputHeight;
-    pict.data[2] = dest;
+    return true;
+}
 
-    pict.linesize[0] = _outputWidth;
-    pict.linesize[1] = _outputWidth/2;
-    pict.linesize[2] = _outputWidth/2;
+void VAH264Decoder::_RetireSurfaces()
+{
+    // Called with _surfaceLock held. Surfaces nobody holds go now, the rest as soon
+    // as their last reference is released.
+    for( size_t i = 0; i < _surfaces.size(); i++ )
+    {
+        struct HWSurface* surface = _surfaces[i];
 
-    uint8_t* srcPlanes[2];
-    srcPlanes[0] = Y_start;
-    srcPlanes[1] = U_start;
+        surface->retired = true;
 
-    int srcStrides[2];
-    srcStrides[0] = Y_pitch;
-    srcStrides[1] = U_pitch;
+        if( surface->refcount > 0 )
+            _retiredSurfaces.push_back( surface );
+        else _DestroySurface( surface );
+    }
 
-    int ret = sws_scale( _scaler,
-                         srcPlanes,
-                         srcStrides,
-                         0,
-                         _context->height,
-                         pict.data,
-                         pict.linesize );
-    if( ret <= 0 )
-        X_THROW(( "Unable to create YUV420P image." ));
+    _surfaces.clear();
+    _freeSurfaces.clear();
+}
 
-    status = vaUnmapBuffer( _vc.display, _outputImage.buf );
+void VAH264Decoder::_DestroySurface( struct HWSurface* surface )
+{
+    VAStatus status = vaDestroySurfaces( _vc.display, &surface->id, 1 );
     if( status != VA_STATUS_SUCCESS )
-        X_THROW(("Unable to vaMapBuffer(): %s\n", vaErrorStr(status)));
+        X_LOG_WARNING( "Unable to vaDestroySurfaces()." );
 
-    return pkt;
+    if( surface->retired )
+    {
+        std::vector<struct HWSurface*>::iterator found = std::find( _retiredSurfaces.begin(), _retiredSurfaces.end(), surface );
+        if( found != _retiredSurfaces.end() )
+            _retiredSurfaces.erase( found );
+    }
+
+    delete surface;
 }
 
 void VAH264Decoder::_FinishFFMPEGInit( uint8_t* frame, size_t frameSize )
 {
-    MEDIA_PARSER::H264Info h264Info;
-
-    if( !MEDIA_PARSER::MediaParser::GetMediaInfo( frame, frameSize, h264Info ) )
-        X_THROW(("Unable to parse SPS."));
-    MEDIA_PARSER::MediaInfo* mediaInfo = &h264Info;
+    uint16_t width = 0, height = 0;
+    _GetPictureSize( frame, frameSize, width, height );
 
-    _context->width = mediaInfo->GetFrameWidth();
-    _context->height = mediaInfo->GetFrameHeight();
+    _context->width = width;
+    _context->height = height;
     _context->thread_count = 1;
     _context->get_format = _GetFormat;
     _context->get_buffer = _GetBuffer;
@@ -378,13 +1762,51 @@ void VAH264Decoder::_FinishFFMPEGInit( uint8_t* frame, size_t frameSize )
         X_THROW(( "Unable to open H264 decoder." ));
 }
 
-void VAH264Decoder::_DestroyScaler()
+void VAH264Decoder::_ToAnnexB( const uint8_t* extraData, size_t extraDataSize, std::vector<uint8_t>& annexB )
 {
-    if( _scaler )
+    if( extraDataSize == 0 )
+        X_THROW(( "No extradata to prewarm from." ));
+
+    // An avcC record starts with configurationVersion 1, where Annex B starts with a
+    // start code. Only its first SPS is needed.
+    if( extraData[0] != 1 )
     {
-        sws_freeContext( _scaler );
-        _scaler = NULL;
+        annexB.assign( extraData, extraData + extraDataSize );
+        return;
     }
+
+    if( extraDataSize < 8 || (extraData[5] & 0x1f) == 0 )
+        X_THROW(( "avcC record has no SPS." ));
+
+    size_t spsSize = (extraData[6] << 8) | extraData[7];
+
+    if( (8 + spsSize) > extraDataSize )
+        X_THROW(( "Truncated SPS in avcC record." ));
+
+    static const uint8_t startCode[] = { 0, 0, 0, 1 };
+
+    annexB.assign( startCode, startCode + sizeof(startCode) );
+    annexB.insert( annexB.end(), extraData + 8, extraData + 8 + spsSize );
+}
+
+void VAH264Decoder::_GetPictureSize( uint8_t* frame, size_t frameSize, uint16_t& width, uint16_t& height )
+{
+    MEDIA_PARSER::H264Info h264Info;
+
+    if( !MEDIA_PARSER::MediaParser::GetMediaInfo( frame, frameSize, h264Info ) )
+        X_THROW(("Unable to parse SPS."));
+    MEDIA_PARSER::MediaInfo* mediaInfo = &h264Info;
+
+    width = mediaInfo->GetFrameWidth();
+    height = mediaInfo->GetFrameHeight();
+}
+
+void VAH264Decoder::_DestroyScaler()
+{
+    _ResetScalers( _conversion );
+
+    for( size_t i = 0; i < _regionConversions.size(); i++ )
+        _ResetScalers( _regionConversions[i] );
 }
 
 void VAH264Decoder::_InitVAAPIDecoder()
@@ -392,13 +1814,28 @@ void VAH264Decoder::_InitVAAPIDecoder()
     XString devicePath = _options.device_path.Value();
 
     _fd = open( devicePath.c_str(), O_RDWR );
-    if( _fd <= 0 )
+    if( _fd < 0 )
         X_THROW(( "Unable to open: %s", devicePath.c_str() ));
 
     _vc.display = (VADisplay)vaGetDisplayDRM( _fd );
 
-    if( !vaDisplayIsValid( _vc.display ) )
-        X_THROW(("Unable to open a valid display."));
+    try
+    {
+        if( !vaDisplayIsValid( _vc.display ) )
+            X_THROW(("Unable to open a valid display."));
+
+        // From here on the shared display closes the device.
+        _display = new SharedVADisplay( _fd, _vc.display );
+    }
+    catch( ... )
+    {
+        close( _fd );
+        _fd = -1;
+        _vc.display = NULL;
+        throw;
+    }
+
+    _display->decoder = this;
 
     int majorVer = 0, minorVer = 0;
     VAStatus status = vaInitialize( _vc.display, &majorVer, &minorVer );
@@ -419,35 +1856,19 @@ void VAH264Decoder::_InitVAAPIDecoder()
     if( status != VA_STATUS_SUCCESS )
         X_THROW(("Unable to vaCreateConfig(): %s\n", vaErrorStr(status)));
 
-    VASurfaceID surfaceIDs[NUM_VA_BUFFERS];
-    status = vaCreateSurfaces( _vc.display,
-                               VA_RT_FORMAT_YUV420,
-                               _context->width,
-                               _context->height,
-                               surfaceIDs,
-                               NUM_VA_BUFFERS,
-                               NULL,
-                               0 );
-    if( status != VA_STATUS_SUCCESS )
-        X_THROW(("Unable to vaCreateSurfaces(): %s\n", vaErrorStr(status)));
-
-    for( int i = 0; i < NUM_VA_BUFFERS; i++ )
     {
-        _surfaces[i].id = surfaceIDs[i];
-        _surfaces[i].refcount = 0;
-        _surfaces[i].order = 0;
+        XGuard g( _surfaceLock );
+
+        _surfaceWidth = (uint16_t)_context->width;
+        _surfaceHeight = (uint16_t)_context->height;
+
+        _AddSurfaces( _InitialSurfaceCount() );
+
+        _CreateContext();
     }
 
-    status = vaCreateContext( _vc.display,
-                              _vc.config_id,
-                              _context->width,
-                              _context->height,
-                              VA_PROGRESSIVE,
-                              surfaceIDs,
-                              NUM_VA_BUFFERS,
-                              &_vc.context_id );
-    if( status != VA_STATUS_SUCCESS )
-        X_THROW(("Unable to vaCreateContext(): %s\n", vaErrorStr(status)));
+    _vaWidth = (uint16_t)_context->width;
+    _vaHeight = (uint16_t)_context->height;
 
     VAImageFormat formatList[vaMaxNumImageFormats( _vc.display )];
     int numFormats = 0;
@@ -466,28 +1887,105 @@ void VAH264Decoder::_InitVAAPIDecoder()
     if( !nv12ImageFormat )
         X_THROW(("Unable to locate NV12 VAImageFormat!"));
 
-    status = vaCreateImage( _vc.display,
-                            nv12ImageFormat,
-                            _context->width,
-                            _context->height,
-                            &_outputImage );
-    if( status != VA_STATUS_SUCCESS )
-        X_THROW(("Unable to vaCreateImage(): %s\n", vaErrorStr(status)));
+    _nv12Format = *nv12ImageFormat;
+
+    // Further images are created on demand, as more pictures are queued.
+    VAImage image = _GetOutputImage();
+    _ReleaseOutputImage( image );
+}
+
+void VAH264Decoder::_ResizeVAAPIDecoder()
+{
+    uint16_t width = (uint16_t)_context->width;
+    uint16_t height = (uint16_t)_context->height;
+
+    if( width == _vaWidth && height == _vaHeight )
+    {
+        // The same size, but the SPS may need more references than the pool was
+        // sized for.
+        XGuard g( _surfaceLock );
+
+        size_t oldCount = _surfaces.size();
+
+        if( _TopUpSurfaces() )
+        {
+            if( _vc.context_id != VA_INVALID_ID )
+            {
+                vaDestroyContext( _vc.display, _vc.context_id );
+                _vc.context_id = VA_INVALID_ID;
+            }
+
+            try
+            {
+                _CreateContext();
+            }
+            catch( XException& ex )
+            {
+                // Carry on with the old pool, which _GrowSurfaces() can still grow.
+                X_LOG_WARNING( "Unable to top up VA surface pool (%s).", ex.what() );
+
+                _RemoveSurfaces( oldCount );
+                _CreateContext();
+            }
+        }
+
+        return;
+    }
+
+    // Queued pictures and readback images are the old size.
+    if( GetNumPictures() > 0 )
+        X_LOG_NOTICE( "Dropping %u decoded picture(s) on resolution change.", (unsigned int)GetNumPictures() );
+
+    _DropPictures();
+    _DestroyOutputImages();
+
+    {
+        XGuard g( _surfaceLock );
+
+        if( _vc.context_id != VA_INVALID_ID )
+        {
+            vaDestroyContext( _vc.display, _vc.context_id );
+            _vc.context_id = VA_INVALID_ID;
+        }
+
+        // Surfaces at least as large as the pictures are kept, so a switch to a
+        // smaller stream only costs a new context.
+        if( width > _surfaceWidth || height > _surfaceHeight )
+        {
+            _RetireSurfaces();
+
+            _surfaceWidth = width;
+            _surfaceHeight = height;
+
+            _AddSurfaces( _InitialSurfaceCount() );
+        }
+        else _TopUpSurfaces();
+
+        _CreateContext();
+    }
+
+    _vaWidth = width;
+    _vaHeight = height;
 }
 
 void VAH264Decoder::_DestroyVAAPIDecoder()
 {
     VAStatus status = VA_STATUS_SUCCESS;
 
-    if( _outputImage.image_id != VA_INVALID_ID )
+    _StopReadbackThread();
+
+    while( !_outputQueue.empty() )
     {
-        status = vaDestroyImage( _vc.display, _outputImage.image_id );
+        _ReleasePicture( _outputQueue.front() );
+        _outputQueue.pop_front();
+    }
 
-        if( status != VA_STATUS_SUCCESS )
-            X_LOG_WARNING( "Unable to vaDestroyImage().");
+    for( size_t i = 0; i < _regionConversions.size(); i++ )
+        _DestroyConversion( _regionConversions[i] );
 
-        _outputImage.image_id = VA_INVALID_ID;
-    }
+    _regionConversions.clear();
+
+    _DestroyOutputImages();
 
     if( _vc.context_id != VA_INVALID_ID )
     {
@@ -499,16 +1997,31 @@ void VAH264Decoder::_DestroyVAAPIDecoder()
         _vc.context_id = VA_INVALID_ID;
     }
 
-    for( int i = 0; i < NUM_VA_BUFFERS; i++ )
+    // There is no display if bring up failed early, or never ran because only
+    // parameter sets were decoded. No surfaces exist then either.
+    if( _display.IsValid() )
     {
-        if( _surfaces[i].id != VA_INVALID_ID )
+        // Every other reference is gone by now, so surfaces still referenced are held
+        // by NV12Frames that outlive us. They are left for the frames to free.
+        XGuard g( _display->lock );
+
+        _display->decoder = NULL;
+
+        for( size_t i = 0; i < _surfaces.size(); i++ )
         {
-            status = vaDestroySurfaces( _vc.display, &_surfaces[i].id, 1 );
+            if( _surfaces[i]->refcount > 0 )
+                continue;
+
+            status = vaDestroySurfaces( _vc.display, &_surfaces[i]->id, 1 );
             if( status != VA_STATUS_SUCCESS )
                 X_LOG_WARNING( "Unable to vaDestroySurfaces()." );
 
-            _surfaces[i].id = VA_INVALID_ID;
+            delete _surfaces[i];
         }
+
+        _surfaces.clear();
+        _freeSurfaces.clear();
+        _retiredSurfaces.clear();
     }
 
     if( _vc.config_id != VA_INVALID_ID )
@@ -521,22 +2034,10 @@ void VAH264Decoder::_DestroyVAAPIDecoder()
         _vc.config_id = VA_INVALID_ID;
     }
 
-    if( _vc.display != NULL )
-    {
-        status = vaTerminate( _vc.display );
-
-        if( status != VA_STATUS_SUCCESS )
-            X_LOG_WARNING( "Unable to vaTerminate().");
-
-        _vc.display = NULL;
-    }
-
-    if( _fd != -1 )
-    {
-        close( _fd );
-
-        _fd = -1;
-    }
+    // The display goes with the last NV12Frame, if any are left.
+    _display = XIRef<SharedVADisplay>();
+    _vc.display = NULL;
+    _fd = -1;
 
     _initComplete = false;
 }
@@ -554,7 +2055,11 @@ enum PixelFormat VAH264Decoder::_GetFormat( struct AVCodecContext *avctx, const
 
         if( avctx->codec_id == CODEC_ID_H264 )
         {
-            context->_InitVAAPIDecoder();
+            // Prewarm() may already have brought the device up, and a new SPS
+            // only needs it resized.
+            if( context->_vc.display == NULL )
+                context->_InitVAAPIDecoder();
+            else context->_ResizeVAAPIDecoder();
 
             avctx->hwaccel_context = &context->_vc;
 
@@ -571,36 +2076,35 @@ int VAH264Decoder::_GetBuffer( struct AVCodecContext* avctx, AVFrame* pic )
     if( !context )
         X_THROW(("Unable to get decoder context."));
 
-    int oldest, i;
+    struct HWSurface* surface = NULL;
 
     {
         XGuard g( context->_surfaceLock );
 
-        for( i = 0, oldest = 0; i < NUM_VA_BUFFERS; i++ )
+        if( context->_freeSurfaces.empty() && !context->_GrowSurfaces() )
         {
-            struct HWSurface* surface = &context->_surfaces[i];
-
-            if( !surface->refcount )
-                break;
-
-            if( surface->order < context->_surfaces[oldest].order )
-                oldest = i;
+            // Every surface is a reference or held for the caller. Handing one out
+            // anyway would corrupt it, so fail this picture instead.
+            X_LOG_WARNING( "No free VA surface (%u in use).", (unsigned int)context->_surfaces.size() );
+            return -1;
         }
 
-        if( i >= NUM_VA_BUFFERS )
-            i = oldest;
-    }
+        surface = context->_freeSurfaces.back();
+        context->_freeSurfaces.pop_back();
 
-    struct HWSurface* surface = &context->_surfaces[i];
+        surface->refcount = 1;
 
-    surface->refcount = 1;
-    surface->order = context->_surfaceOrder++;
+        size_t inUse = context->_surfaces.size() - context->_freeSurfaces.size();
+        if( inUse > context->_peakSurfacesInUse )
+            context->_peakSurfacesInUse = inUse;
+    }
 
     /* data[0] must be non-NULL for libavcodec internal checks.
      * data[3] actually contains the format-specific surface handle. */
 
     pic->opaque = surface;
     pic->type = FF_BUFFER_TYPE_USER;
+    pic->reordered_opaque = avctx->reordered_opaque;
     pic->data[0] = (uint8_t*)(uintptr_t)surface->id;
     pic->data[1] = NULL;
     pic->data[2] = NULL;
@@ -619,14 +2123,203 @@ void VAH264Decoder::_ReleaseBuffer( struct AVCodecContext* avctx, AVFrame* pic )
     if( !context )
         X_THROW(("Unable to get decoder context."));
 
-    {
-        XGuard g( context->_surfaceLock );
-        struct HWSurface* surface = (struct HWSurface*)pic->opaque;
-        surface->refcount--;
-    }
+    struct HWSurface* surface = (struct HWSurface*)pic->opaque;
+    if( surface )
+        context->_UnrefSurface( surface );
+
+    pic->opaque = NULL;
 
     pic->data[0] = NULL;
     pic->data[1] = NULL;
     pic->data[2] = NULL;
     pic->data[3] = NULL;
 }
+
+VAH264Decoder::ReadbackThread::ReadbackThread( VAH264Decoder* parent ) :
+    XThread( "VAH264Decoder" ),
+    _parent( parent )
+{
+}
+
+VAH264Decoder::ReadbackThread::~ReadbackThread() throw()
+{
+}
+
+void* VAH264Decoder::ReadbackThread::EntryPoint()
+{
+    while( true )
+    {
+        struct Readback* readback = NULL;
+
+        {
+            XGuard g( _parent->_readbackLock );
+
+            while( _parent->_readbackRunning && (readback = _parent->_NextReadback()) == NULL )
+                _parent->_readbackCond.Wait();
+
+            if( !_parent->_readbackRunning )
+                break;
+        }
+
+        // vaGetImage() waits for the surface to finish decoding, then copies it out.
+        VAStatus status = vaGetImage( _parent->_vc.display,
+                                      readback->picture.surface->id,
+                                      0,
+                                      0,
+                                      readback->width,
+                                      readback->height,
+                                      readback->image.image_id );
+
+        {
+            XGuard g( _parent->_readbackLock );
+
+            if( status != VA_STATUS_SUCCESS )
+                readback->error = XString::Format( "Unable to vaGetImage(): %s", vaErrorStr(status) );
+
+            readback->done = true;
+            _parent->_readbackCond.Broadcast();
+        }
+    }
+
+    return NULL;
+}
+
+SharedVADisplay::SharedVADisplay( int fd, VADisplay display ) :
+    fd( fd ),
+    display( display ),
+    lock(),
+    decoder( NULL )
+{
+}
+
+SharedVADisplay::~SharedVADisplay() throw()
+{
+    if( display != NULL )
+    {
+        VAStatus status = vaTerminate( display );
+
+        if( status != VA_STATUS_SUCCESS )
+            X_LOG_WARNING( "Unable to vaTerminate().");
+    }
+
+    if( fd != -1 )
+        close( fd );
+}
+
+NV12Frame::NV12Frame( XIRef<SharedVADisplay> display,
+                      const VAImageFormat& nv12Format,
+                      struct HWSurface* surface,
+                      uint16_t width,
+                      uint16_t height,
+                      int64_t pts,
+                      bool key ) :
+    _display( display ),
+    _surface( surface ),
+    _image(),
+    _base( NULL ),
+    _width( width ),
+    _height( height ),
+    _pts( pts ),
+    _key( key )
+{
+    VADisplay vaDisplay = _display->display;
+
+    VAStatus status = vaDeriveImage( vaDisplay, _surface->id, &_image );
+
+    if( status == VA_STATUS_SUCCESS && _image.format.fourcc != VA_FOURCC_NV12 )
+    {
+        vaDestroyImage( vaDisplay, _image.image_id );
+        status = VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
+    // Not every driver can derive an NV12 image from a decode surface, in which case
+    // we fall back to a single copy of the picture.
+    if( status != VA_STATUS_SUCCESS )
+    {
+        VAImageFormat format = nv12Format;
+
+        status = vaCreateImage( vaDisplay, &format, _width, _height, &_image );
+        if( status != VA_STATUS_SUCCESS )
+            X_THROW(("Unable to vaCreateImage(): %s\n", vaErrorStr(status)));
+
+        status = vaGetImage( vaDisplay, _surface->id, 0, 0, _width, _height, _image.image_id );
+        if( status != VA_STATUS_SUCCESS )
+        {
+            vaDestroyImage( vaDisplay, _image.image_id );
+            X_THROW(("Unable to vaGetImage(): %s\n", vaErrorStr(status)));
+        }
+    }
+
+    status = vaMapBuffer( vaDisplay, _image.buf, (void**)&_base );
+    if( status != VA_STATUS_SUCCESS )
+    {
+        vaDestroyImage( vaDisplay, _image.image_id );
+        X_THROW(("Unable to vaMapBuffer(): %s\n", vaErrorStr(status)));
+    }
+}
+
+NV12Frame::~NV12Frame() throw()
+{
+    VADisplay vaDisplay = _display->display;
+
+    vaUnmapBuffer( vaDisplay, _image.buf );
+    vaDestroyImage( vaDisplay, _image.image_id );
+
+    XGuard g( _display->lock );
+
+    if( _display->decoder )
+    {
+        _display->decoder->_UnrefSurface( _surface );
+        return;
+    }
+
+    // Our decoder is gone and left the surface to us.
+    if( --_surface->refcount == 0 )
+    {
+        VAStatus status = vaDestroySurfaces( vaDisplay, &_surface->id, 1 );
+        if( status != VA_STATUS_SUCCESS )
+            X_LOG_WARNING( "Unable to vaDestroySurfaces()." );
+
+        delete _surface;
+    }
+}
+
+const uint8_t* NV12Frame::GetY() const
+{
+    return _base + _image.offsets[0];
+}
+
+const uint8_t* NV12Frame::GetUV() const
+{
+    return _base + _image.offsets[1];
+}
+
+size_t NV12Frame::GetYPitch() const
+{
+    return _image.pitches[0];
+}
+
+size_t NV12Frame::GetUVPitch() const
+{
+    return _image.pitches[1];
+}
+
+uint16_t NV12Frame::GetWidth() const
+{
+    return _width;
+}
+
+uint16_t NV12Frame::GetHeight() const
+{
+    return _height;
+}
+
+int64_t NV12Frame::GetPTS() const
+{
+    return _pts;
+}
+
+bool NV12Frame::IsKey() const
+{
+    return _key;
+}
@@ -12,8 +12,10 @@
 #include "VAKit/VAH264Encoder.h"
 #include "VAKit/BitStream.h"
 #include "VAKit/NALTypes.h"
+#include "VAKit/DeviceCapabilities.h"
 #include "XSDK/XException.h"
 #include <algorithm>
+#include <time.h>
 
 using namespace VAKit;
 using namespace std;
@@ -34,6 +36,34 @@ static const size_t DEFAULT_PADDING = 16;
 static const size_t DEFAULT_ENCODE_BUFFER_SIZE = (1024*1024);
 static const size_t DEFAULT_EXTRADATA_BUFFER_SIZE = (1024*256);
 
+static uint64_t NowNanos()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+static struct EncodeStageStats SummarizeStage( vector<uint64_t>& samples )
+{
+    struct EncodeStageStats stageStats;
+    memset( &stageStats, 0, sizeof( stageStats ) );
+
+    if( samples.empty() )
+        return stageStats;
+
+    sort( samples.begin(), samples.end() );
+
+    uint64_t sum = 0;
+    for( size_t i = 0; i < samples.size(); i++ )
+        sum += samples[i];
+
+    stageStats.minNanos = samples.front();
+    stageStats.avgNanos = sum / samples.size();
+    stageStats.p99Nanos = samples[((samples.size() - 1) * 99) / 100];
+
+    return stageStats;
+}
+
 VAH264Encoder::VAH264Encoder( const struct AVKit::CodecOptions& options,
                               bool annexB ) :
     _devicePath(),
@@ -41,36 +71,53 @@ VAH264Encoder::VAH264Encoder( const struct AVKit::CodecOptions& options,
     _fd(-1),
     _display(),
     _h264Profile( VAProfileH264High ),
-    _configID( 0 ),
-    _srcSurfaceID( 0 ),
-    _codedBufID( 0 ),
+    _configID( VA_INVALID_ID ),
+    _srcSurfaceID( VA_INVALID_SURFACE ),
+    _codedBufID( VA_INVALID_ID ),
     _refSurfaceIDs(),
-    _contextID(0),
+    _contextID( VA_INVALID_ID ),
     _seqParam(),
     _picParam(),
     _sliceParam(),
     _currentCurrPic(),
     _referenceFrames(),
     _refPicListP(),
+    _numShortTerm( 0 ),
     _constraintSetFlag( 0 ),
     _h264EntropyMode( 1 ), /* cabac */
     _frameWidth( 0 ),
     _frameWidthMBAligned( 0 ),
     _frameHeight( 0 ),
     _frameHeightMBAligned( 0 ),
+    _surfaceWidth( 0 ),
+    _surfaceHeight( 0 ),
     _frameBitRate( 0 ),
+    _rateControl( VA_RC_CQP ),
     _intraPeriod( 15 ),
     _currentIDRDisplay( 0 ),
+    _picOrderCntMsbRef( 0 ),
+    _picOrderCntLsbRef( 0 ),
     _currentFrameNum( 0 ),
     _currentFrameType( 0 ),
     _timeBaseNum( 0 ),
     _timeBaseDen( 0 ),
     _initialQP( 26 ),
+    _ppsQP( 26 ),
+    _resendSequence( false ),
+    _rebuildExtraData( false ),
     _extraData(),
     _options( options ),
     _pf( new PacketFactoryDefault ),
-    _pkt()
+    _pkt(),
+    _lastStats(),
+    _stats(),
+    _statsWindow(),
+    _statsWindowSize( DEFAULT_STATS_WINDOW ),
+    _statsWindowPos( 0 )
 {
+    for( size_t i = 0; i < SURFACE_NUM; i++ )
+        _refSurfaceIDs[i] = VA_INVALID_SURFACE;
+
     if( options.device_path.IsNull() )
         X_THROW(("device_path needed for VAH264Encoder."));
 
@@ -82,19 +129,13 @@ VAH264Encoder::VAH264Encoder( const struct AVKit::CodecOptions& options,
 
     _display = (VADisplay)vaGetDisplayDRM( _fd );
 
-    if( !options.width.IsNull() )
-    {
-        _frameWidth = options.width.Value();
-        _frameWidthMBAligned = (_frameWidth + 15) & (~15);
-    }
-    else X_THROW(( "Required option missing: width" ));
+    if( options.width.IsNull() )
+        X_THROW(( "Required option missing: width" ));
 
-    if( !options.height.IsNull() )
-    {
-        _frameHeight = options.height.Value();
-        _frameHeightMBAligned = (_frameHeight + 15) & (~15);
-    }
-    else X_THROW(( "Required option missing: height" ));
+    if( options.height.IsNull() )
+        X_THROW(( "Required option missing: height" ));
+
+    _SetResolution( options.width.Value(), options.height.Value() );
 
     if( !options.bit_rate.IsNull() )
     {
@@ -116,6 +157,8 @@ VAH264Encoder::VAH264Encoder( const struct AVKit::CodecOptions& options,
     if( !options.initial_qp.IsNull() )
         _initialQP = options.initial_qp.Value();
 
+    _ppsQP = _initialQP;
+
     int major_ver = 0, minor_ver = 0;
     VAStatus status = vaInitialize( _display, &major_ver, &minor_ver );
     if( status != VA_STATUS_SUCCESS )
@@ -150,8 +193,15 @@ VAH264Encoder::VAH264Encoder( const struct AVKit::CodecOptions& options,
     configAttrib[configAttribNum].value = VA_RT_FORMAT_YUV420;
     configAttribNum++;
 
+    // Bitrate only means something to the driver in CBR or VBR mode. Devices that
+    // offer neither encode at a fixed QP and cannot follow bitrate changes.
+    _rateControl = ChooseRateControl( GetDeviceCapabilities( _devicePath ) );
+
+    if( _rateControl == VA_RC_CQP )
+        X_LOG_NOTICE( "%s has no CBR or VBR rate control, encoding at a fixed QP.", _devicePath.c_str() );
+
     configAttrib[configAttribNum].type = VAConfigAttribRateControl;
-    configAttrib[configAttribNum].value = VA_RC_CQP;
+    configAttrib[configAttribNum].value = _rateControl;
     configAttribNum++;
 
     configAttrib[configAttribNum].type = VAConfigAttribEncPackedHeaders;
@@ -173,149 +223,124 @@ VAH264Encoder::VAH264Encoder( const struct AVKit::CodecOptions& options,
     // encoder channel. I point this out because we might want to split this out
     // someday.
 
-    /* create source surfaces */
-    status = vaCreateSurfaces( _display,
-                               VA_RT_FORMAT_YUV420,
-                               _frameWidthMBAligned,
-                               _frameHeightMBAligned,
-                               &_srcSurfaceID,
-                               1,
-                               NULL,
-                               0 );
-
-    if( status != VA_STATUS_SUCCESS )
-        X_THROW(( "Unable to vaCreateSurfaces (%s).", vaErrorStr(status) ));
-
-    /* create reference surfaces */
-    status = vaCreateSurfaces( _display,
-                               VA_RT_FORMAT_YUV420,
-                               _frameWidthMBAligned,
-                               _frameHeightMBAligned,
-                               &_refSurfaceIDs[0],
-                               SURFACE_NUM,
-                               NULL,
-                               0 );
+    _CreateSurfaces();
 
-    if( status != VA_STATUS_SUCCESS )
-        X_THROW(( "Unable to vaCreateSurfaces (%s).", vaErrorStr(status) ));
+    _CreateContext();
+}
 
-    VASurfaceID* tmp_surfaceid = (VASurfaceID*)calloc( 2, sizeof(VASurfaceID) );
-    memcpy( tmp_surfaceid, &_srcSurfaceID, sizeof(VASurfaceID) );
-    memcpy( tmp_surfaceid + 1, &_refSurfaceIDs, sizeof(VASurfaceID) );
+VAH264Encoder::~VAH264Encoder() throw()
+{
+    _DestroyContext();
 
-    /* Create a context for this encode pipe */
-    status = vaCreateContext( _display,
-                              _configID,
-                              _frameWidthMBAligned,
-                              _frameHeightMBAligned,
-                              VA_PROGRESSIVE,
-                              tmp_surfaceid,
-                              2,
-                              &_contextID );
+    _DestroySurfaces();
 
-    free(tmp_surfaceid);
+    if( _configID != VA_INVALID_ID )
+        vaDestroyConfig( _display, _configID );
 
-    if( status != VA_STATUS_SUCCESS )
-        X_THROW(( "Unable to vaCreateContext (%s).", vaErrorStr(status) ));
+    vaTerminate( _display );
 
-    status = vaCreateBuffer( _display,
-                             _contextID,
-                             VAEncCodedBufferType,
-                             (_frameWidthMBAligned * _frameHeightMBAligned * 400) / (16*16),
-                             1,
-                             NULL,
-                             &_codedBufID );
-    if( status != VA_STATUS_SUCCESS )
-        X_THROW(( "Unable to vaCreateBuffer (%s).", vaErrorStr(status) ));
+    close( _fd );
 }
 
-VAH264Encoder::~VAH264Encoder() throw()
+bool VAH264Encoder::HasHW( const XString& devicePath )
 {
-    vaDestroyBuffer( _display, _codedBufID );
+    // Probed once per device, then answered from the cache.
+    return GetDeviceCapabilities( devicePath ).h264Encode.supported;
+}
 
-    vaDestroyContext( _display, _contextID );
+void VAH264Encoder::Reconfigure( const struct AVKit::CodecOptions& options )
+{
+    if( !options.bit_rate.IsNull() )
+    {
+        uint32_t frameBitRate = (options.bit_rate.Value() / 1024) / 8;
 
-    vaDestroySurfaces( _display, &_refSurfaceIDs[0], SURFACE_NUM );
+        if( frameBitRate != _frameBitRate )
+        {
+            if( _rateControl == VA_RC_CQP )
+                X_THROW(( "%s encodes at a fixed QP, so bitrate cannot be changed.", _devicePath.c_str() ));
 
-    vaDestroySurfaces( _display, &_srcSurfaceID, 1 );
+            _frameBitRate = frameBitRate;
+            _resendSequence = true;
+            _rebuildExtraData = true;
+        }
 
-    vaDestroyConfig( _display, _configID );
+        _options.bit_rate = options.bit_rate;
+    }
 
-    vaTerminate( _display );
+    if( !options.gop_size.IsNull() )
+    {
+        if( options.gop_size.Value() != _intraPeriod )
+        {
+            _intraPeriod = options.gop_size.Value();
+            _resendSequence = true;
+        }
 
-    close( _fd );
-}
+        _options.gop_size = options.gop_size;
+    }
 
-bool VAH264Encoder::HasHW( const XString& devicePath )
-{
-    bool hasHW = true;
+    // QP changes are applied immediately via slice_qp_delta, relative to the
+    // pic_init_qp in the PPS we last sent. The PPS itself picks up the new value at
+    // the next IDR.
+    if( !options.initial_qp.IsNull() )
+    {
+        _initialQP = options.initial_qp.Value();
+        _options.initial_qp = options.initial_qp;
+    }
 
-    int fd = open( devicePath.c_str(), O_RDWR );
-    if( fd <= 0 )
-        hasHW = false;
+    int32_t width = (!options.width.IsNull()) ? options.width.Value() : _frameWidth;
+    int32_t height = (!options.height.IsNull()) ? options.height.Value() : _frameHeight;
 
-    if( hasHW )
+    if( width != _frameWidth || height != _frameHeight )
     {
-        VADisplay display = (VADisplay)vaGetDisplayDRM( fd );
-        if( !vaDisplayIsValid( display ) )
-            hasHW = false;
+        _DestroyContext();
+
+        _SetResolution( width, height );
 
-        if( hasHW )
+        if( _frameWidthMBAligned > _surfaceWidth || _frameHeightMBAligned > _surfaceHeight )
         {
-            int major_ver = 0, minor_ver = 0;
-            VAStatus status = vaInitialize( display, &major_ver, &minor_ver );
-            if( status != VA_STATUS_SUCCESS )
-                hasHW = false;
-
-            if( hasHW )
-            {
-                VAConfigAttrib configAttrib[VAConfigAttribTypeMax];
-                int configAttribNum = 0;
-
-                configAttrib[configAttribNum].type = VAConfigAttribRTFormat;
-                configAttrib[configAttribNum].value = VA_RT_FORMAT_YUV420;
-                configAttribNum++;
-
-                configAttrib[configAttribNum].type = VAConfigAttribRateControl;
-                configAttrib[configAttribNum].value = VA_RC_CQP;
-                configAttribNum++;
-
-                configAttrib[configAttribNum].type = VAConfigAttribEncPackedHeaders;
-                configAttrib[configAttribNum].value = VA_ENC_PACKED_HEADER_NONE;
-                configAttrib[configAttribNum].value = VA_ENC_PACKED_HEADER_SEQUENCE | VA_ENC_PACKED_HEADER_PICTURE;
-                configAttribNum++;
-
-                VAConfigID configID = VA_INVALID_ID;
-                status = vaCreateConfig( display,
-                                         VAProfileH264High,
-                                         VAEntrypointEncSlice,
-                                         &configAttrib[0],
-                                         configAttribNum,
-                                         &configID );
-                if( status != VA_STATUS_SUCCESS )
-                    hasHW = false;
-
-                if( hasHW )
-                    vaDestroyConfig( display, configID );
-            }
-
-            vaTerminate( display );
+            _DestroySurfaces();
+            _CreateSurfaces();
         }
 
-        close( fd );
+        _CreateContext();
+
+        // Restarting frame_num at 0 makes the next frame an IDR carrying the new
+        // SPS/PPS, and drops references to pictures of the old size.
+        _currentFrameNum = 0;
+        _numShortTerm = 0;
+        ++_sliceParam.idr_pic_id;
+
+        _resendSequence = true;
+        _rebuildExtraData = true;
+
+        _options.width = options.width;
+        _options.height = options.height;
     }
+}
 
-    return hasHW;
+void VAH264Encoder::StartSegment( uint16_t idrPicID )
+{
+    _currentFrameNum = 0;
+    _numShortTerm = 0;
+    _sliceParam.idr_pic_id = idrPicID;
 }
 
 void VAH264Encoder::EncodeYUV420P( XIRef<Packet> input,
                                    FrameType type )
 {
+    uint64_t uploadStart = NowNanos();
+
     VAImage image;
-    vaDeriveImage( _display, _srcSurfaceID, &image );
+    VAStatus status = vaDeriveImage( _display, _srcSurfaceID, &image );
+    if( status != VA_STATUS_SUCCESS )
+        X_THROW(( "Unable to vaDeriveImage (%s).", vaErrorStr(status) ));
 
     _UploadImage( input->Map(), image, _frameWidth, _frameHeight );
 
+    vaDestroyImage( _display, image.image_id );
+
+    uint64_t renderStart = NowNanos();
+
     _currentFrameType = _ComputeCurrentFrameType( _currentFrameNum,
                                                   _intraPeriod,
                                                   type );
@@ -327,12 +352,14 @@ void VAH264Encoder::EncodeYUV420P( XIRef<Packet> input,
         _currentIDRDisplay = _currentFrameNum;
     }
 
-    VAStatus status = vaBeginPicture( _display, _contextID, _srcSurfaceID );
+    status = vaBeginPicture( _display, _contextID, _srcSurfaceID );
     if( status != VA_STATUS_SUCCESS )
         X_THROW(( "Unable to vaBeginPicture (%s).", vaErrorStr(status) ));
 
     if( _currentFrameType == FRAME_IDR )
     {
+        _ppsQP = _initialQP;
+
         _RenderSequence();
 
         _RenderPicture( false );
@@ -341,7 +368,7 @@ void VAH264Encoder::EncodeYUV420P( XIRef<Packet> input,
 
         _RenderPackedPPS();
 
-        if( !_extraData.Get() )
+        if( !_extraData.Get() || _rebuildExtraData )
         {
             BitStream seqBS;
             BuildPackedSeqBuffer( seqBS,
@@ -359,9 +386,19 @@ void VAH264Encoder::EncodeYUV420P( XIRef<Packet> input,
 
             memcpy( &_extraData->Extend(seqBS.Size()), seqBS.Map(), seqBS.Size() );
             memcpy( &_extraData->Extend(ppsBS.Size()), ppsBS.Map(), ppsBS.Size() );
+
+            _rebuildExtraData = false;
         }
     }
-    else _RenderPicture( false );
+    else
+    {
+        if( _resendSequence )
+            _RenderSequence();
+
+        _RenderPicture( false );
+    }
+
+    _resendSequence = false;
 
     _RenderSlice();
 
@@ -371,10 +408,14 @@ void VAH264Encoder::EncodeYUV420P( XIRef<Packet> input,
 
     _UpdateReferenceFrames();
 
+    uint64_t syncStart = NowNanos();
+
     status = vaSyncSurface( _display, _srcSurfaceID );
     if( status != VA_STATUS_SUCCESS )
         X_THROW(( "Unable to vaSyncSurface (%s).", vaErrorStr(status) ));
 
+    uint64_t copyStart = NowNanos();
+
     VACodedBufferSegment* bufList = NULL;
 
     status = vaMapBuffer( _display, _codedBufID, (void **)(&bufList) );
@@ -383,6 +424,13 @@ void VAH264Encoder::EncodeYUV420P( XIRef<Packet> input,
 
     VACodedBufferSegment* current = bufList;
 
+    // Under CBR and VBR the driver picks the QP, and reports its average for the
+    // frame in the first segment's status.
+    int32_t qp = (bufList) ? (int32_t)(bufList->status & VA_CODED_BUF_STATUS_PICTURE_AVE_QP_MASK) : 0;
+
+    if( qp == 0 && _rateControl == VA_RC_CQP )
+        qp = _ppsQP + _sliceParam.slice_qp_delta;
+
     uint32_t accumSize = 0;
 
     while( current != NULL )
@@ -408,6 +456,21 @@ void VAH264Encoder::EncodeYUV420P( XIRef<Packet> input,
     vaUnmapBuffer( _display, _codedBufID );
 
     _pkt->SetDataSize( accumSize );
+
+    uint64_t copyEnd = NowNanos();
+
+    _lastStats.key = LastWasKey();
+    _lastStats.idr = (_currentFrameType == FRAME_IDR);
+    _lastStats.frameNum = _currentCurrPic.frame_idx;
+    _lastStats.poc = _currentCurrPic.TopFieldOrderCnt;
+    _lastStats.qp = qp;
+    _lastStats.codedSize = accumSize;
+    _lastStats.uploadNanos = renderStart - uploadStart;
+    _lastStats.renderNanos = syncStart - renderStart;
+    _lastStats.syncNanos = copyStart - syncStart;
+    _lastStats.copyNanos = copyEnd - copyStart;
+
+    _RecordStats();
 }
 
 XIRef<Packet> VAH264Encoder::Get()
@@ -433,6 +496,55 @@ XIRef<XMemory> VAH264Encoder::GetExtraData() const
     return _extraData;
 }
 
+struct EncodeFrameStats VAH264Encoder::GetLastFrameStats() const
+{
+    return _lastStats;
+}
+
+struct EncodeStats VAH264Encoder::GetStats() const
+{
+    struct EncodeStats stats = _stats;
+
+    size_t n = _statsWindow.size();
+    stats.windowFrames = n;
+
+    vector<uint64_t> upload( n ), render( n ), sync( n ), copy( n ), total( n );
+
+    for( size_t i = 0; i < n; i++ )
+    {
+        const struct EncodeFrameStats& frameStats = _statsWindow[i];
+
+        upload[i] = frameStats.uploadNanos;
+        render[i] = frameStats.renderNanos;
+        sync[i] = frameStats.syncNanos;
+        copy[i] = frameStats.copyNanos;
+        total[i] = upload[i] + render[i] + sync[i] + copy[i];
+    }
+
+    stats.upload = SummarizeStage( upload );
+    stats.render = SummarizeStage( render );
+    stats.sync = SummarizeStage( sync );
+    stats.copy = SummarizeStage( copy );
+    stats.total = SummarizeStage( total );
+
+    return stats;
+}
+
+void VAH264Encoder::SetStatsWindow( size_t frames )
+{
+    if( frames == 0 )
+        X_THROW(( "Stats window must hold at least one frame." ));
+
+    _statsWindowSize = frames;
+    _statsWindow.clear();
+    _statsWindowPos = 0;
+}
+
+size_t VAH264Encoder::GetStatsWindow() const
+{
+    return _statsWindowSize;
+}
+
 int32_t VAH264Encoder::_ComputeCurrentFrameType( uint32_t currentFrameNum,
                                                  int32_t intraPeriod,
                                                  AVKit::FrameType type ) const
@@ -520,6 +632,7 @@ void VAH264Encoder::_RenderSequence()
         _seqParam.frame_crop_top_offset = 0;
         _seqParam.frame_crop_bottom_offset = (_frameHeightMBAligned - _frameHeight) / 2;
     }
+    else _seqParam.frame_cropping_flag = 0;
 
     status = vaCreateBuffer( _display,
                              _contextID,
@@ -576,15 +689,14 @@ void VAH264Encoder::_RenderSequence()
 
 int32_t VAH264Encoder::_CalcPOC( int32_t picOrderCntLSB )
 {
-    static int picOrderCntMsbRef = 0, picOrderCntLsbRef = 0;
     int prevPicOrderCntMsb = 0, prevPicOrderCntLsb = 0;
     int picOrderCntMsb = 0, topFieldOrderCnt = 0;
 
     if( _currentFrameType == FRAME_IDR )
         prevPicOrderCntMsb = prevPicOrderCntLsb = 0;
     else {
-        prevPicOrderCntMsb = picOrderCntMsbRef;
-        prevPicOrderCntLsb = picOrderCntLsbRef;
+        prevPicOrderCntMsb = _picOrderCntMsbRef;
+        prevPicOrderCntLsb = _picOrderCntLsbRef;
     }
 
     if( (picOrderCntLSB < prevPicOrderCntLsb) &&
@@ -598,8 +710,8 @@ int32_t VAH264Encoder::_CalcPOC( int32_t picOrderCntLSB )
 
     topFieldOrderCnt = picOrderCntMsb + picOrderCntLSB;
 
-    picOrderCntMsbRef = picOrderCntMsb;
-    picOrderCntLsbRef = picOrderCntLSB;
+    _picOrderCntMsbRef = picOrderCntMsb;
+    _picOrderCntLsbRef = picOrderCntLSB;
 
     return topFieldOrderCnt;
 }
@@ -634,7 +746,7 @@ void VAH264Encoder::_RenderPicture( bool done )
     _picParam.frame_num = _currentFrameNum;
     _picParam.coded_buf = _codedBufID;
     _picParam.last_picture = (done)?1:0;
-    _picParam.pic_init_qp = _initialQP;
+    _picParam.pic_init_qp = _ppsQP;
 
     VAStatus status = vaCreateBuffer( _display,
                                       _contextID,
@@ -761,7 +873,7 @@ void VAH264Encoder::_RenderSlice()
     _sliceParam.macroblock_address = 0;
     _sliceParam.num_macroblocks = _frameWidthMBAligned * _frameHeightMBAligned/(16*16); /*Measured by MB*/
     _sliceParam.slice_type = (_currentFrameType == FRAME_IDR)?2:_currentFrameType;
-    _sliceParam.slice_qp_delta = 0;
+    _sliceParam.slice_qp_delta = _initialQP - _ppsQP;
 
     if( _currentFrameType == FRAME_IDR )
     {
@@ -848,3 +960,144 @@ void VAH264Encoder::_UploadImage( uint8_t* yv12, VAImage& image, uint16_t width,
 
     vaUnmapBuffer( _display, image.buf );
 }
+
+void VAH264Encoder::_RecordStats()
+{
+    _stats.frames++;
+    if( _lastStats.key )
+        _stats.keyFrames++;
+    _stats.codedBytes += _lastStats.codedSize;
+    _stats.uploadNanos += _lastStats.uploadNanos;
+    _stats.renderNanos += _lastStats.renderNanos;
+    _stats.syncNanos += _lastStats.syncNanos;
+    _stats.copyNanos += _lastStats.copyNanos;
+
+    if( _statsWindow.size() < _statsWindowSize )
+        _statsWindow.push_back( _lastStats );
+    else
+    {
+        _statsWindow[_statsWindowPos] = _lastStats;
+        _statsWindowPos = (_statsWindowPos + 1) % _statsWindowSize;
+    }
+}
+
+void VAH264Encoder::_SetResolution( int32_t width, int32_t height )
+{
+    _frameWidth = width;
+    _frameWidthMBAligned = (_frameWidth + 15) & (~15);
+    _frameHeight = height;
+    _frameHeightMBAligned = (_frameHeight + 15) & (~15);
+}
+
+void VAH264Encoder::_CreateSurfaces()
+{
+    /* create source surfaces */
+    VAStatus status = vaCreateSurfaces( _display,
+                                        VA_RT_FORMAT_YUV420,
+                                        _frameWidthMBAligned,
+                                        _frameHeightMBAligned,
+                                        &_srcSurfaceID,
+                                        1,
+                                        NULL,
+                                        0 );
+
+    if( status != VA_STATUS_SUCCESS )
+    {
+        _srcSurfaceID = VA_INVALID_SURFACE;
+        X_THROW(( "Unable to vaCreateSurfaces (%s).", vaErrorStr(status) ));
+    }
+
+    /* create reference surfaces */
+    status = vaCreateSurfaces( _display,
+                               VA_RT_FORMAT_YUV420,
+                               _frameWidthMBAligned,
+                               _frameHeightMBAligned,
+                               &_refSurfaceIDs[0],
+                               SURFACE_NUM,
+                               NULL,
+                               0 );
+
+    if( status != VA_STATUS_SUCCESS )
+    {
+        _refSurfaceIDs[0] = VA_INVALID_SURFACE;
+        X_THROW(( "Unable to vaCreateSurfaces (%s).", vaErrorStr(status) ));
+    }
+
+    _surfaceWidth = _frameWidthMBAligned;
+    _surfaceHeight = _frameHeightMBAligned;
+}
+
+void VAH264Encoder::_DestroySurfaces()
+{
+    // The IDs are invalidated as they go, so a destructor running after a throw half
+    // way through Reconfigure() does not destroy them twice.
+    if( _refSurfaceIDs[0] != VA_INVALID_SURFACE )
+    {
+        vaDestroySurfaces( _display, &_refSurfaceIDs[0], SURFACE_NUM );
+
+        for( size_t i = 0; i < SURFACE_NUM; i++ )
+            _refSurfaceIDs[i] = VA_INVALID_SURFACE;
+    }
+
+    if( _srcSurfaceID != VA_INVALID_SURFACE )
+    {
+        vaDestroySurfaces( _display, &_srcSurfaceID, 1 );
+        _srcSurfaceID = VA_INVALID_SURFACE;
+    }
+
+    _surfaceWidth = 0;
+    _surfaceHeight = 0;
+}
+
+void VAH264Encoder::_CreateContext()
+{
+    VASurfaceID* tmp_surfaceid = (VASurfaceID*)calloc( 2, sizeof(VASurfaceID) );
+    memcpy( tmp_surfaceid, &_srcSurfaceID, sizeof(VASurfaceID) );
+    memcpy( tmp_surfaceid + 1, &_refSurfaceIDs, sizeof(VASurfaceID) );
+
+    /* Create a context for this encode pipe */
+    VAStatus status = vaCreateContext( _display,
+                                       _configID,
+                                       _frameWidthMBAligned,
+                                       _frameHeightMBAligned,
+                                       VA_PROGRESSIVE,
+                                       tmp_surfaceid,
+                                       2,
+                                       &_contextID );
+
+    free(tmp_surfaceid);
+
+    if( status != VA_STATUS_SUCCESS )
+    {
+        _contextID = VA_INVALID_ID;
+        X_THROW(( "Unable to vaCreateContext (%s).", vaErrorStr(status) ));
+    }
+
+    status = vaCreateBuffer( _display,
+                             _contextID,
+                             VAEncCodedBufferType,
+                             (_frameWidthMBAligned * _frameHeightMBAligned * 400) / (16*16),
+                             1,
+                             NULL,
+                             &_codedBufID );
+    if( status != VA_STATUS_SUCCESS )
+    {
+        _codedBufID = VA_INVALID_ID;
+        X_THROW(( "Unable to vaCreateBuffer (%s).", vaErrorStr(status) ));
+    }
+}
+
+void VAH264Encoder::_DestroyContext()
+{
+    if( _codedBufID != VA_INVALID_ID )
+    {
+        vaDestroyBuffer( _display, _codedBufID );
+        _codedBufID = VA_INVALID_ID;
+    }
+
+    if( _contextID != VA_INVALID_ID )
+    {
+        vaDestroyContext( _display, _contextID );
+        _contextID = VA_INVALID_ID;
+    }
+}
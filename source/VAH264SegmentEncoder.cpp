@@ -0,0 +1,319 @@
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// XSDK
+// Copyright (c) 2015 Schneider Electric
+//
+// Use, modification, and distribution is subject to the Boost Software License,
+// Version 1.0 (See accompanying file LICENSE).
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+#include "VAKit/VAH264SegmentEncoder.h"
+#include "VAKit/NALTypes.h"
+#include "XSDK/XException.h"
+#include "XSDK/XGuard.h"
+
+using namespace VAKit;
+using namespace AVKit;
+using namespace XSDK;
+using namespace std;
+
+static const size_t DEFAULT_GOP_SIZE = 15;
+
+// How many submitted segments may wait for a context, per context, before
+// EncodeYUV420P() blocks.
+static const size_t PENDING_SEGMENTS_PER_CONTEXT = 2;
+
+VAH264SegmentEncoder::VAH264SegmentEncoder( const struct CodecOptions& options,
+                                            size_t numContexts,
+                                            const vector<XString>& devicePaths ) :
+    _options( options ),
+    _gopSize( DEFAULT_GOP_SIZE ),
+    _encoders(),
+    _workers(),
+    _lock(),
+    _cond( _lock ),
+    _current( NULL ),
+    _nextIndex( 0 ),
+    _pending(),
+    _segments(),
+    _outputIndex( 0 ),
+    _outputFrame( 0 ),
+    _finished( false ),
+    _running( true ),
+    _error(),
+    _lastWasKey( false ),
+    _extraData()
+{
+    if( !_options.gop_size.IsNull() )
+        _gopSize = _options.gop_size.Value();
+
+    if( _gopSize == 0 )
+        X_THROW(( "gop_size must be greater than zero." ));
+
+    vector<XString> devices = devicePaths;
+
+    if( devices.empty() )
+    {
+        if( _options.device_path.IsNull() )
+            X_THROW(( "device_path needed for VAH264SegmentEncoder." ));
+
+        if( numContexts == 0 )
+            X_THROW(( "VAH264SegmentEncoder needs at least one context." ));
+
+        for( size_t i = 0; i < numContexts; i++ )
+            devices.push_back( _options.device_path.Value() );
+    }
+
+    for( size_t i = 0; i < devices.size(); i++ )
+    {
+        struct CodecOptions encoderOptions = _options;
+        encoderOptions.device_path = devices[i];
+
+        _encoders.push_back( new VAH264Encoder( encoderOptions ) );
+    }
+
+    for( size_t i = 0; i < _encoders.size(); i++ )
+    {
+        _workers.push_back( new Worker( this, _encoders[i] ) );
+        _workers.back()->Start();
+    }
+}
+
+VAH264SegmentEncoder::~VAH264SegmentEncoder() throw()
+{
+    {
+        XGuard g( _lock );
+        _running = false;
+        _cond.Broadcast();
+    }
+
+    for( size_t i = 0; i < _workers.size(); i++ )
+    {
+        _workers[i]->Join();
+        delete _workers[i];
+    }
+
+    for( size_t i = 0; i < _encoders.size(); i++ )
+        delete _encoders[i];
+
+    for( map<size_t, Segment*>::iterator i = _segments.begin(); i != _segments.end(); i++ )
+        delete i->second;
+
+    if( _current )
+        delete _current;
+}
+
+void VAH264SegmentEncoder::EncodeYUV420P( XIRef<Packet> input )
+{
+    XGuard g( _lock );
+
+    if( _finished )
+        X_THROW(( "Frames cannot be queued after Finish()." ));
+
+    if( !_current )
+    {
+        _current = new Segment;
+        _current->index = _nextIndex++;
+        _current->done = false;
+    }
+
+    _current->input.push_back( input );
+
+    if( _current->input.size() >= _gopSize )
+    {
+        while( _error.empty() && _pending.size() >= (_encoders.size() * PENDING_SEGMENTS_PER_CONTEXT) )
+            _cond.Wait();
+
+        _SubmitCurrent();
+    }
+}
+
+void VAH264SegmentEncoder::Finish()
+{
+    XGuard g( _lock );
+
+    if( _current )
+    {
+        if( _current->input.empty() )
+        {
+            delete _current;
+            _current = NULL;
+            _nextIndex--;
+        }
+        else _SubmitCurrent();
+    }
+
+    _finished = true;
+}
+
+XIRef<Packet> VAH264SegmentEncoder::Get()
+{
+    XGuard g( _lock );
+
+    while( true )
+    {
+        if( !_error.empty() )
+            X_THROW(( "Segment encode failed: %s", _error.c_str() ));
+
+        map<size_t, Segment*>::iterator found = _segments.find( _outputIndex );
+
+        // The next segment has not been submitted yet, so the caller has to queue
+        // more frames (or call Finish()) before there is anything to return.
+        if( found == _segments.end() )
+            return XIRef<Packet>();
+
+        Segment* segment = found->second;
+
+        if( segment->done )
+        {
+            XIRef<Packet> pkt = segment->output[_outputFrame];
+            _lastWasKey = segment->keys[_outputFrame];
+
+            _outputFrame++;
+
+            if( _outputFrame >= segment->output.size() )
+            {
+                _segments.erase( found );
+                delete segment;
+
+                _outputIndex++;
+                _outputFrame = 0;
+            }
+
+            return pkt;
+        }
+
+        _cond.Wait();
+    }
+}
+
+bool VAH264SegmentEncoder::LastWasKey() const
+{
+    return _lastWasKey;
+}
+
+XIRef<XMemory> VAH264SegmentEncoder::GetExtraData() const
+{
+    if( !_extraData.Get() )
+        X_THROW(("Encode the first segment before call to GetExtraData()."));
+
+    return _extraData;
+}
+
+void VAH264SegmentEncoder::_SubmitCurrent()
+{
+    _segments[_current->index] = _current;
+    _pending.push_back( _current );
+    _current = NULL;
+
+    _cond.Broadcast();
+}
+
+void VAH264SegmentEncoder::_EncodeSegment( VAH264Encoder* encoder, Segment* segment )
+{
+    encoder->StartSegment( (uint16_t)(segment->index & 0xffff) );
+
+    for( size_t i = 0; i < segment->input.size(); i++ )
+    {
+        encoder->EncodeYUV420P( segment->input[i] );
+
+        XIRef<Packet> pkt = encoder->Get();
+
+        // Every segment encoder produces identical SPS/PPS, so only the first
+        // segment keeps them.
+        if( i == 0 && segment->index != 0 )
+            _StripParameterSets( pkt );
+
+        segment->output.push_back( pkt );
+        segment->keys.push_back( encoder->LastWasKey() );
+    }
+
+    segment->input.clear();
+
+    if( segment->index == 0 )
+    {
+        XGuard g( _lock );
+        _extraData = encoder->GetExtraData();
+    }
+}
+
+void VAH264SegmentEncoder::_StripParameterSets( XIRef<Packet> pkt )
+{
+    vector<NALUnit> units;
+    FindNALUnits( pkt->Map(), pkt->GetDataSize(), units );
+
+    uint8_t* dst = pkt->Map();
+
+    for( size_t i = 0; i < units.size(); i++ )
+    {
+        if( units[i].type == NAL_SPS || units[i].type == NAL_PPS )
+            continue;
+
+        size_t unitSize = (units[i].data + units[i].size) - units[i].start;
+
+        memmove( dst, units[i].start, unitSize );
+        dst += unitSize;
+    }
+
+    pkt->SetDataSize( dst - pkt->Map() );
+}
+
+VAH264SegmentEncoder::Worker::Worker( VAH264SegmentEncoder* parent, VAH264Encoder* encoder ) :
+    XThread( "VAH264SegmentEncoder" ),
+    _parent( parent ),
+    _encoder( encoder )
+{
+}
+
+VAH264SegmentEncoder::Worker::~Worker() throw()
+{
+}
+
+void* VAH264SegmentEncoder::Worker::EntryPoint()
+{
+    while( true )
+    {
+        Segment* segment = NULL;
+
+        {
+            XGuard g( _parent->_lock );
+
+            while( _parent->_running && _parent->_pending.empty() )
+                _parent->_cond.Wait();
+
+            if( !_parent->_running )
+                break;
+
+            segment = _parent->_pending.front();
+            _parent->_pending.pop_front();
+
+            // A slot in the pending queue just opened up.
+            _parent->_cond.Broadcast();
+        }
+
+        XString error;
+
+        try
+        {
+            _parent->_EncodeSegment( _encoder, segment );
+        }
+        catch( XException& ex )
+        {
+            error = ex.what();
+        }
+
+        {
+            XGuard g( _parent->_lock );
+
+            if( !error.empty() && _parent->_error.empty() )
+                _parent->_error = error;
+
+            segment->done = true;
+            _parent->_cond.Broadcast();
+        }
+    }
+
+    return NULL;
+}
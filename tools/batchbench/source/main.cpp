@@ -0,0 +1,184 @@
+
+#include "XSDK/XIRef.h"
+#include "XSDK/XString.h"
+#include "XSDK/TimeUtils.h"
+#include "AVKit/AVDeMuxer.h"
+#include "AVKit/Options.h"
+#include "AVKit/Packet.h"
+#include "AVKit/Locky.h"
+#include "VAKit/VAH264Decoder.h"
+#include "VAKit/VABatchDecoder.h"
+
+#include <vector>
+
+using namespace XSDK;
+using namespace AVKit;
+using namespace VAKit;
+using namespace std;
+
+static void LoadPackets( const XString& fileName, vector<XIRef<Packet> >& packets )
+{
+    AVDeMuxer deMuxer( fileName );
+
+    int videoStreamIndex = deMuxer.GetVideoStreamIndex();
+    int streamIndex = -1;
+
+    while( deMuxer.ReadFrame( streamIndex ) )
+    {
+        if( streamIndex == videoStreamIndex )
+            packets.push_back( deMuxer.Get() );
+    }
+}
+
+static void CreateDecoders( const XString& devicePath, int numStreams, vector<VAH264Decoder*>& decoders )
+{
+    // Both runs read back on the thread that calls Get(), so the comparison is of
+    // batching alone.
+    for( int i = 0; i < numStreams; i++ )
+    {
+        decoders.push_back( new VAH264Decoder( GetFastH264DecoderOptions( devicePath ) ) );
+        decoders.back()->SetReadbackDepth( 1 );
+    }
+}
+
+static void DestroyDecoders( vector<VAH264Decoder*>& decoders )
+{
+    for( size_t i = 0; i < decoders.size(); i++ )
+        delete decoders[i];
+
+    decoders.clear();
+}
+
+// Each stream decodes the same packets, every stream getting frame N before any
+// gets frame N + 1, as they would arriving from many cameras.
+static size_t RunPerPacket( const vector<XIRef<Packet> >& packets, vector<VAH264Decoder*>& decoders, int frames )
+{
+    size_t pictures = 0;
+
+    for( int frame = 0; frame < frames; frame++ )
+    {
+        XIRef<Packet> pkt = packets[frame % packets.size()];
+
+        for( size_t i = 0; i < decoders.size(); i++ )
+        {
+            decoders[i]->Decode( pkt, frame );
+
+            while( decoders[i]->GetNumPictures() > 0 )
+            {
+                decoders[i]->Get();
+                pictures++;
+            }
+        }
+    }
+
+    return pictures;
+}
+
+static size_t RunBatched( const vector<XIRef<Packet> >& packets,
+                          vector<VAH264Decoder*>& decoders,
+                          int frames,
+                          VABatchDecoder& batch,
+                          size_t& errors )
+{
+    size_t pictures = 0;
+
+    vector<struct BatchItem> items( decoders.size() );
+    vector<struct BatchPicture> output;
+
+    for( int frame = 0; frame < frames; frame++ )
+    {
+        XIRef<Packet> pkt = packets[frame % packets.size()];
+
+        for( size_t i = 0; i < decoders.size(); i++ )
+        {
+            items[i].decoder = decoders[i];
+            items[i].packet = pkt;
+            items[i].pts = frame;
+        }
+
+        output.clear();
+        batch.Decode( items, output );
+
+        for( size_t i = 0; i < output.size(); i++ )
+        {
+            if( output[i].error.empty() )
+                pictures++;
+            else errors++;
+        }
+    }
+
+    return pictures;
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc < 5 )
+    {
+        printf("Invalid args.\n");
+        fflush(stdout);
+        exit(1);
+    }
+
+    XString inputFileName = argv[1];
+    XString devicePath = argv[2];
+    int numStreams = XString( argv[3] ).ToInt();
+    int frames = XString( argv[4] ).ToInt();
+    size_t numThreads = (argc > 5) ? (size_t)XString( argv[5] ).ToInt() : 0;
+
+    Locky::RegisterFFMPEG();
+
+    vector<XIRef<Packet> > packets;
+    LoadPackets( inputFileName, packets );
+
+    if( packets.empty() )
+    {
+        printf("No video packets in %s.\n", inputFileName.c_str());
+        exit(1);
+    }
+
+    vector<VAH264Decoder*> decoders;
+
+    CreateDecoders( devicePath, numStreams, decoders );
+
+    uint64_t start = XMonoClock::GetTime();
+    size_t perPacketPictures = RunPerPacket( packets, decoders, frames );
+    double perPacketSeconds = XMonoClock::GetElapsedTime( start, XMonoClock::GetTime() );
+
+    DestroyDecoders( decoders );
+
+    CreateDecoders( devicePath, numStreams, decoders );
+
+    size_t errors = 0;
+    double batchedSeconds = 0.0;
+    size_t batchedPictures = 0;
+
+    {
+        VABatchDecoder batch( numThreads );
+
+        start = XMonoClock::GetTime();
+        batchedPictures = RunBatched( packets, decoders, frames, batch, errors );
+        batchedSeconds = XMonoClock::GetElapsedTime( start, XMonoClock::GetTime() );
+
+        numThreads = batch.GetNumThreads();
+    }
+
+    DestroyDecoders( decoders );
+
+    double perPacketFPS = perPacketPictures / perPacketSeconds;
+    double batchedFPS = batchedPictures / batchedSeconds;
+
+    printf("streams: %d, frames per stream: %d, batch threads: %u\n", numStreams, frames, (unsigned int)numThreads);
+    printf("per packet: %u pictures in %f seconds, %f fps\n", (unsigned int)perPacketPictures, perPacketSeconds, perPacketFPS);
+    printf("batched:    %u pictures in %f seconds, %f fps\n", (unsigned int)batchedPictures, batchedSeconds, batchedFPS);
+    printf("speedup:    %f\n", batchedFPS / perPacketFPS);
+
+    Locky::UnregisterFFMPEG();
+
+    if( errors > 0 )
+    {
+        printf("%u batch errors.\n", (unsigned int)errors);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,230 @@
+
+#include "XSDK/XString.h"
+#include "XSDK/TimeUtils.h"
+#include "VAKit/NV12Convert.h"
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libswscale/swscale.h"
+}
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace XSDK;
+using namespace VAKit;
+using namespace std;
+
+// Mapped VA images usually have their rows padded out to a multiple of 64 bytes.
+static const size_t PITCH_ALIGNMENT = 64;
+
+// Scaled output is not expected to match swscale's bicubic filter, so this only
+// reports timings.
+static void BenchScaled( const uint8_t* y,
+                         const uint8_t* uv,
+                         size_t pitch,
+                         uint16_t width,
+                         uint16_t height,
+                         uint16_t outputWidth,
+                         uint16_t outputHeight,
+                         int iterations )
+{
+    vector<uint8_t> output( (outputWidth * outputHeight * 3) / 2 );
+
+    SwsContext* scaler = sws_getContext( width,
+                                         height,
+                                         PIX_FMT_NV12,
+                                         outputWidth,
+                                         outputHeight,
+                                         PIX_FMT_YUV420P,
+                                         SWS_BICUBIC,
+                                         NULL,
+                                         NULL,
+                                         NULL );
+    if( !scaler )
+    {
+        printf("Unable to allocate scaler context.\n");
+        fflush(stdout);
+        exit(1);
+    }
+
+    const uint8_t* srcPlanes[2];
+    srcPlanes[0] = y;
+    srcPlanes[1] = uv;
+
+    int srcStrides[2];
+    srcStrides[0] = (int)pitch;
+    srcStrides[1] = (int)pitch;
+
+    uint8_t* dstPlanes[3];
+    dstPlanes[0] = &output[0];
+    dstPlanes[1] = dstPlanes[0] + (outputWidth * outputHeight);
+    dstPlanes[2] = dstPlanes[1] + ((outputWidth / 2) * (outputHeight / 2));
+
+    int dstStrides[3];
+    dstStrides[0] = outputWidth;
+    dstStrides[1] = outputWidth / 2;
+    dstStrides[2] = outputWidth / 2;
+
+    uint64_t clockStart = XMonoClock::GetTime();
+
+    for( int i = 0; i < iterations; i++ )
+        sws_scale( scaler, srcPlanes, srcStrides, 0, height, dstPlanes, dstStrides );
+
+    double swsSeconds = XMonoClock::GetElapsedTime( clockStart, XMonoClock::GetTime() );
+
+    sws_freeContext( scaler );
+
+    NV12Scaler fastScaler( width, height, outputWidth, outputHeight );
+
+    size_t fastPitches[3];
+    fastPitches[0] = outputWidth;
+    fastPitches[1] = outputWidth / 2;
+    fastPitches[2] = outputWidth / 2;
+
+    clockStart = XMonoClock::GetTime();
+
+    for( int i = 0; i < iterations; i++ )
+        fastScaler.ToI420( y, pitch, uv, pitch, dstPlanes, fastPitches );
+
+    double fastSeconds = XMonoClock::GetElapsedTime( clockStart, XMonoClock::GetTime() );
+
+    printf( "%ux%u->%ux%u kernel=%s sws_bicubic_ms=%.3f nv12scaler_ms=%.3f speedup=%.2f\n",
+            width,
+            height,
+            outputWidth,
+            outputHeight,
+            GetConvertKernelName(),
+            (swsSeconds * 1000.0) / iterations,
+            (fastSeconds * 1000.0) / iterations,
+            (fastSeconds > 0.0) ? swsSeconds / fastSeconds : 0.0 );
+    fflush(stdout);
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc < 4 )
+    {
+        printf("Invalid args.\n");
+        fflush(stdout);
+        exit(1);
+    }
+
+    uint16_t width = (uint16_t)XString( argv[1] ).ToInt();
+    uint16_t height = (uint16_t)XString( argv[2] ).ToInt();
+    int iterations = XString( argv[3] ).ToInt();
+
+    if( width == 0 || height == 0 || (width % 2) != 0 || (height % 2) != 0 || iterations <= 0 )
+    {
+        printf("Width and height must be even and non zero, and iterations positive.\n");
+        fflush(stdout);
+        exit(1);
+    }
+
+    size_t pitch = ((width + PITCH_ALIGNMENT - 1) / PITCH_ALIGNMENT) * PITCH_ALIGNMENT;
+
+    vector<uint8_t> y( pitch * height );
+    vector<uint8_t> uv( pitch * (height / 2) );
+
+    for( size_t i = 0; i < y.size(); i++ )
+        y[i] = (uint8_t)rand();
+    for( size_t i = 0; i < uv.size(); i++ )
+        uv[i] = (uint8_t)rand();
+
+    size_t outputSize = (width * height * 3) / 2;
+
+    vector<uint8_t> swsOutput( outputSize );
+    vector<uint8_t> fastOutput( outputSize );
+
+    SwsContext* scaler = sws_getContext( width,
+                                         height,
+                                         PIX_FMT_NV12,
+                                         width,
+                                         height,
+                                         PIX_FMT_YUV420P,
+                                         SWS_BICUBIC,
+                                         NULL,
+                                         NULL,
+                                         NULL );
+    if( !scaler )
+    {
+        printf("Unable to allocate scaler context.\n");
+        fflush(stdout);
+        exit(1);
+    }
+
+    uint8_t* srcPlanes[2];
+    srcPlanes[0] = &y[0];
+    srcPlanes[1] = &uv[0];
+
+    int srcStrides[2];
+    srcStrides[0] = (int)pitch;
+    srcStrides[1] = (int)pitch;
+
+    uint8_t* dstPlanes[3];
+    dstPlanes[0] = &swsOutput[0];
+    dstPlanes[1] = dstPlanes[0] + (width * height);
+    dstPlanes[2] = dstPlanes[1] + ((width / 2) * (height / 2));
+
+    int dstStrides[3];
+    dstStrides[0] = width;
+    dstStrides[1] = width / 2;
+    dstStrides[2] = width / 2;
+
+    uint64_t clockStart = XMonoClock::GetTime();
+
+    for( int i = 0; i < iterations; i++ )
+        sws_scale( scaler, srcPlanes, srcStrides, 0, height, dstPlanes, dstStrides );
+
+    double swsSeconds = XMonoClock::GetElapsedTime( clockStart, XMonoClock::GetTime() );
+
+    uint8_t* fastPlanes[3];
+    fastPlanes[0] = &fastOutput[0];
+    fastPlanes[1] = fastPlanes[0] + (width * height);
+    fastPlanes[2] = fastPlanes[1] + ((width / 2) * (height / 2));
+
+    size_t fastPitches[3];
+    fastPitches[0] = width;
+    fastPitches[1] = width / 2;
+    fastPitches[2] = width / 2;
+
+    clockStart = XMonoClock::GetTime();
+
+    for( int i = 0; i < iterations; i++ )
+        NV12ToI420( &y[0], pitch, &uv[0], pitch, width, height, fastPlanes, fastPitches );
+
+    double fastSeconds = XMonoClock::GetElapsedTime( clockStart, XMonoClock::GetTime() );
+
+    sws_freeContext( scaler );
+
+    bool match = (memcmp( &swsOutput[0], &fastOutput[0], outputSize ) == 0);
+
+    printf( "%ux%u kernel=%s sws_ms=%.3f nv12toi420_ms=%.3f speedup=%.2f match=%s\n",
+            width,
+            height,
+            GetConvertKernelName(),
+            (swsSeconds * 1000.0) / iterations,
+            (fastSeconds * 1000.0) / iterations,
+            (fastSeconds > 0.0) ? swsSeconds / fastSeconds : 0.0,
+            (match) ? "yes" : "no" );
+    fflush(stdout);
+
+    if( argc >= 6 )
+    {
+        uint16_t outputWidth = (uint16_t)XString( argv[4] ).ToInt();
+        uint16_t outputHeight = (uint16_t)XString( argv[5] ).ToInt();
+
+        if( outputWidth < 2 || outputHeight < 2 || (outputWidth % 2) != 0 || (outputHeight % 2) != 0 )
+        {
+            printf("Output width and height must be even and at least 2.\n");
+            fflush(stdout);
+            exit(1);
+        }
+
+        BenchScaled( &y[0], &uv[0], pitch, width, height, outputWidth, outputHeight, iterations );
+    }
+
+    return (match) ? 0 : 1;
+}
@@ -49,6 +49,7 @@ int main( int argc, char* argv[] )
     int fps = XString( argv[2] ).ToInt();
     bool useHW = (XString( argv[3] ).Contains( "yes" )) ? true : false;
     bool scale = (XString( argv[4] ).Contains( "yes" )) ? true : false;
+    bool fastScaler = (argc > 5 && XString( argv[5] ).Contains( "fast" )) ? true : false;
 
     int64_t sleepMicros = 1000000 / fps;
 
@@ -56,7 +57,12 @@ int main( int argc, char* argv[] )
 
     XRef<Decoder> decoder;
     if( useHW )
-        decoder = new VAH264Decoder( GetFastH264DecoderOptions( "/dev/dri/card0" ) );
+    {
+        VAH264Decoder* vaDecoder = new VAH264Decoder( GetFastH264DecoderOptions( "/dev/dri/card0" ) );
+        if( fastScaler )
+            vaDecoder->SetScaler( SCALER_FAST );
+        decoder = vaDecoder;
+    }
     else decoder = new H264Decoder( GetFastH264DecoderOptions() );
 
     decoder->SetOutputWidth( 1152 );
@@ -0,0 +1,314 @@
+
+#include "XSDK/XIRef.h"
+#include "XSDK/XString.h"
+#include "XSDK/XMemory.h"
+#include "XSDK/XThread.h"
+#include "XSDK/TimeUtils.h"
+#include "AVKit/Options.h"
+#include "AVKit/Packet.h"
+#include "AVKit/Locky.h"
+#include "VAKit/VAH264Encoder.h"
+#include "VAKit/NALTypes.h"
+#include "MediaParser/MediaParser.h"
+
+#include <vector>
+
+using namespace XSDK;
+using namespace AVKit;
+using namespace VAKit;
+using namespace std;
+
+static bool HasStartCode( const uint8_t* p, size_t size )
+{
+    return (size > 4 && p[0] == 0 && p[1] == 0 && p[2] == 0 && p[3] == 1);
+}
+
+static bool CheckSPS( const uint8_t* p, size_t size, uint16_t width, uint16_t height )
+{
+    MEDIA_PARSER::H264Info h264Info;
+
+    if( !MEDIA_PARSER::MediaParser::GetMediaInfo( p, size, h264Info ) )
+        return false;
+
+    return (h264Info.GetFrameWidth() == width && h264Info.GetFrameHeight() == height);
+}
+
+static const int NUM_PICTURES = 8;
+
+class EncodeThread : public XThread
+{
+public:
+    EncodeThread( const XString& devicePath, uint16_t width, uint16_t height, int frames ) :
+        XThread( "EncodeThread" ),
+        _devicePath( devicePath ),
+        _width( width ),
+        _height( height ),
+        _frames( frames ),
+        _errors( 0 ),
+        _framesEncoded( 0 ),
+        _pictures(),
+        _encoder( NULL ),
+        _sps(),
+        _haveSPS( false ),
+        _haveFrame( false ),
+        _lastFrameNum( 0 ),
+        _lastWasReference( false ),
+        _lastWasIDR( false ),
+        _lastPOC( 0 ),
+        _lastIDRPicID( 0 )
+    {
+        // A diagonal ramp that moves every frame keeps the encoder from treating
+        // the input as static content. The pictures are generated up front so that
+        // filling them is not part of the measured time.
+        size_t picSize = (_width * _height * 3) / 2;
+
+        for( int i = 0; i < NUM_PICTURES; i++ )
+        {
+            XIRef<Packet> pic = new Packet( picSize );
+            pic->SetDataSize( picSize );
+
+            uint8_t* y = pic->Map();
+            for( uint16_t row = 0; row < _height; row++ )
+                for( uint16_t col = 0; col < _width; col++ )
+                    *y++ = (uint8_t)(row + col + (i * 4));
+            memset( pic->Map() + (_width * _height), 128, picSize - (_width * _height) );
+
+            _pictures.push_back( pic );
+        }
+
+        // Likewise bringing the encoder up is not part of encoding.
+        struct CodecOptions options;
+        options.device_path = _devicePath;
+        options.width = _width;
+        options.height = _height;
+        options.bit_rate = 2000000;
+        options.gop_size = 15;
+        options.time_base_num = 1;
+        options.time_base_den = 30;
+
+        try
+        {
+            _encoder = new VAH264Encoder( options );
+        }
+        catch( XException& ex )
+        {
+            printf( "Unable to create encoder: %s\n", ex.what() );
+            _errors++;
+        }
+    }
+
+    virtual ~EncodeThread() throw()
+    {
+        delete _encoder;
+    }
+
+    virtual void* EntryPoint()
+    {
+        if( !_encoder )
+            return NULL;
+
+        try
+        {
+            for( int i = 0; i < _frames; i++ )
+            {
+                _encoder->EncodeYUV420P( _pictures[i % NUM_PICTURES] );
+
+                XIRef<Packet> output = _encoder->Get();
+
+                if( !HasStartCode( output->Map(), output->GetDataSize() ) || !_CheckFrame( output ) )
+                    _errors++;
+
+                _framesEncoded++;
+            }
+
+            XIRef<XMemory> extraData = _encoder->GetExtraData();
+
+            if( !CheckSPS( extraData->Map(), extraData->GetDataSize(), _width, _height ) )
+                _errors++;
+        }
+        catch( XException& ex )
+        {
+            printf( "Encoder failed: %s\n", ex.what() );
+            _errors++;
+        }
+
+        return NULL;
+    }
+
+    int GetErrors() const { return _errors; }
+    int GetFramesEncoded() const { return _framesEncoded; }
+
+private:
+    // IDRs must carry an SPS for the requested resolution (other I frames do not
+    // repeat it). Every frame's frame_num must follow the last one's (restarting at
+    // 0 on an IDR), its POC must move forward (there are no B frames), and back to
+    // back IDRs need different idr_pic_ids.
+    bool _CheckFrame( XIRef<Packet> output )
+    {
+        vector<NALUnit> units;
+        FindNALUnits( output->Map(), output->GetDataSize(), units );
+
+        bool sawSPS = false;
+
+        for( size_t i = 0; i < units.size(); i++ )
+        {
+            const NALUnit& unit = units[i];
+
+            if( unit.type == NAL_SPS )
+            {
+                if( !ParseSPS( unit, _sps ) || !CheckSPS( unit.start, (unit.data + unit.size) - unit.start, _width, _height ) )
+                    return false;
+
+                _haveSPS = true;
+                sawSPS = true;
+            }
+            else if( unit.type == NAL_IDR || unit.type == NAL_NON_IDR )
+            {
+                if( unit.type == NAL_IDR && !sawSPS )
+                    return false;
+
+                return _CheckSlice( unit );
+            }
+        }
+
+        // No slice at all.
+        return false;
+    }
+
+    bool _CheckSlice( const NALUnit& unit )
+    {
+        SliceInfo slice;
+
+        if( !_haveSPS || !ParseSliceHeader( unit, _sps, slice ) )
+            return false;
+
+        bool idr = (unit.type == NAL_IDR);
+        uint32_t maxFrameNum = 1u << _sps.log2MaxFrameNum;
+        uint32_t maxPOC = 1u << _sps.log2MaxPicOrderCntLsb;
+
+        bool ok = true;
+
+        if( idr )
+        {
+            if( slice.frameNum != 0 )
+                ok = false;
+
+            if( _haveFrame && _lastWasIDR && slice.idrPicID == _lastIDRPicID )
+                ok = false;
+
+            _lastIDRPicID = slice.idrPicID;
+        }
+        else
+        {
+            uint32_t expected = (_lastWasReference) ? (_lastFrameNum + 1) % maxFrameNum : _lastFrameNum;
+
+            if( !_haveFrame || slice.frameNum != expected )
+                ok = false;
+
+            // The difference modulo the POC range, which must be a step forward.
+            uint32_t step = (slice.picOrderCntLsb - _lastPOC) & (maxPOC - 1);
+
+            if( _sps.picOrderCntType == 0 && (step == 0 || step >= maxPOC / 2) )
+                ok = false;
+        }
+
+        _haveFrame = true;
+        _lastFrameNum = slice.frameNum;
+        _lastWasReference = (unit.refIDC != 0);
+        _lastWasIDR = idr;
+        _lastPOC = slice.picOrderCntLsb;
+
+        return ok;
+    }
+
+    XString _devicePath;
+    uint16_t _width;
+    uint16_t _height;
+    int _frames;
+    int _errors;
+    int _framesEncoded;
+    vector<XIRef<Packet> > _pictures;
+    VAH264Encoder* _encoder;
+    SPSInfo _sps;
+    bool _haveSPS;
+    bool _haveFrame;
+    uint32_t _lastFrameNum;
+    bool _lastWasReference;
+    bool _lastWasIDR;
+    uint32_t _lastPOC;
+    uint32_t _lastIDRPicID;
+};
+
+int main( int argc, char* argv[] )
+{
+    if( argc < 6 )
+    {
+        printf("Invalid args.\n");
+        fflush(stdout);
+        exit(1);
+    }
+
+    XString devicePath = argv[1];
+    uint16_t width = (uint16_t)XString( argv[2] ).ToInt();
+    uint16_t height = (uint16_t)XString( argv[3] ).ToInt();
+    int frames = XString( argv[4] ).ToInt();
+    int maxEncoders = XString( argv[5] ).ToInt();
+
+    Locky::RegisterFFMPEG();
+
+    if( !VAH264Encoder::HasHW( devicePath ) )
+    {
+        printf("No H.264 encode support on %s.\n", devicePath.c_str());
+        exit(1);
+    }
+
+    double singleFPS = 0.0;
+    int totalErrors = 0;
+
+    for( int n = 1; n <= maxEncoders; n++ )
+    {
+        vector<EncodeThread*> threads;
+
+        for( int i = 0; i < n; i++ )
+            threads.push_back( new EncodeThread( devicePath, width, height, frames ) );
+
+        uint64_t clockStart = XMonoClock::GetTime();
+
+        for( int i = 0; i < n; i++ )
+            threads[i]->Start();
+
+        int errors = 0, framesEncoded = 0;
+
+        for( int i = 0; i < n; i++ )
+            threads[i]->Join();
+
+        double elapsed = XMonoClock::GetElapsedTime( clockStart, XMonoClock::GetTime() );
+
+        // Deleting a thread tears its encoder down, which is not part of the timing.
+        for( int i = 0; i < n; i++ )
+        {
+            errors += threads[i]->GetErrors();
+            framesEncoded += threads[i]->GetFramesEncoded();
+            delete threads[i];
+        }
+
+        double fps = (elapsed > 0.0) ? framesEncoded / elapsed : 0.0;
+
+        if( n == 1 )
+            singleFPS = fps;
+
+        printf( "encoders=%d aggregate_fps=%.1f fps_per_encoder=%.1f scaling=%.2f errors=%d\n",
+                n,
+                fps,
+                fps / n,
+                (singleFPS > 0.0) ? fps / singleFPS : 0.0,
+                errors );
+        fflush(stdout);
+
+        totalErrors += errors;
+    }
+
+    Locky::UnregisterFFMPEG();
+
+    return (totalErrors == 0) ? 0 : 1;
+}
@@ -0,0 +1,246 @@
+
+#include "XSDK/XIRef.h"
+#include "XSDK/XString.h"
+#include "XSDK/XMemory.h"
+#include "XSDK/XMutex.h"
+#include "XSDK/XGuard.h"
+#include "XSDK/TimeUtils.h"
+#include "AVKit/AVDeMuxer.h"
+#include "AVKit/Options.h"
+#include "AVKit/Packet.h"
+#include "AVKit/Locky.h"
+#include "VAKit/VAH264Decoder.h"
+#include "VAKit/VADecodeScheduler.h"
+
+#include <map>
+#include <vector>
+
+using namespace XSDK;
+using namespace AVKit;
+using namespace VAKit;
+using namespace std;
+
+class StreamStats : public VADecodeScheduler::Callback
+{
+public:
+    StreamStats() :
+        _lock(),
+        _submitted(),
+        _decoded( 0 ),
+        _errors( 0 ),
+        _maxLatency( 0.0 ),
+        _totalLatency( 0.0 )
+    {
+    }
+
+    virtual ~StreamStats() throw() {}
+
+    void Submitted( int64_t pts )
+    {
+        XGuard g( _lock );
+        _submitted[pts] = XMonoClock::GetTime();
+    }
+
+    virtual void OnPicture( int stream, XIRef<Packet> picture, int64_t pts, bool key )
+    {
+        XGuard g( _lock );
+
+        map<int64_t, uint64_t>::iterator found = _submitted.find( pts );
+        if( found == _submitted.end() )
+            return;
+
+        double latency = XMonoClock::GetElapsedTime( found->second, XMonoClock::GetTime() );
+        _submitted.erase( found );
+
+        _decoded++;
+        _totalLatency += latency;
+        if( latency > _maxLatency )
+            _maxLatency = latency;
+    }
+
+    virtual void OnError( int stream, const XString& error )
+    {
+        XGuard g( _lock );
+        _errors++;
+    }
+
+    virtual void OnDropped( int stream, int64_t pts, VADecodeScheduler::ShedLevel level )
+    {
+        XGuard g( _lock );
+        _submitted.erase( pts );
+    }
+
+    size_t GetDecoded() { XGuard g( _lock ); return _decoded; }
+    size_t GetErrors() { XGuard g( _lock ); return _errors; }
+    double GetMaxLatency() { XGuard g( _lock ); return _maxLatency; }
+    double GetAvgLatency() { XGuard g( _lock ); return (_decoded > 0) ? _totalLatency / _decoded : 0.0; }
+
+private:
+    XMutex _lock;
+    map<int64_t, uint64_t> _submitted;
+    size_t _decoded;
+    size_t _errors;
+    double _maxLatency;
+    double _totalLatency;
+};
+
+static void LoadPackets( const XString& fileName, vector<XIRef<Packet> >& packets )
+{
+    AVDeMuxer deMuxer( fileName );
+
+    int videoStreamIndex = deMuxer.GetVideoStreamIndex();
+    int streamIndex = -1;
+
+    while( deMuxer.ReadFrame( streamIndex ) )
+    {
+        if( streamIndex == videoStreamIndex )
+            packets.push_back( deMuxer.Get() );
+    }
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc < 8 )
+    {
+        printf("Invalid args.\n");
+        fflush(stdout);
+        exit(1);
+    }
+
+    XString inputFileName = argv[1];
+    XString devicePath = argv[2];
+    int numStreams = XString( argv[3] ).ToInt();
+    int numWorkers = XString( argv[4] ).ToInt();
+    int fps = XString( argv[5] ).ToInt();
+    int seconds = XString( argv[6] ).ToInt();
+    double budget = XString( argv[7] ).ToInt() / 1000.0;
+
+    Locky::RegisterFFMPEG();
+
+    vector<XIRef<Packet> > packets;
+    LoadPackets( inputFileName, packets );
+
+    if( packets.empty() )
+    {
+        printf("No video packets in %s.\n", inputFileName.c_str());
+        exit(1);
+    }
+
+    int ret = 0;
+
+    {
+        VADecodeScheduler scheduler( numWorkers );
+
+        vector<VAH264Decoder*> decoders;
+        vector<StreamStats*> stats;
+        vector<int> streams;
+        vector<size_t> maxQueued( numStreams, 0 );
+
+        for( int i = 0; i < numStreams; i++ )
+        {
+            decoders.push_back( new VAH264Decoder( GetFastH264DecoderOptions( devicePath ) ) );
+            stats.push_back( new StreamStats() );
+            streams.push_back( scheduler.AddStream( decoders.back(), stats.back() ) );
+            scheduler.SetLatencyBudget( streams.back(), budget );
+        }
+
+        // Every stream gets a packet every frame interval, whether or not the workers
+        // are keeping up. Each stream replays the file from its beginning, so that
+        // every stream starts at an IDR.
+        int64_t frameMicros = 1000000 / fps;
+        int64_t numFrames = (int64_t)fps * seconds;
+
+        uint64_t start = XMonoClock::GetTime();
+
+        for( int64_t frame = 0; frame < numFrames; frame++ )
+        {
+            XIRef<Packet> pkt = packets[frame % packets.size()];
+
+            for( int i = 0; i < numStreams; i++ )
+            {
+                stats[i]->Submitted( frame );
+                scheduler.Submit( streams[i], pkt, frame );
+
+                size_t queued = scheduler.GetQueuedPackets( streams[i] );
+                if( queued > maxQueued[i] )
+                    maxQueued[i] = queued;
+            }
+
+            int64_t elapsedMicros = (int64_t)(XMonoClock::GetElapsedTime( start, XMonoClock::GetTime() ) * 1000000);
+            int64_t wait = ((frame + 1) * frameMicros) - elapsedMicros;
+
+            if( wait > 0 )
+                x_usleep( (unsigned int)wait );
+        }
+
+        // Once the overload is over every stream has to get back to decoding
+        // everything. Let the queues drain, then replay the start of the file (from
+        // its IDR) one packet at a time, so every packet is on time.
+        for( int i = 0; i < numStreams; i++ )
+        {
+            while( scheduler.GetQueuedPackets( streams[i] ) > 0 )
+                x_usleep( 1000 );
+        }
+
+        int64_t numRecoveryFrames = ((size_t)fps < packets.size()) ? fps : (int64_t)packets.size();
+
+        for( int64_t frame = 0; frame < numRecoveryFrames; frame++ )
+        {
+            for( int i = 0; i < numStreams; i++ )
+            {
+                stats[i]->Submitted( numFrames + frame );
+                scheduler.Submit( streams[i], packets[frame], numFrames + frame );
+
+                while( scheduler.GetQueuedPackets( streams[i] ) > 0 )
+                    x_usleep( 1000 );
+            }
+        }
+
+        printf("stream, submitted, decoded, non ref dropped, non key dropped, late, max queued, avg latency, max latency\n");
+
+        for( int i = 0; i < numStreams; i++ )
+        {
+            struct VADecodeScheduler::SheddingStats shedding = scheduler.GetSheddingStats( streams[i] );
+
+            scheduler.RemoveStream( streams[i] );
+
+            printf("%d, %lld, %u, %u, %u, %u, %u, %f, %f\n",
+                   i,
+                   (long long)(numFrames + numRecoveryFrames),
+                   (unsigned int)stats[i]->GetDecoded(),
+                   (unsigned int)shedding.nonReferenceDropped,
+                   (unsigned int)shedding.nonKeyDropped,
+                   (unsigned int)shedding.latePackets,
+                   (unsigned int)maxQueued[i],
+                   stats[i]->GetAvgLatency(),
+                   stats[i]->GetMaxLatency());
+
+            // Shedding should keep every stream's latency bounded. A stream whose
+            // IDRs alone exceed its share of the workers can not be saved by it.
+            if( stats[i]->GetMaxLatency() > (budget * 4) )
+            {
+                printf("stream %d: max latency %f exceeds 4x the latency budget.\n", i, stats[i]->GetMaxLatency());
+                ret = 1;
+            }
+
+            if( shedding.level == VADecodeScheduler::SHED_TO_IDR )
+            {
+                printf("stream %d: still dropping pictures until the next IDR after catching up.\n", i);
+                ret = 1;
+            }
+
+            if( stats[i]->GetErrors() > 0 )
+            {
+                printf("stream %d: %u decode errors.\n", i, (unsigned int)stats[i]->GetErrors());
+                ret = 1;
+            }
+
+            delete decoders[i];
+            delete stats[i];
+        }
+    }
+
+    Locky::UnregisterFFMPEG();
+
+    return ret;
+}